@@ -0,0 +1,134 @@
+#include "batch.h"
+
+/*
+ * Work stealing over the translation units of a batch.
+ *
+ * Every worker starts with a contiguous range of units. The owner takes
+ * units from the top of its range and idle workers steal from the bottom;
+ * both ends are packed into one word so that either side is a single CAS.
+ * Diagnostics and dependency rules of each unit are captured in memory and
+ * written in input order after all the workers finished.
+ */
+
+#define BATCH_RANGE(top, bottom) (((uint64_t) (top) << 32) | (uint32_t) (bottom))
+
+int take_batch_unit(struct batch_worker *worker) {
+  uint64_t range = atomic_load(&worker->range);
+  while(1) {
+    uint32_t top = range >> 32, bottom = (uint32_t) range;
+    if(top >= bottom) return -1;
+    if(atomic_compare_exchange_weak(&worker->range, &range, BATCH_RANGE(top + 1, bottom))) {
+      return top;
+    }
+  }
+}
+
+int steal_batch_unit(struct batch_worker *victim) {
+  uint64_t range = atomic_load(&victim->range);
+  while(1) {
+    uint32_t top = range >> 32, bottom = (uint32_t) range;
+    if(top >= bottom) return -1;
+    if(atomic_compare_exchange_weak(&victim->range, &range, BATCH_RANGE(top, bottom - 1))) {
+      return bottom - 1;
+    }
+  }
+}
+
+void run_batch_unit(struct batch_worker *worker, struct batch_unit *unit) {
+  FILE *messages = open_memstream(&unit->messages, &unit->messages_size);
+  FILE *rules = open_memstream(&unit->rules, &unit->rules_size);
+  if(messages == NULL || rules == NULL) {
+    perror("open_memstream");
+    exit(1);
+  }
+
+  error_stream = messages;
+  worker->ctx->dependencies->options.stream = rules;
+  unit->status = worker->batch->preprocess(worker->ctx, unit, worker->batch->data);
+  worker->ctx->dependencies->options.stream = NULL;
+  error_stream = NULL;
+
+  fclose(messages);
+  fclose(rules);
+}
+
+void *run_batch_worker(void *arg) {
+  struct batch_worker *worker = (struct batch_worker *) arg;
+  struct batch *batch = worker->batch;
+  int self = worker - batch->workers;
+
+  while(1) {
+    int index = take_batch_unit(worker);
+    for(int i = 1; index < 0 && i < batch->threads; i++) {
+      index = steal_batch_unit(&batch->workers[(self + i) % batch->threads]);
+    }
+    // units are never added, so all the ranges are empty
+    if(index < 0) break;
+
+    run_batch_unit(worker, &batch->units[index]);
+  }
+
+  return NULL;
+}
+
+// the calling thread works with ctx; the others get worker contexts sharing its caches
+void work_batch(struct skcc_context *ctx, struct batch_unit *units, int size, int threads, batch_function preprocess, void *data) {
+  if(threads > size) threads = size;
+  if(threads < 1) threads = 1;
+
+  struct batch batch;
+  batch.units = units;
+  batch.size = size;
+  batch.threads = threads;
+  batch.preprocess = preprocess;
+  batch.data = data;
+  batch.workers = (struct batch_worker *) calloc(threads, sizeof(struct batch_worker));
+  if(batch.workers == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+
+  for(int i = 0; i < threads; i++) {
+    struct batch_worker *worker = &batch.workers[i];
+    worker->batch = &batch;
+    worker->ctx = i == 0 ? ctx : allocate_skcc_worker_context(ctx);
+    atomic_init(&worker->range, BATCH_RANGE((long) size * i / threads, (long) size * (i + 1) / threads));
+  }
+
+  for(int i = 1; i < threads; i++) {
+    if(pthread_create(&batch.workers[i].thread, NULL, run_batch_worker, &batch.workers[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  run_batch_worker(&batch.workers[0]);
+  for(int i = 1; i < threads; i++) {
+    pthread_join(batch.workers[i].thread, NULL);
+    free_skcc_context(batch.workers[i].ctx);
+  }
+  free(batch.workers);
+}
+
+// write the captured output in input order; returns 1 if a unit failed
+int replay_batch(struct batch_unit *units, int size) {
+  int status = 0;
+  for(int i = 0; i < size; i++) {
+    fwrite(units[i].messages, 1, units[i].messages_size, stderr);
+    fwrite(units[i].rules, 1, units[i].rules_size, stdout);
+    free(units[i].messages);
+    free(units[i].rules);
+    units[i].messages = NULL;
+    units[i].rules = NULL;
+    if(units[i].status != 0) {
+      status = 1;
+    }
+  }
+  fflush(stdout);
+
+  return status;
+}
+
+int run_batch(struct skcc_context *ctx, struct batch_unit *units, int size, int threads, batch_function preprocess, void *data) {
+  work_batch(ctx, units, size, threads, preprocess, data);
+  return replay_batch(units, size);
+}
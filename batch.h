@@ -0,0 +1,45 @@
+#ifndef __BATCH_INCLUDE__
+#define __BATCH_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "preprocess.h"
+
+struct batch_unit {
+  char *source;
+  char *output;
+  int status;
+  char *messages;
+  size_t messages_size;
+  char *rules;
+  size_t rules_size;
+};
+
+typedef int (*batch_function)(struct skcc_context *ctx, struct batch_unit *unit, void *data);
+
+struct batch;
+
+struct batch_worker {
+  struct batch *batch;
+  struct skcc_context *ctx;
+  pthread_t thread;
+  _Atomic uint64_t range;
+};
+
+struct batch {
+  struct batch_unit *units;
+  int size;
+  struct batch_worker *workers;
+  int threads;
+  batch_function preprocess;
+  void *data;
+};
+
+extern void work_batch(struct skcc_context *ctx, struct batch_unit *units, int size, int threads, batch_function preprocess, void *data);
+extern int replay_batch(struct batch_unit *units, int size);
+extern int run_batch(struct skcc_context *ctx, struct batch_unit *units, int size, int threads, batch_function preprocess, void *data);
+
+#endif
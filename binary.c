@@ -0,0 +1,203 @@
+#include "binary.h"
+#include "preprocess.h"
+
+/* power of 2 */
+#define ATOM_TABLE_INIT_SIZE 4096
+
+struct atom_entry {
+  uint32_t hash;
+  uint32_t index;
+};
+
+struct token_stream {
+  struct atom_entry *table;
+  long table_size;
+  uint32_t *offsets;
+  long atom_count;
+  long offsets_alloc;
+  char *strings;
+  long strings_size;
+  long strings_alloc;
+  struct token_record *records;
+  long record_count;
+  long records_alloc;
+  int lines;
+  int space;
+  const unsigned char *last_file;
+  uint32_t last_file_atom;
+};
+
+void *grow_array(void *array, long *alloc, long size, long element) {
+  if(size <= *alloc) return array;
+
+  long alloc_size = *alloc == 0 ? 1024 : *alloc;
+  while(alloc_size < size) alloc_size *= 2;
+
+  array = realloc(array, element * alloc_size);
+  if(array == NULL) {
+    perror("realloc");
+    exit(1);
+  }
+  *alloc = alloc_size;
+  return array;
+}
+
+struct atom_entry *allocate_atom_table(long size) {
+  struct atom_entry *table = (struct atom_entry *) calloc(size, sizeof(struct atom_entry));
+  if(table == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  return table;
+}
+
+struct token_stream *allocate_token_stream() {
+  struct token_stream *stream = (struct token_stream *) calloc(1, sizeof(struct token_stream));
+  if(stream == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  stream->table = allocate_atom_table(ATOM_TABLE_INIT_SIZE);
+  stream->table_size = ATOM_TABLE_INIT_SIZE;
+  return stream;
+}
+
+void free_token_stream(struct token_stream *stream) {
+  free(stream->table);
+  free(stream->offsets);
+  free(stream->strings);
+  free(stream->records);
+  free(stream);
+}
+
+// atom table: spellings are interned into the string table, index 0 of the table means empty
+uint32_t atom_hash(const unsigned char *text, int size) {
+  uint32_t h = 2166136261u;
+  for(int i = 0; i < size; i++) {
+    h = (h ^ text[i]) * 16777619u;
+  }
+  return h;
+}
+
+void rehash_atom_table(struct token_stream *stream) {
+  long size = stream->table_size * 2;
+  struct atom_entry *table = allocate_atom_table(size);
+
+  for(long i = 0; i < stream->table_size; i++) {
+    if(stream->table[i].index == 0) continue;
+    long h = stream->table[i].hash & (size - 1);
+    while(table[h].index != 0) h = (h + 1) & (size - 1);
+    table[h] = stream->table[i];
+  }
+
+  free(stream->table);
+  stream->table = table;
+  stream->table_size = size;
+}
+
+uint32_t intern_atom(struct token_stream *stream, const unsigned char *text, int size) {
+  uint32_t hash = atom_hash(text, size);
+  long h = hash & (stream->table_size - 1);
+
+  while(stream->table[h].index != 0) {
+    struct atom_entry *entry = &stream->table[h];
+    const char *atom = &stream->strings[stream->offsets[entry->index - 1]];
+    if(entry->hash == hash && memcmp(atom, text, size) == 0 && atom[size] == '\0') {
+      return entry->index - 1;
+    }
+    h = (h + 1) & (stream->table_size - 1);
+  }
+
+  stream->offsets = grow_array(stream->offsets, &stream->offsets_alloc, stream->atom_count + 1, sizeof(uint32_t));
+  stream->strings = grow_array(stream->strings, &stream->strings_alloc, stream->strings_size + size + 1, sizeof(char));
+  stream->offsets[stream->atom_count] = stream->strings_size;
+  memcpy(&stream->strings[stream->strings_size], text, size);
+  stream->strings[stream->strings_size + size] = '\0';
+  stream->strings_size += size + 1;
+
+  stream->table[h].hash = hash;
+  stream->table[h].index = ++stream->atom_count;
+  if(stream->atom_count * 2 > stream->table_size) {
+    rehash_atom_table(stream);
+  }
+
+  return stream->atom_count - 1;
+}
+
+// records
+void append_token_record(struct token_stream *stream, struct pp_token *token) {
+  stream->records = grow_array(stream->records, &stream->records_alloc, stream->record_count + 1, sizeof(struct token_record));
+  struct token_record *record = &stream->records[stream->record_count++];
+
+  record->type = token->type;
+  record->flags = (stream->space ? TOKEN_SPACE : 0) | (token->persistent ? TOKEN_MACRO : 0);
+  record->lines = stream->lines;
+  record->atom = intern_atom(stream, token->text->head, token->text->size);
+  record->offset = token->offset;
+
+  if(token->file == NULL) {
+    record->file = TOKEN_NO_FILE;
+  } else {
+    if(token->file != stream->last_file) {
+      stream->last_file = token->file;
+      stream->last_file_atom = intern_atom(stream, token->file, strlen(token->file));
+    }
+    record->file = stream->last_file_atom;
+  }
+
+  stream->lines = 0;
+  stream->space = 0;
+}
+
+void write_token_stream_sink(struct pp_sink *sink, struct pp_list *list) {
+  struct token_stream *stream = (struct token_stream *) sink->data;
+
+  for(struct pp_node *node = list->head; node != NULL; node = node->next) {
+    struct pp_token *token = node->token;
+
+    // fold new lines and a following space into the next record
+    if(token->type == PP_NEW_LINE && !stream->space && stream->lines < 0xffff) {
+      stream->lines++;
+    } else if(token->type == PP_SPACE && !stream->space) {
+      stream->space = 1;
+    } else {
+      append_token_record(stream, token);
+    }
+  }
+}
+
+struct pp_sink *allocate_token_stream_sink(struct token_stream *stream) {
+  return allocate_pp_sink(write_token_stream_sink, stream, 0);
+}
+
+void finish_token_stream(struct token_stream *stream, struct output *out) {
+  // trailing white spaces are kept by an empty record
+  if(stream->lines > 0 || stream->space) {
+    struct pp_token *token = allocate_pp_token();
+    token->type = PP_NONE;
+    token->name = pp_token_name[PP_NONE];
+    append_token_record(stream, token);
+    free_pp_token(token);
+  }
+
+  const unsigned char padding[4] = { 0, 0, 0, 0 };
+  long padding_size = (4 - stream->strings_size % 4) % 4;
+
+  struct token_stream_header header;
+  memcpy(header.magic, TOKEN_STREAM_MAGIC, 4);
+  header.version = TOKEN_STREAM_VERSION;
+  header.atom_count = stream->atom_count;
+  header.record_count = stream->record_count;
+  header.atom_offset = sizeof(struct token_stream_header);
+  header.string_offset = header.atom_offset + sizeof(uint32_t) * (stream->atom_count + 1);
+  header.record_offset = header.string_offset + stream->strings_size + padding_size;
+  header.size = header.record_offset + sizeof(struct token_record) * stream->record_count;
+
+  uint32_t end = stream->strings_size;
+  write_output(out, (unsigned char *) &header, sizeof(header));
+  write_output(out, (unsigned char *) stream->offsets, sizeof(uint32_t) * stream->atom_count);
+  write_output(out, (unsigned char *) &end, sizeof(end));
+  write_output(out, (unsigned char *) stream->strings, stream->strings_size);
+  write_output(out, padding, padding_size);
+  write_output(out, (unsigned char *) stream->records, sizeof(struct token_record) * stream->record_count);
+}
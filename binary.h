@@ -0,0 +1,56 @@
+#ifndef __BINARY_INCLUDE__
+#define __BINARY_INCLUDE__
+
+#include <stdint.h>
+
+/*
+ * binary token stream (native little-endian, 4-byte aligned)
+ *
+ *   struct token_stream_header
+ *   uint32_t atom offsets[atom_count + 1]   offsets into the string table
+ *   string table                            NUL terminated spellings, padded to 4 bytes
+ *   struct token_record[record_count]
+ *
+ * White spaces are folded into the next record: "lines" new lines and then
+ * a space if TOKEN_SPACE is set. Other white space sequences are kept as
+ * records of their own.
+ */
+
+#define TOKEN_STREAM_MAGIC "SKTS"
+#define TOKEN_STREAM_VERSION 1
+
+#define TOKEN_NO_FILE 0xffffffff
+
+#define TOKEN_SPACE 0x01
+#define TOKEN_MACRO 0x02
+
+struct token_stream_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t atom_count;
+  uint32_t record_count;
+  uint32_t atom_offset;
+  uint32_t string_offset;
+  uint32_t record_offset;
+  uint32_t size;
+};
+
+struct token_record {
+  uint8_t type;
+  uint8_t flags;
+  uint16_t lines;
+  uint32_t atom;
+  uint32_t file;
+  uint32_t offset;
+};
+
+struct pp_sink;
+struct output;
+struct token_stream;
+
+extern struct token_stream *allocate_token_stream();
+extern struct pp_sink *allocate_token_stream_sink(struct token_stream *stream);
+extern void finish_token_stream(struct token_stream *stream, struct output *out);
+extern void free_token_stream(struct token_stream *stream);
+
+#endif
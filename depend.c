@@ -0,0 +1,151 @@
+#include "depend.h"
+
+struct dependencies *allocate_dependencies() {
+  struct dependencies *dependencies = (struct dependencies *) calloc(1, sizeof(struct dependencies));
+  if(dependencies == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  reset_dependency_options(&dependencies->options);
+  return dependencies;
+}
+
+void reset_dependency_options(struct dependency_options *options) {
+  options->enabled = 0;
+  options->only = 0;
+  options->system = 1;
+  options->file = NULL;
+  options->target = NULL;
+  options->output = NULL;
+  options->stream = NULL;
+}
+
+void clear_dependencies(struct dependencies *dependencies) {
+  for(int i = 0; i < dependencies->size; i++) {
+    free_string(dependencies->paths[i]);
+  }
+  dependencies->size = 0;
+}
+
+void free_dependencies(struct dependencies *dependencies) {
+  clear_dependencies(dependencies);
+  free(dependencies->paths);
+  free(dependencies->system);
+  free(dependencies);
+}
+
+void add_dependency(struct dependencies *dependencies, struct string *path, int system) {
+  if(system && !dependencies->options.system) return;
+
+  for(int i = 0; i < dependencies->size; i++) {
+    if(strcmp(dependencies->paths[i]->head, path->head) == 0) return;
+  }
+
+  if(dependencies->size == dependencies->alloc_size) {
+    dependencies->alloc_size = dependencies->alloc_size == 0 ? 16 : dependencies->alloc_size * 2;
+    dependencies->paths = (struct string **) realloc(dependencies->paths, sizeof(struct string *) * dependencies->alloc_size);
+    dependencies->system = (int *) realloc(dependencies->system, sizeof(int) * dependencies->alloc_size);
+    if(dependencies->paths == NULL || dependencies->system == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+
+  struct string *copy = allocate_string();
+  concat_string(copy, path);
+  dependencies->paths[dependencies->size] = copy;
+  dependencies->system[dependencies->size++] = system;
+}
+
+// make target: the source file name without directories, with suffix replaced by ".o"
+struct string *default_target(const char *source, char *suffix) {
+  const char *base = source;
+  for(int i = 0; source[i]; i++) {
+    if(source[i] == '/') base = &source[i + 1];
+  }
+
+  int length = strlen(base);
+  for(int i = length - 1; i > 0; i--) {
+    if(base[i] == '.') {
+      length = i;
+      break;
+    }
+  }
+
+  struct string *target = allocate_string();
+  for(int i = 0; i < length; i++) {
+    append_string(target, base[i]);
+  }
+  write_string(target, suffix);
+  return target;
+}
+
+// -MD writes next to the output file, or next to the source when the output is the standard output
+struct string *dependency_file(const char *source, const char *output) {
+  const char *path = output != NULL ? output : source;
+  int length = strlen(path);
+  for(int i = length - 1; i >= 0 && path[i] != '/'; i--) {
+    if(path[i] == '.') {
+      length = i;
+      break;
+    }
+  }
+
+  struct string *file = allocate_string();
+  for(int i = 0; i < length; i++) {
+    append_string(file, path[i]);
+  }
+  write_string(file, ".d");
+  return file;
+}
+
+void write_dependency(FILE *fp, const char *path, int *column) {
+  int length = strlen(path);
+  if(*column + length + 1 > 76) {
+    fprintf(fp, " \\\n");
+    *column = 0;
+  }
+
+  fprintf(fp, " ");
+  for(int i = 0; path[i]; i++) {
+    if(path[i] == ' ') fputc('\\', fp);
+    fputc(path[i], fp);
+  }
+  *column += length + 1;
+}
+
+void write_dependencies(struct dependencies *dependencies, const char *source) {
+  FILE *fp = dependencies->options.stream != NULL ? dependencies->options.stream : stdout;
+  if(dependencies->options.file != NULL) {
+    fp = fopen(dependencies->options.file, "w");
+  } else if(!dependencies->options.only) {
+    struct string *file = dependency_file(source, dependencies->options.output);
+    fp = fopen(file->head, "w");
+    free_string(file);
+  }
+  if(fp == NULL) {
+    error("failed to open dependency file.\n");
+  }
+
+  struct string *target = allocate_string();
+  if(dependencies->options.target != NULL) {
+    write_string(target, dependencies->options.target);
+  } else {
+    struct string *t = default_target(source, ".o");
+    concat_string(target, t);
+    free_string(t);
+  }
+
+  fprintf(fp, "%s:", target->head);
+  int column = target->size + 1;
+  write_dependency(fp, source, &column);
+  for(int i = 0; i < dependencies->size; i++) {
+    write_dependency(fp, dependencies->paths[i]->head, &column);
+  }
+  fprintf(fp, "\n");
+
+  free_string(target);
+  if(fp != stdout && fp != dependencies->options.stream) {
+    fclose(fp);
+  }
+}
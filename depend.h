@@ -0,0 +1,35 @@
+#ifndef __DEPEND_INCLUDE__
+#define __DEPEND_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "string.h"
+
+struct dependency_options {
+  int enabled;
+  int only;
+  int system;
+  char *file;
+  char *target;
+  char *output;
+  FILE *stream;
+};
+
+struct dependencies {
+  struct dependency_options options;
+  struct string **paths;
+  int *system;
+  int size;
+  int alloc_size;
+};
+
+extern struct dependencies *allocate_dependencies();
+extern void reset_dependency_options(struct dependency_options *options);
+extern void clear_dependencies(struct dependencies *dependencies);
+extern void free_dependencies(struct dependencies *dependencies);
+extern void add_dependency(struct dependencies *dependencies, struct string *path, int system);
+extern void write_dependencies(struct dependencies *dependencies, const char *source);
+
+#endif
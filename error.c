@@ -1,10 +1,14 @@
 #include "error.h"
 
+_Thread_local jmp_buf *error_jump = NULL;
+_Thread_local FILE *error_stream = NULL;
+
 void print_diagnose(char *type, char *file, int line, char *format, va_list args) {
-  fprintf(stderr, "[%s] %s:%d\n", type, file, line);
-  vfprintf(stderr, format, args);
-  fprintf(stderr, "\n");
-  fprintf(stderr, "\n");
+  FILE *fp = error_stream != NULL ? error_stream : stderr;
+  fprintf(fp, "[%s] %s:%d\n", type, file, line);
+  vfprintf(fp, format, args);
+  fprintf(fp, "\n");
+  fprintf(fp, "\n");
 }
 
 void print_error(char *file, int line, char *format, ...) {
@@ -12,6 +16,9 @@ void print_error(char *file, int line, char *format, ...) {
   va_start(args, format);
   print_diagnose("error", file, line, format, args);
   va_end(args);
+  if(error_jump != NULL) {
+    longjmp(*error_jump, 1);
+  }
   exit(1);
 }
 
@@ -4,11 +4,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <setjmp.h>
 
 #define error(...) print_error(__FILE__, __LINE__, __VA_ARGS__)
 #define warning(...) print_warning(__FILE__, __LINE__, __VA_ARGS__)
 #define debug(...) print_debug(__FILE__, __LINE__, __VA_ARGS__)
 
+// when set, an error jumps here instead of exiting
+extern _Thread_local jmp_buf *error_jump;
+
+// diagnostics go here instead of the standard error when set
+extern _Thread_local FILE *error_stream;
+
 extern void print_error(char *file, int line, char *format, ...);
 extern void print_warning(char *file, int line, char *format, ...);
 extern void print_debug(char *file, int line, char *format, ...);
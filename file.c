@@ -1,125 +1,478 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
 #include "file.h"
+#include "string.h"
+#include "tokcache.h"
 
-struct source *allocate_source(const unsigned char *file) {
-  struct source *src = (struct source *) malloc(sizeof(struct source));
-  if(src == NULL) {
+unsigned char *read_file(int fd, int *size) {
+  int alloc_size = 4096;
+  unsigned char *buf = (unsigned char *) malloc(sizeof(unsigned char) * alloc_size);
+  if(buf == NULL) {
     perror("malloc");
     exit(1);
   }
 
-  src->fp = fopen(file, "r");
-  if(src->fp == NULL) {
-    perror("fopen");
+  *size = 0;
+  while(1) {
+    if(*size == alloc_size) {
+      alloc_size *= 2;
+      buf = (unsigned char *) realloc(buf, sizeof(unsigned char) * alloc_size);
+      if(buf == NULL) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    ssize_t n = read(fd, buf + *size, alloc_size - *size);
+    if(n < 0) {
+      perror("read");
+      exit(1);
+    }
+    if(n == 0) break;
+    *size += n;
+  }
+
+  return buf;
+}
+
+// decode and replace trigraphs, then splice lines; the result is what the lexer reads
+int replace_trigraphs(unsigned char *text, const unsigned char *file, const unsigned char *raw, int raw_size) {
+  unsigned char trigraph_symbol[9] = { '=', '(', '/', ')', '\'', '<', '!', '>', '-' };
+  unsigned char trigraph_char[9] = { '#', '[', '\\', ']', '^', '{', '|', '}', '~' };
+
+  int size = 0;
+  for(int i = 0; i < raw_size;) {
+    unsigned char c = raw[i];
+
+    if(c < 0x80) {
+      if(c == '?' && i + 2 < raw_size && raw[i + 1] == '?') {
+        int replaced = 0;
+        for(int j = 0; j < 9; j++) {
+          if(raw[i + 2] == trigraph_symbol[j]) {
+            text[size++] = trigraph_char[j];
+            replaced = 1;
+            break;
+          }
+        }
+        if(replaced) {
+          i += 3;
+          continue;
+        }
+      }
+      text[size++] = c;
+      i++;
+      continue;
+    }
+
+    struct utf8c uc;
+    uc.bytes = count_bytes(c);
+    if(uc.bytes == -1) {
+      error("source file \"%s\" contains invalid sequence.\n", file);
+    }
+    if(uc.bytes == 0) break;
+    for(int j = 0; j < uc.bytes; j++) {
+      uc.sequence[j] = i + j < raw_size ? raw[i + j] : 0xFF;
+    }
+    if(!check_sequence(uc)) {
+      error("source file \"%s\" contains invalid sequence.\n", file);
+    }
+    for(int j = 0; j < uc.bytes; j++) {
+      text[size++] = uc.sequence[j];
+    }
+    i += uc.bytes;
+  }
+
+  return size;
+}
+
+int splice_lines(unsigned char *text, int size, int **splices, int *splices_size) {
+  int j = 0, alloc_size = 0;
+  *splices = NULL;
+  *splices_size = 0;
+  for(int i = 0; i < size;) {
+    if(text[i] == '\\' && i + 1 < size && text[i + 1] == '\n') {
+      if(i + 2 == size) {
+        error("end of the source file requires new line indicator.\n");
+      }
+      if(*splices_size == alloc_size) {
+        alloc_size = alloc_size == 0 ? 16 : alloc_size * 2;
+        *splices = (int *) realloc(*splices, sizeof(int) * alloc_size);
+        if(*splices == NULL) {
+          perror("realloc");
+          exit(1);
+        }
+      }
+      (*splices)[(*splices_size)++] = j;
+      // the character right after the splice is not examined again
+      int bytes = count_bytes(text[i + 2]);
+      for(int k = 0; k < bytes; k++) {
+        text[j++] = text[i + 2 + k];
+      }
+      i += 2 + bytes;
+    } else {
+      text[j++] = text[i++];
+    }
+  }
+  return j;
+}
+
+void decode_source_file(struct source_file *content, const unsigned char *file, const unsigned char *raw, int raw_size) {
+  content->text = (unsigned char *) malloc(sizeof(unsigned char) * (raw_size + 1));
+  if(content->text == NULL) {
+    perror("malloc");
     exit(1);
   }
 
-  src->file = file;
-  src->row = 1;
-  src->col = 1;
-  src->trigraph_queue_size = 0;
-  src->splice_queue_size = 0;
+  int size = replace_trigraphs(content->text, file, raw, raw_size);
+  content->size = splice_lines(content->text, size, &content->splices, &content->splices_size);
+  content->text[content->size] = '\0';
 }
 
-void free_source(struct source *src) {
-  fclose(src->fp);
-  free(src);
+// source cache
+struct source_cache *allocate_source_cache() {
+  struct source_cache *cache = (struct source_cache *) calloc(1, sizeof(struct source_cache));
+  if(cache == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  cache->limit = SOURCE_CACHE_LIMIT;
+  pthread_mutex_init(&cache->lock, NULL);
+  return cache;
 }
 
-struct utf8c fget_utf8c(struct source *src) {
-  struct utf8c uc;
-  uc.sequence[0] = fgetc(src->fp);
-  uc.bytes = count_bytes(uc.sequence[0]);
+int file_hash(dev_t dev, ino_t ino) {
+  return (int) (((unsigned long) dev * 31 + (unsigned long) ino) % SOURCE_CACHE_SIZE);
+}
 
-  if(uc.bytes == -1) {
-    error("source file \"%s\" contains invalid sequence.\n", src->file);
+void unlink_lru(struct source_cache *cache, struct source_file *content) {
+  if(content->lru_prev != NULL) {
+    content->lru_prev->lru_next = content->lru_next;
+  } else {
+    cache->lru_head = content->lru_next;
   }
+  if(content->lru_next != NULL) {
+    content->lru_next->lru_prev = content->lru_prev;
+  } else {
+    cache->lru_tail = content->lru_prev;
+  }
+}
 
-  if(uc.bytes == 0) {
-    return ueof;
+void push_lru(struct source_cache *cache, struct source_file *content) {
+  content->lru_prev = NULL;
+  content->lru_next = cache->lru_head;
+  if(cache->lru_head != NULL) {
+    cache->lru_head->lru_prev = content;
+  } else {
+    cache->lru_tail = content;
   }
+  cache->lru_head = content;
+}
 
-  for(int i = 1; i < uc.bytes; i++) {
-    uc.sequence[i] = fgetc(src->fp);
+void remove_source_cache(struct source_cache *cache, struct source_file *content) {
+  struct source_file **entry = &cache->table[file_hash(content->dev, content->ino)];
+  while(*entry != content) {
+    entry = &((*entry)->next);
   }
+  *entry = content->next;
+
+  unlink_lru(cache, content);
+  cache->bytes -= content->size;
+}
 
-  if(!check_sequence(uc)) {
-    error("source file \"%s\" contains invalid sequence.\n", src->file);
+void free_source_file(struct source_file *content) {
+  free_skeleton(content->skeleton);
+  free(content->text);
+  free(content->splices);
+  free(content);
+}
+
+// called with the lock held; the token stream lexed from the contents goes with them
+void discard_source_file(struct source_cache *cache, struct source_file *content) {
+  if(cache->tokens != NULL) {
+    drop_lexed_stream(cache->tokens, content);
   }
+  free_source_file(content);
+}
 
-  uc.sequence[uc.bytes] = '\0';
+void evict_source_cache(struct source_cache *cache) {
+  struct source_file *content = cache->lru_tail;
+  while(content != NULL && cache->bytes > cache->limit) {
+    struct source_file *prev = content->lru_prev;
+    if(content->users == 0) {
+      remove_source_cache(cache, content);
+      discard_source_file(cache, content);
+    }
+    content = prev;
+  }
+}
 
-  return uc;
+void set_source_cache_limit(struct source_cache *cache, long limit) {
+  pthread_mutex_lock(&cache->lock);
+  cache->limit = limit;
+  evict_source_cache(cache);
+  pthread_mutex_unlock(&cache->lock);
 }
 
-struct utf8c replace_trigraph(struct source *src) {
-  unsigned char trigraph_symbol[9] = { '=', '(', '/', ')', '\'', '<', '!', '>', '-' };
-  unsigned char trigraph_char[9] = { '#', '[', '\\', ']', '^', '{', '|', '}', '~' };
+// the sources still in use are left to their users
+void free_source_cache(struct source_cache *cache) {
+  set_source_cache_limit(cache, 0);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
 
-  for(; src->trigraph_queue_size < 3; src->trigraph_queue_size++) {
-    src->trigraph_queue[src->trigraph_queue_size] = fget_utf8c(src);
-    if(src->trigraph_queue[src->trigraph_queue_size].bytes == 0) {
-      break;
+// called with the lock held; drops the entry of the file if it was modified since it was cached
+struct source_file *find_source_file(struct source_cache *cache, struct stat *st) {
+  int h = file_hash(st->st_dev, st->st_ino);
+  for(struct source_file *content = cache->table[h]; content != NULL; content = content->next) {
+    if(content->dev != st->st_dev || content->ino != st->st_ino) continue;
+
+    if(content->mtime.tv_sec == st->st_mtim.tv_sec && content->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+      unlink_lru(cache, content);
+      push_lru(cache, content);
+      return content;
     }
+
+    // modified since it was cached
+    remove_source_cache(cache, content);
+    if(content->users == 0) {
+      discard_source_file(cache, content);
+    } else {
+      content->stale = 1;
+    }
+    break;
   }
+  return NULL;
+}
 
-  if(src->trigraph_queue_size == 0) {
-    return ueof;
+// called with the lock held; a file read ahead counts as used when a real load finds it
+void use_source_file(struct source_cache *cache, struct source_file *content, int prefetch) {
+  content->users++;
+  if(!prefetch && content->prefetched) {
+    content->prefetched = 0;
+    cache->prefetch_hits++;
   }
+}
 
-  if(src->trigraph_queue_size == 3) {
-    if(src->trigraph_queue[0].sequence[0] == '?') {
-      if(src->trigraph_queue[1].sequence[0] == '?') {
-        for(int i = 0; i < 9; i++) {
-          if(src->trigraph_queue[2].sequence[0] == trigraph_symbol[i]) {
-            struct utf8c uc = single_byte_char(trigraph_char[i]);
-            src->trigraph_queue_size = 0;
-            return uc;
-          }
-        }
-      }
+struct source_file *fetch_source_file(struct source_cache *cache, const unsigned char *file, int fd, int prefetch) {
+  if(fd < 0) {
+    fd = open(file, O_RDONLY);
+    if(fd < 0) {
+      error("failed to open source file: %s\n", file);
     }
   }
 
-  struct utf8c uc = src->trigraph_queue[0];
-  src->trigraph_queue_size--;
-  for(int i = 0; i < src->trigraph_queue_size; i++) {
-    src->trigraph_queue[i] = src->trigraph_queue[i + 1];
+  struct stat st;
+  if(fstat(fd, &st) < 0) {
+    close(fd);
+    error("failed to stat source file: %s\n", file);
   }
-  return uc;
+
+  pthread_mutex_lock(&cache->lock);
+  struct source_file *cached = find_source_file(cache, &st);
+  if(cached != NULL) {
+    use_source_file(cache, cached, prefetch);
+    pthread_mutex_unlock(&cache->lock);
+    close(fd);
+    return cached;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  // read and decode without the lock so that other threads can use the cache
+  int raw_size;
+  unsigned char *raw = read_file(fd, &raw_size);
+  close(fd);
+
+  struct source_file *content = (struct source_file *) malloc(sizeof(struct source_file));
+  if(content == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  content->dev = st.st_dev;
+  content->ino = st.st_ino;
+  content->mtime = st.st_mtim;
+  content->users = 1;
+  content->stale = 0;
+  content->prefetched = prefetch;
+  content->scanned = 0;
+  decode_source_file(content, file, raw, raw_size);
+  free(raw);
+  content->skeleton = build_skeleton(content->text, content->size);
+
+  pthread_mutex_lock(&cache->lock);
+
+  // another thread may have loaded the same file meanwhile
+  cached = find_source_file(cache, &st);
+  if(cached != NULL) {
+    use_source_file(cache, cached, prefetch);
+    pthread_mutex_unlock(&cache->lock);
+    free_source_file(content);
+    return cached;
+  }
+
+  int h = file_hash(st.st_dev, st.st_ino);
+  content->next = cache->table[h];
+  cache->table[h] = content;
+  push_lru(cache, content);
+  cache->bytes += content->size;
+  if(prefetch) {
+    cache->prefetch_loads++;
+  }
+  evict_source_cache(cache);
+
+  pthread_mutex_unlock(&cache->lock);
+
+  return content;
 }
 
-struct utf8c splice_line(struct source *src) {
-  for(; src->splice_queue_size < 3; src->splice_queue_size++) {
-    src->splice_queue[src->splice_queue_size] = replace_trigraph(src);
-    if(src->splice_queue[src->splice_queue_size].bytes == 0) {
-      break;
-    }
+struct source_file *load_source_file(struct source_cache *cache, const unsigned char *file, int fd) {
+  return fetch_source_file(cache, file, fd, 0);
+}
+
+// loads a file ahead of its inclusion, which is counted for the accuracy of the read-ahead
+struct source_file *prefetch_source_file(struct source_cache *cache, const unsigned char *file, int fd) {
+  return fetch_source_file(cache, file, fd, 1);
+}
+
+void release_source_file(struct source_cache *cache, struct source_file *content) {
+  pthread_mutex_lock(&cache->lock);
+  content->users--;
+  if(content->stale && content->users == 0) {
+    discard_source_file(cache, content);
   }
+  evict_source_cache(cache);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// source
+struct source *allocate_source(struct source_cache *cache, const unsigned char *file) {
+  return allocate_source_fd(cache, file, -1);
+}
 
-  if(src->splice_queue_size == 0) {
-    return ueof;
+struct source *allocate_source_fd(struct source_cache *cache, const unsigned char *file, int fd) {
+  struct source *src = (struct source *) malloc(sizeof(struct source));
+  if(src == NULL) {
+    perror("malloc");
+    exit(1);
   }
 
-  if(src->splice_queue_size >= 2) {
-    if(src->splice_queue[0].sequence[0] == '\\') {
-      if(src->splice_queue[1].sequence[0] == '\n') {
-        if(src->splice_queue_size == 2) {
-          error("end of the source file requires new line indicator.\n");
-        }
-        src->splice_queue_size = 0;
-        return src->splice_queue[2];
-      }
-    }
+  src->cache = cache;
+  src->content = load_source_file(cache, file, fd);
+  src->file = file;
+  src->pos = 0;
+  src->row = 1;
+  src->col = 1;
+  src->row_offset = 0;
+  src->row_splice = 0;
+
+  return src;
+}
+
+// a source which is not a file, such as the definitions of the command line; it is left out of the cache and freed with its last user
+struct source *allocate_source_text(struct source_cache *cache, const unsigned char *file, const unsigned char *text, int size) {
+  struct source_file *content = (struct source_file *) calloc(1, sizeof(struct source_file));
+  if(content == NULL) {
+    perror("calloc");
+    exit(1);
   }
+  content->users = 1;
+  content->stale = 1;
+  decode_source_file(content, file, text, size);
+  content->skeleton = build_skeleton(content->text, content->size);
 
-  struct utf8c uc = src->splice_queue[0];
-  src->splice_queue_size--;
-  for(int i = 0; i < src->splice_queue_size; i++) {
-    src->splice_queue[i] = src->splice_queue[i + 1];
+  struct source *src = (struct source *) malloc(sizeof(struct source));
+  if(src == NULL) {
+    perror("malloc");
+    exit(1);
   }
-  return uc;
+
+  src->cache = cache;
+  src->content = content;
+  src->file = file;
+  src->pos = 0;
+  src->row = 1;
+  src->col = 1;
+  src->row_offset = 0;
+  src->row_splice = 0;
+
+  return src;
+}
+
+void free_source(struct source *src) {
+  release_source_file(src->cache, src->content);
+  free(src);
 }
 
 struct utf8c next_source_char(struct source *src) {
-  return splice_line(src);
+  if(src->pos >= src->content->size) {
+    struct utf8c uc = ueof;
+    uc.offset = src->content->size;
+    return uc;
+  }
+
+  struct utf8c uc;
+  uc.offset = src->pos;
+  uc.bytes = count_bytes(src->content->text[src->pos]);
+  for(int i = 0; i < uc.bytes; i++) {
+    uc.sequence[i] = src->content->text[src->pos++];
+  }
+  uc.sequence[uc.bytes] = '\0';
+
+  return uc;
+}
+
+void seek_source(struct source *src, int offset) {
+  src->pos = offset;
+}
+
+// consume the rest of "//" comment including the new line
+int skip_source_line(struct source *src) {
+  const unsigned char *text = src->content->text;
+  const unsigned char *nl = memchr(&text[src->pos], '\n', src->content->size - src->pos);
+  if(nl == NULL) {
+    src->pos = src->content->size;
+    return 0;
+  }
+  src->pos = nl - text + 1;
+  return 1;
+}
+
+// consume the rest of "/* ... */" comment
+int skip_source_comment(struct source *src) {
+  const unsigned char *text = src->content->text;
+  int size = src->content->size;
+  for(int i = src->pos; i < size;) {
+    const unsigned char *star = memchr(&text[i], '*', size - i);
+    if(star == NULL) break;
+    int k = star - text;
+    if(k + 1 < size && text[k + 1] == '/') {
+      src->pos = k + 2;
+      return 1;
+    }
+    i = k + 1;
+  }
+  src->pos = size;
+  return 0;
+}
+
+// physical line number of the offset, counted on from the last queried offset; every splice before it ended a line too
+int source_row(struct source *src, int offset) {
+  const unsigned char *text = src->content->text;
+  if(offset < src->row_offset) {
+    src->row = 1;
+    src->row_offset = 0;
+    src->row_splice = 0;
+  }
+  for(int i = src->row_offset; i < offset;) {
+    const unsigned char *nl = memchr(&text[i], '\n', offset - i);
+    if(nl == NULL) break;
+    src->row++;
+    i = nl - text + 1;
+  }
+  while(src->row_splice < src->content->splices_size && src->content->splices[src->row_splice] <= offset) {
+    src->row++;
+    src->row_splice++;
+  }
+  src->row_offset = offset;
+  return src->row;
 }
@@ -2,21 +2,75 @@
 #define __FILE_INCLUDE__
 
 #include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
 #include "error.h"
 #include "utf8.h"
+#include "skeleton.h"
+
+/* prime number */
+#define SOURCE_CACHE_SIZE 1021
+#define SOURCE_CACHE_LIMIT (256 * 1024 * 1024)
+
+struct source_file {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  unsigned char *text;
+  int size;
+  // the offsets of text at which a backslash and new line were removed
+  int *splices;
+  int splices_size;
+  struct skeleton *skeleton;
+  int users;
+  int stale;
+  int prefetched;
+  int scanned;
+  struct source_file *next;
+  struct source_file *lru_prev;
+  struct source_file *lru_next;
+};
+
+struct token_cache;
+
+struct source_cache {
+  struct source_file *table[SOURCE_CACHE_SIZE];
+  struct source_file *lru_head;
+  struct source_file *lru_tail;
+  long bytes;
+  long limit;
+  long prefetch_loads;
+  long prefetch_hits;
+  struct token_cache *tokens;
+  pthread_mutex_t lock;
+};
 
 struct source {
-  FILE *fp;
+  struct source_cache *cache;
+  struct source_file *content;
   const unsigned char *file;
+  int pos;
   int row, col;
-  int trigraph_queue_size;
-  struct utf8c trigraph_queue[3];
-  int splice_queue_size;
-  struct utf8c splice_queue[3];
+  int row_offset;
+  int row_splice;
 };
 
-extern struct source *allocate_source(const unsigned char *file);
+extern struct source_cache *allocate_source_cache();
+extern void set_source_cache_limit(struct source_cache *cache, long limit);
+extern void free_source_cache(struct source_cache *cache);
+// returns the contents with a user added
+extern struct source_file *load_source_file(struct source_cache *cache, const unsigned char *file, int fd);
+extern struct source_file *prefetch_source_file(struct source_cache *cache, const unsigned char *file, int fd);
+extern void release_source_file(struct source_cache *cache, struct source_file *content);
+extern struct source *allocate_source(struct source_cache *cache, const unsigned char *file);
+extern struct source *allocate_source_fd(struct source_cache *cache, const unsigned char *file, int fd);
+extern struct source *allocate_source_text(struct source_cache *cache, const unsigned char *file, const unsigned char *text, int size);
 extern void free_source(struct source *src);
 extern struct utf8c next_source_char(struct source *src);
+extern void seek_source(struct source *src, int offset);
+extern int skip_source_line(struct source *src);
+extern int skip_source_comment(struct source *src);
+extern int source_row(struct source *src, int offset);
 
 #endif
@@ -0,0 +1,397 @@
+#include <stdint.h>
+#include <unistd.h>
+#include "hdrcache.h"
+
+/*
+ * Cache of the output of included headers for the translation units of one
+ * command. While a header is preprocessed, the first lookup of every macro
+ * name is recorded with the definition it found, together with every
+ * #define and #undef, the files it included and its diagnostics. An
+ * inclusion of the same header where every recorded lookup finds the same
+ * definition again writes the recorded tokens, applies the definitions and
+ * skips the header, as a committed speculation does.
+ *
+ * The hooks of the lookups see every header being recorded, innermost
+ * first, so the reads of a nested header are reads of the headers which
+ * include it. A header is recorded through a list sink, as a text line
+ * copied straight from the source would skip the lookups of its names.
+ */
+
+struct header_cache *allocate_header_cache() {
+  struct header_cache *cache = (struct header_cache *) calloc(1, sizeof(struct header_cache));
+  if(cache == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  pthread_mutex_init(&cache->lock, NULL);
+  return cache;
+}
+
+void free_header_variant(struct header_variant *variant) {
+  for(int i = 0; i < variant->reads_size; i++) {
+    if(variant->reads[i].macro != NULL) {
+      free_macro_entry(variant->reads[i].macro);
+    }
+  }
+  for(int i = 0; i < variant->effects_size; i++) {
+    if(variant->effects[i].macro != NULL) {
+      free_macro_entry(variant->effects[i].macro);
+    }
+  }
+  for(int i = 0; i < variant->includes_size; i++) {
+    free_string(variant->includes[i].path);
+  }
+  free(variant->reads);
+  free(variant->effects);
+  free(variant->includes);
+  release_written_pp_tokens(variant->output, 0);
+  free_pp_list(variant->output);
+  free(variant->messages);
+  free(variant);
+}
+
+// drops every variant and keeps the cache usable
+void clear_header_cache(struct header_cache *cache) {
+  for(int i = 0; i < HEADER_CACHE_TABLE_SIZE; i++) {
+    while(cache->table[i] != NULL) {
+      struct cached_header *header = cache->table[i];
+      cache->table[i] = header->next;
+      while(header->variants != NULL) {
+        struct header_variant *variant = header->variants;
+        header->variants = variant->next;
+        free_header_variant(variant);
+      }
+      free(header);
+    }
+  }
+}
+
+void free_header_cache(struct header_cache *cache) {
+  clear_header_cache(cache);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+// the names of headers are kept by the lookup table of the search, so they are compared by pointer
+int header_cache_hash(const unsigned char *name) {
+  return ((uintptr_t) name >> 3) % HEADER_CACHE_TABLE_SIZE;
+}
+
+// called with the lock held
+struct cached_header *search_cached_header(struct header_cache *cache, const unsigned char *name, int create) {
+  int h = header_cache_hash(name);
+  for(struct cached_header *header = cache->table[h]; header != NULL; header = header->next) {
+    if(header->name == name) return header;
+  }
+  if(!create) return NULL;
+
+  struct cached_header *header = (struct cached_header *) calloc(1, sizeof(struct cached_header));
+  if(header == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  header->name = name;
+  header->next = cache->table[h];
+  cache->table[h] = header;
+  return header;
+}
+
+// a copy owning its tokens, as the table of the run frees its macros when the translation unit ends
+struct macro_entry *keep_macro_entry(struct skcc_context *ctx, const struct macro_entry *macro) {
+  struct macro_entry *copy = allocate_macro_entry();
+  copy->type = macro->type;
+  copy->identifier = macro->identifier;
+  copy->parameter_size = macro->parameter_size;
+  copy->parameter_ellipsis = macro->parameter_ellipsis;
+  memcpy(copy->parameters, macro->parameters, sizeof(macro->parameters));
+
+  struct pp_list *lists[2][2] = { { macro->replacement_list, copy->replacement_list }, { macro->tokens, copy->tokens } };
+  for(int i = 0; i < 2; i++) {
+    for(struct pp_node *node = lists[i][0]->head; node != NULL; node = node->next) {
+      struct pp_token *token = copy_pp_token(node->token);
+      token->persistent = node->token->persistent;
+      // interned here, so that threads replaying the macro never write to its tokens
+      if(token->type == PP_IDENT && token->atom == NULL) {
+        token->atom = intern_string(ctx->atoms, token->text->head, token->text->size);
+      }
+      append_pp_list(lists[i][1], token);
+    }
+  }
+  return copy;
+}
+
+// set of names looked up by a recording, open addressing over the atoms; returns 1 for a new name
+int mark_header_resolved(struct header_recording *recording, const unsigned char *identifier) {
+  if(recording->resolved_size * 2 >= recording->resolved_alloc) {
+    int alloc = recording->resolved_alloc == 0 ? 256 : recording->resolved_alloc * 2;
+    const unsigned char **resolved = (const unsigned char **) calloc(alloc, sizeof(const unsigned char *));
+    if(resolved == NULL) {
+      perror("calloc");
+      exit(1);
+    }
+    for(int i = 0; i < recording->resolved_alloc; i++) {
+      if(recording->resolved[i] == NULL) continue;
+      unsigned int h = interned_hash(recording->resolved[i]) & (alloc - 1);
+      while(resolved[h] != NULL) h = (h + 1) & (alloc - 1);
+      resolved[h] = recording->resolved[i];
+    }
+    free(recording->resolved);
+    recording->resolved = resolved;
+    recording->resolved_alloc = alloc;
+  }
+
+  unsigned int h = interned_hash(identifier) & (recording->resolved_alloc - 1);
+  while(recording->resolved[h] != NULL) {
+    if(recording->resolved[h] == identifier) return 0;
+    h = (h + 1) & (recording->resolved_alloc - 1);
+  }
+  recording->resolved[h] = identifier;
+  recording->resolved_size++;
+  return 1;
+}
+
+void append_cached_macro(struct cached_macro **macros, int *size, int *alloc_size, const unsigned char *identifier, struct macro_entry *macro) {
+  if(*size == *alloc_size) {
+    *alloc_size = *alloc_size == 0 ? 256 : *alloc_size * 2;
+    *macros = (struct cached_macro *) realloc(*macros, sizeof(struct cached_macro) * *alloc_size);
+    if(*macros == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  (*macros)[*size].identifier = identifier;
+  (*macros)[*size].macro = macro;
+  (*size)++;
+}
+
+// a name seen by an inner recording was seen by the outer ones as well
+void record_header_read(struct skcc_context *ctx, const unsigned char *identifier) {
+  struct macro_entry *macro = NULL;
+  int searched = 0;
+  for(struct header_recording *recording = ctx->recording; recording != NULL; recording = recording->outer) {
+    if(!mark_header_resolved(recording, identifier)) break;
+    if(!searched) {
+      macro = search_macro_table(ctx->macros, identifier);
+      searched = 1;
+    }
+    append_cached_macro(&recording->reads, &recording->reads_size, &recording->reads_alloc, identifier, macro);
+  }
+}
+
+void record_header_effect(struct skcc_context *ctx, const unsigned char *identifier, struct macro_entry *macro) {
+  for(struct header_recording *recording = ctx->recording; recording != NULL; recording = recording->outer) {
+    append_cached_macro(&recording->effects, &recording->effects_size, &recording->effects_alloc, identifier, macro);
+  }
+}
+
+void record_header_include(struct skcc_context *ctx, struct string *path, int system, int missing) {
+  for(struct header_recording *recording = ctx->recording; recording != NULL; recording = recording->outer) {
+    if(recording->includes_size == recording->includes_alloc) {
+      recording->includes_alloc = recording->includes_alloc == 0 ? 16 : recording->includes_alloc * 2;
+      recording->includes = (struct cached_include *) realloc(recording->includes, sizeof(struct cached_include) * recording->includes_alloc);
+      if(recording->includes == NULL) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    struct string *copy = allocate_string();
+    concat_string(copy, path);
+    recording->includes[recording->includes_size].path = copy;
+    recording->includes[recording->includes_size].system = system;
+    recording->includes[recording->includes_size].missing = missing;
+    recording->includes_size++;
+  }
+}
+
+int check_header_variant(struct macro_table *table, struct header_variant *variant) {
+  for(int i = 0; i < variant->reads_size; i++) {
+    struct macro_entry *macro = search_macro_table(table, variant->reads[i].identifier);
+    struct macro_entry *kept = variant->reads[i].macro;
+    if(macro == NULL && kept == NULL) continue;
+    if(macro == NULL || kept == NULL || !compare_macro(macro, kept)) return 0;
+  }
+  return 1;
+}
+
+// variants are only ever added in front, so the list can be walked without the lock
+struct header_variant *find_header_variant(struct skcc_context *ctx, const unsigned char *name) {
+  struct header_cache *cache = ctx->headers;
+  pthread_mutex_lock(&cache->lock);
+  struct cached_header *header = search_cached_header(cache, name, 0);
+  struct header_variant *variants = header != NULL ? header->variants : NULL;
+  pthread_mutex_unlock(&cache->lock);
+
+  for(struct header_variant *variant = variants; variant != NULL; variant = variant->next) {
+    if(check_header_variant(ctx->macros, variant)) return variant;
+  }
+  return NULL;
+}
+
+void store_header_variant(struct header_cache *cache, const unsigned char *name, struct header_variant *variant) {
+  pthread_mutex_lock(&cache->lock);
+  struct cached_header *header = search_cached_header(cache, name, 1);
+  if(header->variants_size == HEADER_CACHE_VARIANTS) {
+    cache->dropped++;
+    pthread_mutex_unlock(&cache->lock);
+    free_header_variant(variant);
+    return;
+  }
+  variant->next = header->variants;
+  header->variants = variant;
+  header->variants_size++;
+  cache->recorded++;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// the include continues as if the header was preprocessed again
+void replay_header_variant(struct preprocessor *pp, struct header_variant *variant) {
+  struct skcc_context *ctx = pp->ctx;
+
+  fwrite(variant->messages, 1, variant->messages_size, error_stream != NULL ? error_stream : stderr);
+  write_pp_token_copies(variant->output, pp->sink);
+
+  for(int i = 0; i < variant->reads_size; i++) {
+    record_header_read(ctx, variant->reads[i].identifier);
+  }
+  for(int i = 0; i < variant->effects_size; i++) {
+    struct cached_macro *effect = &variant->effects[i];
+    if(effect->macro != NULL) {
+      struct macro_entry *macro = borrow_macro_entry(effect->macro);
+      record_header_effect(ctx, effect->identifier, macro);
+      insert_macro_table(ctx->macros, macro);
+    } else {
+      record_header_effect(ctx, effect->identifier, NULL);
+      delete_macro_table(ctx->macros, effect->identifier);
+    }
+  }
+
+  for(int i = 0; i < variant->includes_size; i++) {
+    struct cached_include *include = &variant->includes[i];
+    if(include->missing) {
+      if(ctx->misses != NULL) {
+        add_dependency(ctx->misses, include->path, 0);
+      }
+      record_header_include(ctx, include->path, 0, 1);
+      continue;
+    }
+    if(ctx->dependencies->options.enabled) {
+      add_dependency(ctx->dependencies, include->path, include->system);
+    }
+    if(ctx->inputs != NULL) {
+      add_dependency(ctx->inputs, include->path, include->system);
+    }
+    record_header_include(ctx, include->path, include->system, 0);
+  }
+}
+
+struct header_recording *begin_header_recording(struct skcc_context *ctx, const unsigned char *name) {
+  struct header_recording *recording = (struct header_recording *) calloc(1, sizeof(struct header_recording));
+  if(recording == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  recording->name = name;
+  recording->output = allocate_pp_list();
+  recording->sink = allocate_marked_list_sink(recording->output);
+  recording->messages = open_memstream(&recording->messages_text, &recording->messages_size);
+  if(recording->messages == NULL) {
+    perror("open_memstream");
+    exit(1);
+  }
+
+  recording->saved_stream = error_stream;
+  error_stream = recording->messages;
+  recording->outer = ctx->recording;
+  ctx->recording = recording;
+  return recording;
+}
+
+// pops the recording and passes its diagnostics on to the stream it replaced
+void close_header_recording(struct skcc_context *ctx, struct header_recording *recording) {
+  ctx->recording = recording->outer;
+  fclose(recording->messages);
+  error_stream = recording->saved_stream;
+  fwrite(recording->messages_text, 1, recording->messages_size, error_stream != NULL ? error_stream : stderr);
+  free_pp_sink(recording->sink);
+  free(recording->resolved);
+}
+
+void end_header_recording(struct preprocessor *pp, struct header_recording *recording) {
+  struct skcc_context *ctx = pp->ctx;
+  close_header_recording(ctx, recording);
+  write_pp_token_copies(recording->output, pp->sink);
+
+  // the variant takes over what the recording collected
+  struct header_variant *variant = (struct header_variant *) calloc(1, sizeof(struct header_variant));
+  if(variant == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  variant->reads = recording->reads;
+  variant->reads_size = recording->reads_size;
+  for(int i = 0; i < variant->reads_size; i++) {
+    if(variant->reads[i].macro != NULL) {
+      variant->reads[i].macro = keep_macro_entry(ctx, variant->reads[i].macro);
+    }
+  }
+  variant->effects = recording->effects;
+  variant->effects_size = recording->effects_size;
+  for(int i = 0; i < variant->effects_size; i++) {
+    if(variant->effects[i].macro != NULL) {
+      variant->effects[i].macro = keep_macro_entry(ctx, variant->effects[i].macro);
+    }
+  }
+  variant->includes = recording->includes;
+  variant->includes_size = recording->includes_size;
+  variant->output = recording->output;
+  variant->messages = recording->messages_text;
+  variant->messages_size = recording->messages_size;
+  store_header_variant(ctx->headers, recording->name, variant);
+  free(recording);
+}
+
+void include_cached_header(struct preprocessor *pp, struct include_file *file) {
+  struct skcc_context *ctx = pp->ctx;
+  struct header_variant *variant = find_header_variant(ctx, file->name);
+  if(variant != NULL) {
+    if(file->fd >= 0) close(file->fd);
+    pthread_mutex_lock(&ctx->headers->lock);
+    ctx->headers->hits++;
+    pthread_mutex_unlock(&ctx->headers->lock);
+    replay_header_variant(pp, variant);
+    return;
+  }
+
+  struct header_recording *recording = begin_header_recording(ctx, file->name);
+  parse_preprocessing_file_fd(ctx, (unsigned char *) file->name, file->fd, recording->sink);
+  end_header_recording(pp, recording);
+}
+
+// an error left the recordings open; the diagnostics they hold are passed on and the rest dropped
+void abort_header_recordings(struct skcc_context *ctx) {
+  while(ctx->recording != NULL) {
+    struct header_recording *recording = ctx->recording;
+    close_header_recording(ctx, recording);
+    free(recording->messages_text);
+    release_written_pp_tokens(recording->output, 0);
+    free_pp_list(recording->output);
+    for(int i = 0; i < recording->includes_size; i++) {
+      free_string(recording->includes[i].path);
+    }
+    free(recording->includes);
+    free(recording->reads);
+    free(recording->effects);
+    free(recording);
+  }
+}
+
+void write_header_cache_stats(struct header_cache *cache, FILE *fp) {
+  pthread_mutex_lock(&cache->lock);
+  long total = cache->hits + cache->recorded + cache->dropped;
+  fprintf(fp, "header cache: %ld hits, %ld recorded, %ld dropped", cache->hits, cache->recorded, cache->dropped);
+  if(total > 0) {
+    fprintf(fp, ", hit rate %.1f%%", 100.0 * cache->hits / total);
+  }
+  fprintf(fp, "\n");
+  pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,93 @@
+#ifndef __HDRCACHE_INCLUDE__
+#define __HDRCACHE_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "error.h"
+#include "preprocess.h"
+
+/* prime number */
+#define HEADER_CACHE_TABLE_SIZE 1021
+
+// variants of one header kept at most; the later ones are preprocessed every time
+#define HEADER_CACHE_VARIANTS 8
+
+// a macro name with the definition it had, or NULL if it was not defined
+struct cached_macro {
+  const unsigned char *identifier;
+  struct macro_entry *macro;
+};
+
+// an include, or a candidate path of one which was not found
+struct cached_include {
+  struct string *path;
+  int system;
+  int missing;
+};
+
+// the result of a header for one state of the macros it read
+struct header_variant {
+  struct cached_macro *reads;
+  int reads_size;
+  struct cached_macro *effects;
+  int effects_size;
+  struct cached_include *includes;
+  int includes_size;
+  struct pp_list *output;
+  char *messages;
+  size_t messages_size;
+  struct header_variant *next;
+};
+
+struct cached_header {
+  const unsigned char *name;
+  struct header_variant *variants;
+  int variants_size;
+  struct cached_header *next;
+};
+
+struct header_cache {
+  struct cached_header *table[HEADER_CACHE_TABLE_SIZE];
+  pthread_mutex_t lock;
+  long hits;
+  long recorded;
+  long dropped;
+};
+
+// a header being preprocessed; the recordings of the headers including it are outer ones
+struct header_recording {
+  const unsigned char *name;
+  struct pp_list *output;
+  struct pp_sink *sink;
+  const unsigned char **resolved;
+  int resolved_size;
+  int resolved_alloc;
+  struct cached_macro *reads;
+  int reads_size;
+  int reads_alloc;
+  struct cached_macro *effects;
+  int effects_size;
+  int effects_alloc;
+  struct cached_include *includes;
+  int includes_size;
+  int includes_alloc;
+  FILE *messages;
+  char *messages_text;
+  size_t messages_size;
+  FILE *saved_stream;
+  struct header_recording *outer;
+};
+
+extern struct header_cache *allocate_header_cache();
+extern void clear_header_cache(struct header_cache *cache);
+extern void free_header_cache(struct header_cache *cache);
+extern void record_header_read(struct skcc_context *ctx, const unsigned char *identifier);
+extern void record_header_effect(struct skcc_context *ctx, const unsigned char *identifier, struct macro_entry *macro);
+extern void record_header_include(struct skcc_context *ctx, struct string *path, int system, int missing);
+extern void include_cached_header(struct preprocessor *pp, struct include_file *file);
+extern void abort_header_recordings(struct skcc_context *ctx);
+extern void write_header_cache_stats(struct header_cache *cache, FILE *fp);
+
+#endif
@@ -0,0 +1,471 @@
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "incremental.h"
+#include "hdrcache.h"
+
+/*
+ * Incremental batches. After a translation unit is preprocessed, a record
+ * of it is kept in the directory: the digest of the options, the size and
+ * modification time of every file it read and of its output, the paths
+ * its includes looked for without finding them, and the diagnostics and
+ * dependency rules it wrote. A later run with the same
+ * options only preprocesses the units a file of which changed, and replays
+ * the records of the others, so its output is the same as that of a full
+ * batch.
+ *
+ * In watch mode the directories of those files are watched with inotify.
+ * The events only wake the loop: the paths of the events and those of the
+ * includes are spelled differently, so the records decide which units are
+ * stale as in a run of its own.
+ */
+
+#define INCREMENTAL_SUFFIX ".inc"
+#define INCREMENTAL_TEMP ".tmp-"
+
+// a burst of events, such as an editor saving through a temporary file, is one change
+#define INCREMENTAL_SETTLE_MS 50
+
+uint64_t incremental_digest(const char *text) {
+  uint64_t h = 14695981039346656037ull ^ INCREMENTAL_VERSION;
+  for(int i = 0; text[i]; i++) {
+    h = (h ^ (unsigned char) text[i]) * 1099511628211ull;
+  }
+  return h;
+}
+
+char *incremental_record_path(struct incremental *incremental, const char *source) {
+  char *path = (char *) malloc(strlen(incremental->dir) + 32);
+  if(path == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  sprintf(path, "%s/%016llx" INCREMENTAL_SUFFIX, incremental->dir, (unsigned long long) incremental_digest(source));
+  return path;
+}
+
+struct incremental *allocate_incremental(const char *dir, const char *options) {
+  if(mkdir(dir, 0777) < 0 && errno != EEXIST) {
+    error("failed to create the incremental directory: %s\n", dir);
+  }
+
+  struct incremental *incremental = (struct incremental *) calloc(1, sizeof(struct incremental));
+  if(incremental == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  incremental->dir = strdup(dir);
+  incremental->options = incremental_digest(options);
+  return incremental;
+}
+
+void clear_incremental_record(struct incremental_record *record) {
+  free(record->source);
+  free(record->output.path);
+  for(int i = 0; i < record->inputs_size; i++) {
+    free(record->inputs[i].path);
+  }
+  free(record->inputs);
+  free(record->messages);
+  free(record->rules);
+  memset(record, 0, sizeof(struct incremental_record));
+}
+
+void free_incremental(struct incremental *incremental) {
+  if(incremental->records != NULL) {
+    for(int i = 0; i < incremental->size; i++) {
+      clear_incremental_record(&incremental->records[i]);
+    }
+    free(incremental->records);
+  }
+  free(incremental->dir);
+  free(incremental);
+}
+
+void add_incremental_input(struct incremental_record *record, const char *path, struct timespec mtime, long size) {
+  if(record->inputs_size == record->inputs_alloc) {
+    record->inputs_alloc = record->inputs_alloc == 0 ? 16 : record->inputs_alloc * 2;
+    record->inputs = (struct incremental_input *) realloc(record->inputs, sizeof(struct incremental_input) * record->inputs_alloc);
+    if(record->inputs == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  struct incremental_input *input = &record->inputs[record->inputs_size++];
+  input->path = strdup(path);
+  input->mtime = mtime;
+  input->size = size;
+}
+
+// returns 0 if the file does not exist
+int stat_incremental_input(const char *path, struct incremental_input *input) {
+  struct stat st;
+  if(stat(path, &st) < 0) {
+    input->mtime.tv_sec = 0;
+    input->mtime.tv_nsec = 0;
+    input->size = -1;
+    return 0;
+  }
+  input->mtime = st.st_mtim;
+  input->size = st.st_size;
+  return 1;
+}
+
+// a path which was not found is fresh while it does not exist
+int check_incremental_input(const struct incremental_input *input) {
+  struct incremental_input current;
+  if(!stat_incremental_input(input->path, &current)) return input->size < 0;
+  return current.size == input->size && current.mtime.tv_sec == input->mtime.tv_sec && current.mtime.tv_nsec == input->mtime.tv_nsec;
+}
+
+// a file modified after the unit started may have been read before the change, so it is recorded as changed
+void record_incremental_input(struct incremental_record *record, const char *path, const struct timespec *started) {
+  struct incremental_input input;
+  stat_incremental_input(path, &input);
+  if(input.mtime.tv_sec > started->tv_sec || (input.mtime.tv_sec == started->tv_sec && input.mtime.tv_nsec >= started->tv_nsec)) {
+    input.mtime.tv_sec = 0;
+    input.mtime.tv_nsec = 0;
+  }
+  add_incremental_input(record, path, input.mtime, input.size);
+}
+
+int read_incremental_blob(FILE *fp, char **blob, size_t *size, size_t length) {
+  free(*blob);
+  *blob = (char *) malloc(length + 1);
+  if(*blob == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  *size = length;
+  if(fread(*blob, 1, length, fp) != length) return 0;
+  (*blob)[length] = '\0';
+  return fgetc(fp) == '\n';
+}
+
+// returns 0 if the record is missing or broken
+int load_incremental_record(struct incremental_record *record, const char *path) {
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL) return 0;
+
+  char *line = NULL;
+  size_t alloc_size = 0;
+  ssize_t length;
+  int version = 0;
+  int valid = getline(&line, &alloc_size, fp) >= 0 && sscanf(line, "skcc-incremental %d", &version) == 1 && version == INCREMENTAL_VERSION;
+  while(valid && (length = getline(&line, &alloc_size, fp)) >= 0) {
+    if(length > 0 && line[length - 1] == '\n') {
+      line[--length] = '\0';
+    }
+
+    unsigned long long options;
+    long long seconds;
+    long nanoseconds, size;
+    size_t blob;
+    int offset;
+    if(sscanf(line, "options %llx", &options) == 1) {
+      record->options = options;
+    } else if(strncmp(line, "source ", 7) == 0) {
+      free(record->source);
+      record->source = strdup(&line[7]);
+    } else if(sscanf(line, "output %lld %ld %ld %n", &seconds, &nanoseconds, &size, &offset) == 3) {
+      free(record->output.path);
+      record->output.path = strdup(&line[offset]);
+      record->output.mtime.tv_sec = seconds;
+      record->output.mtime.tv_nsec = nanoseconds;
+      record->output.size = size;
+    } else if(sscanf(line, "input %lld %ld %ld %n", &seconds, &nanoseconds, &size, &offset) == 3) {
+      struct timespec mtime = { seconds, nanoseconds };
+      add_incremental_input(record, &line[offset], mtime, size);
+    } else if(sscanf(line, "messages %zu", &blob) == 1) {
+      valid = read_incremental_blob(fp, &record->messages, &record->messages_size, blob);
+    } else if(sscanf(line, "rules %zu", &blob) == 1) {
+      valid = read_incremental_blob(fp, &record->rules, &record->rules_size, blob);
+    } else {
+      valid = 0;
+    }
+  }
+  free(line);
+  fclose(fp);
+
+  if(!valid || record->source == NULL || record->messages == NULL || record->rules == NULL) {
+    clear_incremental_record(record);
+    return 0;
+  }
+  return 1;
+}
+
+// the record is written to a temporary file and renamed into place; a record which cannot be written is only missed by the next run
+void store_incremental_record(struct incremental *incremental, struct incremental_record *record, const char *path) {
+  char *temp = (char *) malloc(strlen(incremental->dir) + 16);
+  if(temp == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  sprintf(temp, "%s/" INCREMENTAL_TEMP "XXXXXX", incremental->dir);
+
+  int fd = mkstemp(temp);
+  FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if(fp == NULL) {
+    if(fd >= 0) {
+      close(fd);
+      unlink(temp);
+    }
+    free(temp);
+    return;
+  }
+  fchmod(fd, 0644);
+
+  fprintf(fp, "skcc-incremental %d\n", INCREMENTAL_VERSION);
+  fprintf(fp, "options %016llx\n", (unsigned long long) record->options);
+  fprintf(fp, "source %s\n", record->source);
+  if(record->output.path != NULL) {
+    fprintf(fp, "output %lld %ld %ld %s\n", (long long) record->output.mtime.tv_sec, record->output.mtime.tv_nsec, record->output.size, record->output.path);
+  }
+  for(int i = 0; i < record->inputs_size; i++) {
+    struct incremental_input *input = &record->inputs[i];
+    fprintf(fp, "input %lld %ld %ld %s\n", (long long) input->mtime.tv_sec, input->mtime.tv_nsec, input->size, input->path);
+  }
+  fprintf(fp, "messages %zu\n", record->messages_size);
+  fwrite(record->messages, 1, record->messages_size, fp);
+  fprintf(fp, "\nrules %zu\n", record->rules_size);
+  fwrite(record->rules, 1, record->rules_size, fp);
+  fprintf(fp, "\n");
+
+  int written = !ferror(fp);
+  if(fclose(fp) != 0) {
+    written = 0;
+  }
+  if(!written || rename(temp, path) < 0) {
+    unlink(temp);
+  }
+  free(temp);
+}
+
+// a unit is fresh when it was preprocessed with the same options and none of its files changed since
+int check_incremental_record(struct incremental *incremental, struct incremental_record *record, struct batch_unit *unit) {
+  if(record->options != incremental->options) return 0;
+  if(strcmp(record->source, unit->source) != 0) return 0;
+
+  if((record->output.path == NULL) != (unit->output == NULL)) return 0;
+  if(unit->output != NULL) {
+    if(strcmp(record->output.path, unit->output) != 0) return 0;
+    if(!check_incremental_input(&record->output)) return 0;
+  }
+
+  for(int i = 0; i < record->inputs_size; i++) {
+    if(!check_incremental_input(&record->inputs[i])) return 0;
+  }
+  return 1;
+}
+
+// runs a stale unit, recording the files it reads
+int record_incremental_unit(struct skcc_context *ctx, struct batch_unit *unit, void *data) {
+  struct incremental *incremental = (struct incremental *) data;
+  struct incremental_record *record = &incremental->records[incremental->indexes[unit - incremental->work]];
+
+  struct timespec started;
+  clock_gettime(CLOCK_REALTIME, &started);
+
+  ctx->inputs = allocate_dependencies();
+  ctx->misses = allocate_dependencies();
+  int status = incremental->preprocess(ctx, unit, incremental->data);
+
+  clear_incremental_record(record);
+  record->options = incremental->options;
+  record->source = strdup(unit->source);
+  record_incremental_input(record, unit->source, &started);
+  for(int i = 0; i < ctx->inputs->size; i++) {
+    record_incremental_input(record, ctx->inputs->paths[i]->head, &started);
+  }
+  for(int i = 0; i < ctx->misses->size; i++) {
+    record_incremental_input(record, ctx->misses->paths[i]->head, &started);
+  }
+  if(unit->output != NULL) {
+    record->output.path = strdup(unit->output);
+    stat_incremental_input(unit->output, &record->output);
+  }
+
+  free_dependencies(ctx->inputs);
+  free_dependencies(ctx->misses);
+  ctx->inputs = NULL;
+  ctx->misses = NULL;
+  return status;
+}
+
+// preprocess the stale units of a batch and replay the records of the others
+int run_incremental(struct skcc_context *ctx, struct incremental *incremental, struct batch_unit *units, int size, int threads, batch_function preprocess, void *data, FILE *stats) {
+  if(incremental->records == NULL) {
+    incremental->records = (struct incremental_record *) calloc(size > 0 ? size : 1, sizeof(struct incremental_record));
+    if(incremental->records == NULL) {
+      perror("calloc");
+      exit(1);
+    }
+    incremental->size = size;
+  }
+  incremental->work = (struct batch_unit *) calloc(size > 0 ? size : 1, sizeof(struct batch_unit));
+  incremental->indexes = (int *) calloc(size > 0 ? size : 1, sizeof(int));
+  if(incremental->work == NULL || incremental->indexes == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  incremental->preprocess = preprocess;
+  incremental->data = data;
+
+  int stale = 0;
+  for(int i = 0; i < size; i++) {
+    struct incremental_record *record = &incremental->records[i];
+    char *path = incremental_record_path(incremental, units[i].source);
+    clear_incremental_record(record);
+    if(load_incremental_record(record, path) && check_incremental_record(incremental, record, &units[i])) {
+      // the batch frees the captured output after writing it
+      units[i].status = 0;
+      units[i].messages = record->messages;
+      units[i].messages_size = record->messages_size;
+      units[i].rules = record->rules;
+      units[i].rules_size = record->rules_size;
+      record->messages = NULL;
+      record->rules = NULL;
+    } else {
+      incremental->work[stale] = units[i];
+      incremental->indexes[stale++] = i;
+    }
+    free(path);
+  }
+
+  // the headers and the lookups may have changed since the last pass of a watching process
+  if(ctx->headers != NULL) {
+    clear_header_cache(ctx->headers);
+  }
+  refresh_include_search(ctx->search, 1);
+  if(stale > 0) {
+    work_batch(ctx, incremental->work, stale, threads, record_incremental_unit, incremental);
+  }
+
+  for(int i = 0; i < stale; i++) {
+    struct batch_unit *unit = &incremental->work[i];
+    struct incremental_record *record = &incremental->records[incremental->indexes[i]];
+    char *path = incremental_record_path(incremental, unit->source);
+    if(unit->status == 0) {
+      record->messages = unit->messages;
+      record->messages_size = unit->messages_size;
+      record->rules = unit->rules;
+      record->rules_size = unit->rules_size;
+      store_incremental_record(incremental, record, path);
+      record->messages = NULL;
+      record->rules = NULL;
+    } else {
+      // a failed unit is preprocessed again by the next run whatever changed
+      unlink(path);
+    }
+    free(path);
+    units[incremental->indexes[i]] = *unit;
+  }
+
+  free(incremental->work);
+  free(incremental->indexes);
+  incremental->work = NULL;
+  incremental->indexes = NULL;
+
+  if(stats != NULL) {
+    fprintf(stats, "incremental: %d of %d units preprocessed\n", stale, size);
+    fflush(stats);
+  }
+
+  return replay_batch(units, size);
+}
+
+// directories are watched rather than files, as editors often replace a file by renaming another over it
+void watch_incremental_directory(int fd, const char *path, char ***watched, int *size, int *alloc_size) {
+  const char *slash = strrchr(path, '/');
+  char *dir;
+  if(slash == NULL) {
+    dir = strdup(".");
+  } else {
+    int length = slash == path ? 1 : slash - path;
+    dir = strndup(path, length);
+  }
+
+  for(int i = 0; i < *size; i++) {
+    if(strcmp((*watched)[i], dir) == 0) {
+      free(dir);
+      return;
+    }
+  }
+
+  if(*size == *alloc_size) {
+    *alloc_size = *alloc_size == 0 ? 16 : *alloc_size * 2;
+    *watched = (char **) realloc(*watched, sizeof(char *) * *alloc_size);
+    if(*watched == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  (*watched)[(*size)++] = dir;
+
+  // a directory which cannot be watched, such as one removed meanwhile, is left to the stat checks
+  inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB);
+}
+
+void watch_incremental_inputs(int fd, struct incremental *incremental, struct batch_unit *units, int size) {
+  char **watched = NULL;
+  int watched_size = 0, watched_alloc = 0;
+
+  for(int i = 0; i < size; i++) {
+    struct incremental_record *record = &incremental->records[i];
+    watch_incremental_directory(fd, units[i].source, &watched, &watched_size, &watched_alloc);
+    if(units[i].output != NULL) {
+      watch_incremental_directory(fd, units[i].output, &watched, &watched_size, &watched_alloc);
+    }
+    for(int j = 0; j < record->inputs_size; j++) {
+      watch_incremental_directory(fd, record->inputs[j].path, &watched, &watched_size, &watched_alloc);
+    }
+  }
+
+  for(int i = 0; i < watched_size; i++) {
+    free(watched[i]);
+  }
+  free(watched);
+}
+
+// blocks until something changes, then until the burst of events settles
+void wait_incremental_change(int fd) {
+  char buffer[4096];
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  int timeout = -1;
+  while(1) {
+    int n = poll(&pfd, 1, timeout);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) {
+      perror("poll");
+      exit(1);
+    }
+    if(n == 0) break;
+
+    if(read(fd, buffer, sizeof(buffer)) < 0 && errno != EINTR) {
+      perror("read");
+      exit(1);
+    }
+    timeout = INCREMENTAL_SETTLE_MS;
+  }
+}
+
+// runs an incremental batch whenever a file of a unit changes, until the process is killed
+int watch_incremental(struct skcc_context *ctx, struct incremental *incremental, struct batch_unit *units, int size, int threads, batch_function preprocess, void *data, FILE *stats) {
+  int fd = inotify_init1(IN_CLOEXEC);
+  if(fd < 0) {
+    perror("inotify_init1");
+    exit(1);
+  }
+
+  // the outputs and records written by a run wake the loop once more, and the next run finds every unit fresh
+  while(1) {
+    run_incremental(ctx, incremental, units, size, threads, preprocess, data, stats);
+    watch_incremental_inputs(fd, incremental, units, size);
+    wait_incremental_change(fd);
+  }
+
+  close(fd);
+  return 0;
+}
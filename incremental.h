@@ -0,0 +1,63 @@
+#ifndef __INCREMENTAL_INCLUDE__
+#define __INCREMENTAL_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "error.h"
+#include "preprocess.h"
+#include "batch.h"
+
+/*
+ * incremental record (text, one file per translation unit)
+ *
+ *   skcc-incremental <version>
+ *   options <digest>
+ *   source <path>
+ *   output <seconds> <nanoseconds> <size> <path>     absent with -M
+ *   input <seconds> <nanoseconds> <size> <path>      the source file, every file it included and,
+ *                                                    with size -1, every path an include did not find
+ *   messages <size>                                  followed by the diagnostics
+ *   rules <size>                                     followed by the dependency rules
+ */
+
+#define INCREMENTAL_VERSION 2
+
+struct incremental_input {
+  char *path;
+  struct timespec mtime;
+  long size;
+};
+
+struct incremental_record {
+  uint64_t options;
+  char *source;
+  struct incremental_input output;
+  struct incremental_input *inputs;
+  int inputs_size;
+  int inputs_alloc;
+  char *messages;
+  size_t messages_size;
+  char *rules;
+  size_t rules_size;
+};
+
+struct incremental {
+  char *dir;
+  uint64_t options;
+  struct incremental_record *records;
+  struct batch_unit *work;
+  int *indexes;
+  batch_function preprocess;
+  void *data;
+  int size;
+};
+
+extern struct incremental *allocate_incremental(const char *dir, const char *options);
+extern void free_incremental(struct incremental *incremental);
+extern int run_incremental(struct skcc_context *ctx, struct incremental *incremental, struct batch_unit *units, int size, int threads, batch_function preprocess, void *data, FILE *stats);
+extern int watch_incremental(struct skcc_context *ctx, struct incremental *incremental, struct batch_unit *units, int size, int threads, batch_function preprocess, void *data, FILE *stats);
+
+#endif
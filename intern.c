@@ -0,0 +1,132 @@
+#include <stddef.h>
+#include "intern.h"
+
+/*
+ * Open addressing with linear probing. A slot only ever changes from empty
+ * to an atom, by a CAS, so lookups need no lock and finish in a bounded
+ * number of probes. An insert which loses the CAS checks the atom of the
+ * winner and continues probing if it is a different spelling.
+ *
+ * A spelling whose probes find neither itself nor a free slot goes on to
+ * the next segment, which is added by a CAS as well, so the table grows
+ * without moving any atom and every thread follows the same path.
+ */
+
+struct interned {
+  unsigned int hash;
+  int size;
+  unsigned char text[];
+};
+
+struct intern_table *allocate_intern_segment(unsigned int size) {
+  struct intern_table *table = (struct intern_table *) calloc(1, sizeof(struct intern_table) + sizeof(table->slots[0]) * size);
+  if(table == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  table->size = size;
+  return table;
+}
+
+struct intern_table *allocate_intern_table() {
+  return allocate_intern_segment(INTERN_TABLE_SIZE);
+}
+
+// the segment after table, added if there is none yet
+struct intern_table *next_intern_segment(struct intern_table *table) {
+  struct intern_table *next = atomic_load_explicit(&table->next, memory_order_acquire);
+  if(next != NULL) return next;
+
+  struct intern_table *segment = allocate_intern_segment(table->size * 2);
+  if(atomic_compare_exchange_strong_explicit(&table->next, &next, segment, memory_order_acq_rel, memory_order_acquire)) {
+    return segment;
+  }
+  // another thread added one; next is what it stored
+  free(segment);
+  return next;
+}
+
+struct interned *interned_entry(const unsigned char *atom) {
+  return (struct interned *) (atom - offsetof(struct interned, text));
+}
+
+void free_intern_table(struct intern_table *table) {
+  while(table != NULL) {
+    for(unsigned int i = 0; i < table->size; i++) {
+      const unsigned char *atom = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+      if(atom != NULL) {
+        free(interned_entry(atom));
+      }
+    }
+    struct intern_table *next = atomic_load_explicit(&table->next, memory_order_relaxed);
+    free(table);
+    table = next;
+  }
+}
+
+unsigned int intern_hash(const unsigned char *text, int size) {
+  unsigned int h = 2166136261u;
+  for(int i = 0; i < size; i++) {
+    h = (h ^ text[i]) * 16777619u;
+  }
+  return h;
+}
+
+unsigned int interned_hash(const unsigned char *atom) {
+  return interned_entry(atom)->hash;
+}
+
+int match_interned(const unsigned char *atom, unsigned int hash, const unsigned char *text, int size) {
+  struct interned *entry = interned_entry(atom);
+  return entry->hash == hash && entry->size == size && memcmp(atom, text, size) == 0;
+}
+
+// returns NULL if the spelling was never interned
+const unsigned char *find_interned(struct intern_table *table, const unsigned char *text, int size) {
+  unsigned int hash = intern_hash(text, size);
+
+  for(; table != NULL; table = atomic_load_explicit(&table->next, memory_order_acquire)) {
+    unsigned int h = hash & (table->size - 1);
+    for(int i = 0; i < INTERN_PROBE_LIMIT; i++, h = (h + 1) & (table->size - 1)) {
+      const unsigned char *atom = atomic_load_explicit(&table->slots[h], memory_order_acquire);
+      if(atom == NULL) return NULL;
+      if(match_interned(atom, hash, text, size)) return atom;
+    }
+  }
+  return NULL;
+}
+
+const unsigned char *intern_string(struct intern_table *table, const unsigned char *text, int size) {
+  unsigned int hash = intern_hash(text, size);
+  struct interned *entry = NULL;
+
+  for(;; table = next_intern_segment(table)) {
+    unsigned int h = hash & (table->size - 1);
+    for(int i = 0; i < INTERN_PROBE_LIMIT; i++, h = (h + 1) & (table->size - 1)) {
+      const unsigned char *atom = atomic_load_explicit(&table->slots[h], memory_order_acquire);
+
+      if(atom == NULL) {
+        if(entry == NULL) {
+          entry = (struct interned *) malloc(sizeof(struct interned) + size + 1);
+          if(entry == NULL) {
+            perror("malloc");
+            exit(1);
+          }
+          entry->hash = hash;
+          entry->size = size;
+          memcpy(entry->text, text, size);
+          entry->text[size] = '\0';
+        }
+        if(atomic_compare_exchange_strong_explicit(&table->slots[h], &atom, entry->text, memory_order_acq_rel, memory_order_acquire)) {
+          return entry->text;
+        }
+        // another thread took the slot; atom is what it stored
+      }
+
+      if(match_interned(atom, hash, text, size)) {
+        free(entry);
+        return atom;
+      }
+    }
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef __INTERN_INCLUDE__
+#define __INTERN_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "error.h"
+
+/* power of 2; the size of the first segment, each next one is twice as large */
+#define INTERN_TABLE_SIZE (1 << 20)
+// a spelling with no free slot within this many probes goes to the next segment
+#define INTERN_PROBE_LIMIT 256
+
+// atoms are NUL terminated spellings; equal spellings of a table are the same pointer
+struct intern_table {
+  unsigned int size;
+  _Atomic(struct intern_table *) next;
+  _Atomic(const unsigned char *) slots[];
+};
+
+extern struct intern_table *allocate_intern_table();
+extern void free_intern_table(struct intern_table *table);
+extern unsigned int intern_hash(const unsigned char *text, int size);
+extern unsigned int interned_hash(const unsigned char *atom);
+extern const unsigned char *find_interned(struct intern_table *table, const unsigned char *text, int size);
+extern const unsigned char *intern_string(struct intern_table *table, const unsigned char *text, int size);
+
+#endif
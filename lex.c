@@ -1,8 +1,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include "lex.h"
+#include "tokcache.h"
 
-struct pp_token_lexer *allocate_pp_token_lexer(const unsigned char *file);
+struct pp_token_lexer *allocate_pp_token_lexer(struct source_cache *cache, const unsigned char *file);
+struct pp_token_lexer *allocate_pp_token_lexer_fd(struct source_cache *cache, const unsigned char *file, int fd);
+struct pp_token_lexer *allocate_source_lexer(struct source_cache *cache, struct source *src);
 void free_pp_token_lexer(struct pp_token_lexer *lexer);
 struct pp_token *allocate_pp_token();
 void free_pp_token(struct pp_token *token);
@@ -16,6 +19,8 @@ int hex_digit(unsigned char c);
 int octal_digit(unsigned char c);
 int ident_allowed_code(int code);
 int ident_disallowed_init_code(int code);
+void update_lexer_context(struct pp_token_lexer *lexer, struct pp_token *token);
+struct pp_token *replay_pp_token(struct pp_token_lexer *lexer);
 struct pp_token *next_pp_token(struct pp_token_lexer *lexer);
 
 const unsigned char pp_token_name[][32] = {
@@ -32,7 +37,19 @@ const unsigned char pp_token_name[][32] = {
   "other", "none", "place marker"
 };
 
-struct pp_token_lexer *allocate_pp_token_lexer(const unsigned char *file) {
+struct pp_token_lexer *allocate_pp_token_lexer(struct source_cache *cache, const unsigned char *file) {
+  return allocate_pp_token_lexer_fd(cache, file, -1);
+}
+
+struct pp_token_lexer *allocate_pp_token_lexer_fd(struct source_cache *cache, const unsigned char *file, int fd) {
+  return allocate_source_lexer(cache, allocate_source_fd(cache, file, fd));
+}
+
+struct pp_token_lexer *allocate_pp_token_lexer_text(struct source_cache *cache, const unsigned char *file, const unsigned char *text, int size) {
+  return allocate_source_lexer(cache, allocate_source_text(cache, file, text, size));
+}
+
+struct pp_token_lexer *allocate_source_lexer(struct source_cache *cache, struct source *src) {
   const int INIT_SIZE = 64;
 
   struct pp_token_lexer *lexer = (struct pp_token_lexer *) malloc(sizeof(struct pp_token_lexer));
@@ -41,21 +58,20 @@ struct pp_token_lexer *allocate_pp_token_lexer(const unsigned char *file) {
     exit(1);
   }
 
-  lexer->src = allocate_source(file);
+  lexer->src = src;
   lexer->comment_queue_size = 0;
   lexer->queue = (struct utf8c *) malloc(sizeof(struct utf8c) * INIT_SIZE);
   lexer->queue_head = 0;
   lexer->queue_size = 0;
   lexer->queue_allocate_size = INIT_SIZE;
-  lexer->context = CTX_NL;
+  lexer->stream = NULL;
+  lexer->replay = -1;
+  rewind_pp_token_lexer(lexer);
 
-  while(1) {
-    struct utf8c uc = remove_comment(lexer);
-    unsigned char c = uc.sequence[0];
-    if(!(c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\n')) {
-      push_char_queue(lexer, uc);
-      break;
-    }
+  // a file lexed before is replayed from the token cache
+  if(cache->tokens != NULL) {
+    lexer->stream = find_lexed_stream(cache->tokens, lexer);
+    lexer->replay = lexer->stream != NULL ? 0 : -1;
   }
 
   return lexer;
@@ -68,6 +84,11 @@ struct pp_token *allocate_pp_token() {
     exit(1);
   }
   token->text = allocate_string();
+  token->file = NULL;
+  token->offset = -1;
+  token->atom = NULL;
+  token->persistent = 0;
+  token->released = 0;
   return token;
 }
 
@@ -77,6 +98,9 @@ void free_pp_token(struct pp_token *token) {
 }
 
 void free_pp_token_lexer(struct pp_token_lexer *lexer) {
+  if(lexer->stream != NULL) {
+    release_lexed_stream(lexer->src->cache->tokens, lexer->stream);
+  }
   free_source(lexer->src);
   free(lexer->queue);
   free(lexer);
@@ -97,31 +121,19 @@ struct utf8c remove_comment(struct pp_token_lexer *lexer) {
   if(lexer->comment_queue_size == 2) {
     if(lexer->comment_queue[0].sequence[0] == '/') {
       if(lexer->comment_queue[1].sequence[0] == '/') {
-        while(1) {
-          struct utf8c uc = next_source_char(lexer->src);
-          if(uc.bytes == 0) {
-            error("reached end of file while removing \"//...\" comment.\n");
-          }
-          if(uc.sequence[0] == '\n') {
-            break;
-          }
+        if(!skip_source_line(lexer->src)) {
+          error("reached end of file while removing \"//...\" comment.\n");
         }
         struct utf8c uc = single_byte_char('\n');
+        uc.offset = lexer->comment_queue[0].offset;
         lexer->comment_queue_size = 0;
         return uc;
       } else if(lexer->comment_queue[1].sequence[0] == '*') {
-        struct utf8c last = next_source_char(lexer->src);
-        while(1) {
-          struct utf8c uc = next_source_char(lexer->src);
-          if(uc.bytes == 0) {
-            error("reached end of file while removing \"/* ... */\" comment.\n");
-          }
-          if(last.sequence[0] == '*' && uc.sequence[0] == '/') {
-            break;
-          }
-          last = uc;
+        if(!skip_source_comment(lexer->src)) {
+          error("reached end of file while removing \"/* ... */\" comment.\n");
         }
         struct utf8c uc = single_byte_char(' ');
+        uc.offset = lexer->comment_queue[0].offset;
         lexer->comment_queue_size = 0;
         return uc;
       }
@@ -255,7 +267,65 @@ int ident_disallowed_init_code(int code) {
   return 0;
 }
 
+void update_lexer_context(struct pp_token_lexer *lexer, struct pp_token *token) {
+  if(lexer->context == CTX_NL) {
+    if(token->type == PP_SHARP) {
+      lexer->context = CTX_SHARP;
+    } else if(token->type != PP_SPACE) {
+      lexer->context = CTX_NORMAL;
+    }
+  } else if(lexer->context == CTX_SHARP) {
+    if(token->type == PP_IDENT && strcmp(token->text->head, "include") == 0) {
+      lexer->context = CTX_INCLUDE;
+    } else if(token->type != PP_SPACE) {
+      lexer->context = CTX_NORMAL;
+    }
+  } else if(lexer->context == CTX_INCLUDE) {
+    if(token->type != PP_SPACE) {
+      lexer->context = CTX_NORMAL;
+    }
+  } else if(lexer->context == CTX_NORMAL) {
+    if(token->type == PP_NEW_LINE) {
+      lexer->context = CTX_NL;
+    }
+  }
+}
+
+// returns NULL when the record was lexed in another context; the source is lexed from there on
+struct pp_token *replay_pp_token(struct pp_token_lexer *lexer) {
+  const struct lexed_record *record = &lexer->stream->records[lexer->replay];
+  if(record->type != PP_NONE && record->context != lexer->context) {
+    seek_source(lexer->src, record->offset);
+    lexer->comment_queue_size = 0;
+    lexer->queue_head = 0;
+    lexer->queue_size = 0;
+    lexer->replay = -1;
+    return NULL;
+  }
+
+  struct pp_token *token = allocate_pp_token();
+  token->type = record->type;
+  token->name = pp_token_name[token->type];
+  write_string(token->text, (char *) &lexer->stream->strings[record->text]);
+  token->concat = 0;
+  token->file = lexer->src->file;
+  token->offset = record->offset;
+
+  // the end of file is returned again and again like the source does
+  if(record->type != PP_NONE) {
+    lexer->replay++;
+  }
+  update_lexer_context(lexer, token);
+
+  return token;
+}
+
 struct pp_token *next_pp_token(struct pp_token_lexer *lexer) {
+  if(lexer->replay >= 0) {
+    struct pp_token *token = replay_pp_token(lexer);
+    if(token != NULL) return token;
+  }
+
   enum pp_token_lexer_state state = ST_START;
   enum pp_token_type type;
   int count = 0;
@@ -1280,6 +1350,8 @@ struct pp_token *next_pp_token(struct pp_token_lexer *lexer) {
   }
 
   struct pp_token *token = allocate_pp_token();
+  token->file = lexer->src != NULL ? lexer->src->file : NULL;
+  token->offset = lexer->queue[lexer->queue_head].offset;
   if(count == 0) {
     struct utf8c uc = pop_char_queue(lexer);
     if(uc.bytes == 0) {
@@ -1360,28 +1432,34 @@ struct pp_token *next_pp_token(struct pp_token_lexer *lexer) {
   }
   token->name = pp_token_name[token->type];
   token->concat = 0;
+  update_lexer_context(lexer, token);
 
-  if(lexer->context == CTX_NL) {
-    if(token->type == PP_SHARP) {
-      lexer->context = CTX_SHARP;
-    } else if(token->type != PP_SPACE) {
-      lexer->context = CTX_NORMAL;
-    }
-  } else if(lexer->context == CTX_SHARP) {
-    if(token->type == PP_IDENT && strcmp(token->text->head, "include") == 0) {
-      lexer->context = CTX_INCLUDE;
-    } else if(token->type != PP_SPACE) {
-      lexer->context = CTX_NORMAL;
-    }
-  } else if(lexer->context == CTX_INCLUDE) {
-    if(token->type != PP_SPACE) {
-      lexer->context = CTX_NORMAL;
-    }
-  } else if(lexer->context == CTX_NORMAL) {
-    if(token->type == PP_NEW_LINE) {
-      lexer->context = CTX_NL;
-    }
+  return token;
+}
+
+void seek_pp_token_lexer(struct pp_token_lexer *lexer, int offset) {
+  seek_source(lexer->src, offset);
+  lexer->comment_queue_size = 0;
+  lexer->queue_head = 0;
+  lexer->queue_size = 0;
+  lexer->context = CTX_NL;
+  if(lexer->stream != NULL) {
+    lexer->replay = search_lexed_record(lexer->stream, offset);
   }
+}
 
-  return token;
+// back to the first token; the white spaces at the beginning of the file are skipped
+void rewind_pp_token_lexer(struct pp_token_lexer *lexer) {
+  seek_pp_token_lexer(lexer, 0);
+  while(1) {
+    struct utf8c uc = remove_comment(lexer);
+    unsigned char c = uc.sequence[0];
+    if(!(c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\n')) {
+      push_char_queue(lexer, uc);
+      break;
+    }
+  }
+  if(lexer->stream != NULL) {
+    lexer->replay = 0;
+  }
 }
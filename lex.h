@@ -60,6 +60,8 @@ enum pp_token_type {
 
 enum pp_token_lexer_context { CTX_NL, CTX_SHARP, CTX_INCLUDE, CTX_NORMAL };
 
+struct lexed_stream;
+
 struct pp_token_lexer {
   struct source *src;
   int comment_queue_size;
@@ -69,6 +71,8 @@ struct pp_token_lexer {
   int queue_size;
   int queue_allocate_size;
   enum pp_token_lexer_context context;
+  const struct lexed_stream *stream;
+  int replay;
 };
 
 struct pp_token {
@@ -76,14 +80,23 @@ struct pp_token {
   const unsigned char *name;
   struct string *text;
   int concat;
+  const unsigned char *file;
+  int offset;
+  const unsigned char *atom;
+  int persistent;
+  int released;
 };
 
 extern const unsigned char pp_token_name[][32];
 
-extern struct pp_token_lexer *allocate_pp_token_lexer(const unsigned char *file);
+extern struct pp_token_lexer *allocate_pp_token_lexer(struct source_cache *cache, const unsigned char *file);
+extern struct pp_token_lexer *allocate_pp_token_lexer_fd(struct source_cache *cache, const unsigned char *file, int fd);
+extern struct pp_token_lexer *allocate_pp_token_lexer_text(struct source_cache *cache, const unsigned char *file, const unsigned char *text, int size);
 extern void free_pp_token_lexer(struct pp_token_lexer *lexer);
 extern struct pp_token *allocate_pp_token();
 extern void free_pp_token(struct pp_token *token);
 extern struct pp_token *next_pp_token(struct pp_token_lexer *lexer);
+extern void seek_pp_token_lexer(struct pp_token_lexer *lexer, int offset);
+extern void rewind_pp_token_lexer(struct pp_token_lexer *lexer);
 
 #endif
@@ -1,26 +1,423 @@
+#include <unistd.h>
 #include "main.h"
 
-int main(int argc, char **argv) {
-  if(argc < 2) {
-    error("usage: skcc [source file name]");
+char *option_argument(int argc, char **argv, int *i, char *option) {
+  int length = strlen(option);
+  if(argv[*i][length] != '\0') {
+    return &argv[*i][length];
+  }
+  if(*i + 1 >= argc) {
+    error("missing argument to \"%s\".", option);
+  }
+  return argv[++(*i)];
+}
+
+// input files given on the command line or listed by --batch
+void add_input_file(struct input_files *inputs, char *file) {
+  if(inputs->size == inputs->alloc_size) {
+    inputs->alloc_size = inputs->alloc_size == 0 ? 16 : inputs->alloc_size * 2;
+    inputs->files = (char **) realloc(inputs->files, sizeof(char *) * inputs->alloc_size);
+    if(inputs->files == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  inputs->files[inputs->size++] = file;
+}
+
+void read_batch_list(struct input_files *inputs, const char *list) {
+  FILE *fp = fopen(list, "r");
+  if(fp == NULL) {
+    error("failed to open batch list: %s", list);
+  }
+
+  char *line = NULL;
+  size_t alloc_size = 0;
+  ssize_t length;
+  while((length = getline(&line, &alloc_size, fp)) >= 0) {
+    while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' || line[length - 1] == ' ')) {
+      line[--length] = '\0';
+    }
+    if(length == 0) continue;
+    add_input_file(inputs, strdup(line));
+  }
+
+  free(line);
+  fclose(fp);
+}
+
+// batch output: the source path with its suffix replaced by ".i"
+char *batch_output_file(const char *source) {
+  int length = strlen(source);
+  int suffix = length;
+  for(int i = length - 1; i >= 0 && source[i] != '/'; i--) {
+    if(source[i] == '.') {
+      suffix = i;
+      break;
+    }
+  }
+
+  char *file = (char *) malloc(sizeof(char) * (suffix + 3));
+  if(file == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(file, source, suffix);
+  strcpy(&file[suffix], ".i");
+  return file;
+}
+
+// preprocess a translation unit to the output file, or to the standard output if it is NULL
+int preprocess_file(struct skcc_context *ctx, char *file, char *output_file, struct output_options *options) {
+  int status;
+  struct output *out;
+  if(output_file != NULL) {
+    out = allocate_output_file(output_file, options->mapped);
+  } else {
+    out = allocate_output_fd(1);
+  }
+  if(options->pipeline) {
+    start_output_writer(out);
+  }
+  ctx->dependencies->options.output = output_file;
+
+  if(options->binary) {
+    struct token_stream *stream = allocate_token_stream();
+    struct pp_sink *sink = allocate_token_stream_sink(stream);
+    status = skcc_preprocess(ctx, file, sink);
+    finish_token_stream(stream, out);
+    free_pp_sink(sink);
+    free_token_stream(stream);
+  } else if(options->compact) {
+    struct compact_output *output = allocate_compact_output(out, options->markers);
+    struct pp_sink *sink = allocate_compact_sink(output);
+    status = skcc_preprocess(ctx, file, sink);
+    free_pp_sink(sink);
+    free_compact_output(output);
+  } else {
+    struct pp_sink *sink = allocate_output_sink(out);
+    status = skcc_preprocess(ctx, file, sink);
+    free_pp_sink(sink);
+  }
+  ctx->dependencies->options.output = NULL;
+
+  // a failed run leaves no partial output file behind
+  if(status != 0) {
+    discard_output(out);
+  }
+  free_output(out);
+  if(status != 0 && output_file != NULL) {
+    unlink(output_file);
+  }
+
+  return status;
+}
+
+// an error outside the preprocessing, such as an output file which cannot be opened, fails only the unit
+int preprocess_batch_unit(struct skcc_context *ctx, struct batch_unit *unit, void *data) {
+  jmp_buf jump;
+  jmp_buf *saved_jump = error_jump;
+  int status;
+
+  error_jump = &jump;
+  if(setjmp(jump) == 0) {
+    status = preprocess_file(ctx, unit->source, unit->output, (struct output_options *) data);
+  } else {
+    status = 1;
+  }
+  error_jump = saved_jump;
+
+  return status;
+}
+
+// the options of scheduling and statistics leave the output as it is, so they are left out of incremental records
+int check_output_option(const char *option) {
+  const char *others[] = { "-j", "--batch", "--incremental", "--watch" };
+  for(int i = 0; i < (int) (sizeof(others) / sizeof(others[0])); i++) {
+    if(strncmp(option, others[i], strlen(others[i])) == 0) return 0;
+  }
+  int length = strlen(option);
+  return length < 6 || strcmp(&option[length - 6], "-stats") != 0;
+}
+
+int execute_command(struct skcc_context *ctx, struct command *command, int argc, char **argv) {
+  struct input_files *inputs = &command->inputs;
+  struct output_options options = { NULL, 0, 0, 0, 0, 0 };
+  int batch = 0;
+  int threads = 1;
+  int prefetch_stats = 0;
+  int speculate_stats = 0;
+  int token_cache_stats = 0;
+  long token_cache_limit = 0;
+  char *snapshot_input = NULL;
+  char *snapshot_output = NULL;
+  char *zygote_prefix = NULL;
+  int zygote_stats = 0;
+  char *incremental_dir = NULL;
+  int incremental_stats = 0;
+  int watch = 0;
+  int header_cache_stats = 0;
+  struct string *signature = command->signature;
+  struct dependency_options *dependency_options = &ctx->dependencies->options;
+
+  for(int i = 1; i < argc; i++) {
+    int first = i;
+    if(strncmp(argv[i], "-include-snapshot", 17) == 0) {
+      snapshot_input = option_argument(argc, argv, &i, "-include-snapshot");
+    } else if(strncmp(argv[i], "--write-snapshot", 16) == 0) {
+      snapshot_output = option_argument(argc, argv, &i, "--write-snapshot");
+    } else if(strncmp(argv[i], "-isystem", 8) == 0) {
+      add_include_path(ctx->search, PATH_SYSTEM, option_argument(argc, argv, &i, "-isystem"));
+    } else if(strncmp(argv[i], "-iquote", 7) == 0) {
+      add_include_path(ctx->search, PATH_QUOTE, option_argument(argc, argv, &i, "-iquote"));
+    } else if(strncmp(argv[i], "-D", 2) == 0) {
+      add_macro_definition(ctx, "-D", option_argument(argc, argv, &i, "-D"));
+    } else if(strncmp(argv[i], "-U", 2) == 0) {
+      add_macro_definition(ctx, "-U", option_argument(argc, argv, &i, "-U"));
+    } else if(strncmp(argv[i], "-I", 2) == 0) {
+      add_include_path(ctx->search, PATH_BRACKET, option_argument(argc, argv, &i, "-I"));
+    } else if(strcmp(argv[i], "-M") == 0 || strcmp(argv[i], "-MM") == 0) {
+      dependency_options->enabled = 1;
+      dependency_options->only = 1;
+      dependency_options->system = argv[i][2] != 'M';
+    } else if(strcmp(argv[i], "-MD") == 0 || strcmp(argv[i], "-MMD") == 0) {
+      dependency_options->enabled = 1;
+      dependency_options->system = argv[i][2] != 'M';
+    } else if(strncmp(argv[i], "-MF", 3) == 0) {
+      dependency_options->file = option_argument(argc, argv, &i, "-MF");
+    } else if(strncmp(argv[i], "-MT", 3) == 0) {
+      dependency_options->target = option_argument(argc, argv, &i, "-MT");
+    } else if(strncmp(argv[i], "-o", 2) == 0) {
+      options.file = option_argument(argc, argv, &i, "-o");
+    } else if(strcmp(argv[i], "--mmap-output") == 0) {
+      options.mapped = 1;
+    } else if(strcmp(argv[i], "--pipeline") == 0) {
+      options.pipeline = 1;
+    } else if(strcmp(argv[i], "--binary-output") == 0) {
+      options.binary = 1;
+    } else if(strcmp(argv[i], "-P") == 0) {
+      options.compact = 1;
+    } else if(strcmp(argv[i], "--line-markers") == 0) {
+      options.compact = 1;
+      options.markers = 1;
+    } else if(strncmp(argv[i], "--source-cache-limit=", 21) == 0) {
+      set_source_cache_limit(ctx->sources, atol(&argv[i][21]));
+    } else if(strncmp(argv[i], "--token-cache=", 14) == 0) {
+      if(ctx->sources->tokens == NULL) {
+        ctx->sources->tokens = allocate_token_cache(&argv[i][14]);
+      }
+    } else if(strncmp(argv[i], "--token-cache-limit=", 20) == 0) {
+      token_cache_limit = atol(&argv[i][20]);
+    } else if(strcmp(argv[i], "--token-cache-stats") == 0) {
+      token_cache_stats = 1;
+    } else if(strncmp(argv[i], "--prefetch=", 11) == 0) {
+      if(ctx->prefetch == NULL && atoi(&argv[i][11]) > 0) {
+        ctx->prefetch = allocate_prefetcher(ctx->sources, ctx->search, atoi(&argv[i][11]));
+      }
+    } else if(strcmp(argv[i], "--prefetch-stats") == 0) {
+      prefetch_stats = 1;
+    } else if(strncmp(argv[i], "--speculate=", 12) == 0) {
+      if(ctx->speculator == NULL && atoi(&argv[i][12]) > 0) {
+        ctx->speculator = allocate_speculator(ctx, atoi(&argv[i][12]));
+      }
+    } else if(strcmp(argv[i], "--speculate-stats") == 0) {
+      speculate_stats = 1;
+    } else if(strcmp(argv[i], "--zygote-stats") == 0) {
+      zygote_stats = 1;
+    } else if(strncmp(argv[i], "--zygote", 8) == 0) {
+      zygote_prefix = option_argument(argc, argv, &i, "--zygote");
+    } else if(strcmp(argv[i], "--incremental-stats") == 0) {
+      incremental_stats = 1;
+    } else if(strncmp(argv[i], "--incremental=", 14) == 0) {
+      incremental_dir = &argv[i][14];
+    } else if(strcmp(argv[i], "--watch") == 0) {
+      watch = 1;
+    } else if(strcmp(argv[i], "--header-cache") == 0) {
+      if(ctx->headers == NULL) {
+        ctx->headers = allocate_header_cache();
+      }
+    } else if(strcmp(argv[i], "--header-cache-stats") == 0) {
+      header_cache_stats = 1;
+    } else if(strncmp(argv[i], "--batch", 7) == 0) {
+      read_batch_list(inputs, option_argument(argc, argv, &i, "--batch"));
+      batch = 1;
+    } else if(strncmp(argv[i], "-j", 2) == 0) {
+      threads = atoi(option_argument(argc, argv, &i, "-j"));
+      if(threads < 1) {
+        error("invalid number of threads: %d", threads);
+      }
+    } else if(argv[i][0] == '-') {
+      error("unknown option: %s", argv[i]);
+    } else {
+      add_input_file(inputs, strdup(argv[i]));
+    }
+
+    if(argv[first][0] == '-' && check_output_option(argv[first])) {
+      for(int j = first; j <= i; j++) {
+        write_string(signature, argv[j]);
+        append_string(signature, '\n');
+      }
+    }
+  }
+
+  if(inputs->size == 0 && !batch) {
+    error("usage: skcc [--server socket | --client socket] [-D name[=definition]] [-U name] [-I dir] [-isystem dir] [-iquote dir] [-M|-MM|-MD|-MMD] [-MF file] [-MT target] [-o file] [-include-snapshot file] [--write-snapshot file] [--mmap-output] [--pipeline] [--binary-output] [-P [--line-markers]] [--source-cache-limit=bytes] [--token-cache=dir [--token-cache-limit=bytes] [--token-cache-stats]] [--prefetch=threads [--prefetch-stats]] [--speculate=threads [--speculate-stats]] [--zygote prefix [--zygote-stats]] [--incremental=dir [--incremental-stats] [--watch]] [--header-cache [--header-cache-stats]] [--batch list] [-j threads] [source file name...]");
+  }
+
+  // the snapshot is checked against the include paths and definitions, which may come after it
+  if(snapshot_input != NULL) {
+    ctx->snapshot = load_macro_snapshot(ctx, snapshot_input);
+  }
+
+  if(token_cache_limit > 0 && ctx->sources->tokens != NULL) {
+    set_token_cache_limit(ctx->sources->tokens, token_cache_limit);
+  }
+
+  // the children of a zygote would not inherit the threads of the pools
+  if(zygote_prefix != NULL && (ctx->prefetch != NULL || ctx->speculator != NULL || ctx->snapshot != NULL || snapshot_output != NULL)) {
+    error("--zygote cannot be used with --prefetch, --speculate or snapshots.");
+  }
+  // a speculation would replay the includes of its run without recording them
+  if(incremental_dir != NULL && (zygote_prefix != NULL || ctx->speculator != NULL || snapshot_output != NULL)) {
+    error("--incremental cannot be used with --zygote, --speculate or --write-snapshot.");
+  }
+  // a snapshot is loaded once, so it would not follow the changes of its headers
+  if(watch && (incremental_dir == NULL || ctx->snapshot != NULL)) {
+    error("--watch needs --incremental and cannot be used with -include-snapshot.");
+  }
+  // a committed speculation applies the macros of a header without the lookups being recorded
+  if(ctx->headers != NULL && ctx->speculator != NULL) {
+    error("--header-cache cannot be used with --speculate.");
+  }
+
+  int status = 0;
+  if(snapshot_output != NULL) {
+    if(inputs->size != 1 || batch) {
+      error("--write-snapshot takes one prefix header.");
+    }
+    status = write_macro_snapshot(ctx, inputs->files[0], snapshot_output);
+  } else if(inputs->size == 1 && !batch && zygote_prefix == NULL && incremental_dir == NULL) {
+    status = preprocess_file(ctx, inputs->files[0], options.file, &options);
+  } else {
+    if(options.file != NULL || dependency_options->file != NULL || dependency_options->target != NULL) {
+      error("-o, -MF and -MT cannot be used with several source files, --zygote or --incremental.");
+    }
+
+    struct batch_unit *units = (struct batch_unit *) calloc(inputs->size, sizeof(struct batch_unit));
+    if(units == NULL) {
+      perror("calloc");
+      exit(1);
+    }
+    command->units = units;
+    for(int i = 0; i < inputs->size; i++) {
+      units[i].source = inputs->files[i];
+      units[i].output = dependency_options->only ? NULL : batch_output_file(inputs->files[i]);
+      // an input already named like its output would be truncated before it is read
+      if(units[i].output != NULL && strcmp(units[i].output, units[i].source) == 0) {
+        error("output file is the same as the source file: %s\n", units[i].source);
+      }
+    }
+
+    if(zygote_prefix != NULL) {
+      status = run_zygote(ctx, zygote_prefix, units, inputs->size, threads, preprocess_batch_unit, &options, zygote_stats ? stderr : NULL);
+    } else if(incremental_dir != NULL) {
+      struct incremental *incremental = allocate_incremental(incremental_dir, (char *) signature->head);
+      command->incremental = incremental;
+      if(watch) {
+        status = watch_incremental(ctx, incremental, units, inputs->size, threads, preprocess_batch_unit, &options, incremental_stats ? stderr : NULL);
+      } else {
+        status = run_incremental(ctx, incremental, units, inputs->size, threads, preprocess_batch_unit, &options, incremental_stats ? stderr : NULL);
+      }
+      free_incremental(incremental);
+      command->incremental = NULL;
+    } else {
+      // the caches of the context are shared by all the translation units and threads
+      status = run_batch(ctx, units, inputs->size, threads, preprocess_batch_unit, &options);
+    }
+  }
+
+  if(token_cache_stats && ctx->sources->tokens != NULL) {
+    write_token_cache_stats(ctx->sources->tokens, stderr);
+  }
+  if(prefetch_stats && ctx->prefetch != NULL) {
+    write_prefetch_stats(ctx->prefetch, stderr);
   }
+  if(speculate_stats && ctx->speculator != NULL) {
+    write_speculation_stats(ctx->speculator, stderr);
+  }
+  if(header_cache_stats && ctx->headers != NULL) {
+    write_header_cache_stats(ctx->headers, stderr);
+  }
+
+  return status;
+}
+
+// runs one command line with ctx; the server calls it for every request, so an error frees what the command allocated
+int run_command(struct skcc_context *ctx, int argc, char **argv) {
+  struct command *command = (struct command *) calloc(1, sizeof(struct command));
+  if(command == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  command->signature = allocate_string();
+
+  jmp_buf jump;
+  jmp_buf *saved_jump = error_jump;
+  int status;
 
-  char *file = argv[1];
-  struct pp_list *list = preprocess(file);
+  error_jump = &jump;
+  if(setjmp(jump) == 0) {
+    status = execute_command(ctx, command, argc, argv);
+  } else {
+    status = 1;
+  }
+  error_jump = saved_jump;
 
-  /* for(struct pp_node *node = list->head; node != NULL; node = node->next) { */
-  /*   struct pp_token *token = node->token; */
-  /*   printf("(%d, %s)", token->type, token->name); */
-  /*   if(token->type != PP_NEW_LINE && token->type != PP_SPACE && token->type != PP_NONE) { */
-  /*     printf(" %s", token->text->head); */
-  /*   } */
-  /*   printf("\n"); */
-  /* } */
+  if(ctx->snapshot != NULL) {
+    free_macro_snapshot(ctx->snapshot);
+    ctx->snapshot = NULL;
+  }
+  if(ctx->headers != NULL) {
+    free_header_cache(ctx->headers);
+    ctx->headers = NULL;
+  }
+  if(command->incremental != NULL) {
+    free_incremental(command->incremental);
+  }
+  if(command->units != NULL) {
+    for(int i = 0; i < command->inputs.size; i++) {
+      free(command->units[i].output);
+    }
+    free(command->units);
+  }
+  for(int i = 0; i < command->inputs.size; i++) {
+    free(command->inputs.files[i]);
+  }
+  free(command->inputs.files);
+  free_string(command->signature);
+  free(command);
+
+  return status;
+}
+
+
+int main(int argc, char **argv) {
+  // the client only forwards the command line
+  if(argc > 1 && strncmp(argv[1], "--client", 8) == 0) {
+    int i = 1;
+    char *socket_path = option_argument(argc, argv, &i, "--client");
+    return run_client(socket_path, argc - i - 1, &argv[i + 1]);
+  }
 
-  for(struct pp_node *node = list->head; node != NULL; node = node->next) {
-    struct pp_token *token = node->token;
-    printf("%s", token->text->head);
+  struct skcc_context *ctx = allocate_skcc_context();
+  int status;
+  if(argc > 1 && strncmp(argv[1], "--server", 8) == 0) {
+    int i = 1;
+    status = run_server(ctx, option_argument(argc, argv, &i, "--server"));
+  } else {
+    status = run_command(ctx, argc, argv);
   }
+  free_skcc_context(ctx);
 
-  return 0;
+  return status;
 }
@@ -2,5 +2,38 @@
 #define __MAIN_INCLUDE__
 
 #include "preprocess.h"
+#include "binary.h"
+#include "batch.h"
+#include "speculate.h"
+#include "snapshot.h"
+#include "zygote.h"
+#include "incremental.h"
+#include "hdrcache.h"
+#include "server.h"
+
+struct input_files {
+  char **files;
+  int size;
+  int alloc_size;
+};
+
+struct output_options {
+  char *file;
+  int mapped;
+  int binary;
+  int compact;
+  int markers;
+  int pipeline;
+};
+
+// what a command line allocates; it is freed also when an error ends the command
+struct command {
+  struct input_files inputs;
+  struct batch_unit *units;
+  struct incremental *incremental;
+  struct string *signature;
+};
+
+extern int run_command(struct skcc_context *ctx, int argc, char **argv);
 
 #endif
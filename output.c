@@ -0,0 +1,238 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "output.h"
+
+struct output *allocate_output(int fd, int mapped) {
+  struct output *out = (struct output *) malloc(sizeof(struct output));
+  if(out == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  out->fd = fd;
+  out->mapped = mapped;
+  out->size = 0;
+  out->map_offset = 0;
+  out->written = 0;
+  out->ring = NULL;
+
+  if(mapped) {
+    out->buffer = NULL;
+    out->capacity = 0;
+  } else {
+    out->buffer = (unsigned char *) malloc(sizeof(unsigned char) * OUTPUT_BUFFER_SIZE);
+    if(out->buffer == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    out->capacity = OUTPUT_BUFFER_SIZE;
+  }
+
+  return out;
+}
+
+struct output *allocate_output_fd(int fd) {
+  return allocate_output(fd, 0);
+}
+
+struct output *allocate_output_file(const char *file, int mapped) {
+  int fd = open(file, mapped ? O_RDWR | O_CREAT | O_TRUNC : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    error("failed to open output file: %s\n", file);
+  }
+  return allocate_output(fd, mapped);
+}
+
+void write_all(int fd, const unsigned char *data, long size) {
+  while(size > 0) {
+    ssize_t n = write(fd, data, size);
+    if(n < 0) {
+      error("failed to write output.\n");
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+// mapped output: the file is extended and mapped one window at a time
+void unmap_window(struct output *out) {
+  if(out->buffer == NULL) return;
+  munmap(out->buffer, out->capacity);
+  out->map_offset += out->size;
+  out->buffer = NULL;
+  out->size = 0;
+  out->capacity = 0;
+}
+
+void map_window(struct output *out) {
+  unmap_window(out);
+
+  if(ftruncate(out->fd, out->map_offset + OUTPUT_MAP_SIZE) < 0) {
+    perror("ftruncate");
+    exit(1);
+  }
+  out->buffer = (unsigned char *) mmap(NULL, OUTPUT_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, out->map_offset);
+  if(out->buffer == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  out->capacity = OUTPUT_MAP_SIZE;
+}
+
+/*
+ * Pipelined output: a writer thread drains the chunks filled by the
+ * preprocessing thread, so that write(2) runs alongside the macro
+ * expansion. The ring is single producer, single consumer; the producer
+ * always holds the chunk it fills, and the semaphores count the filled
+ * chunks and the empty ones it may take next. A negative size ends it.
+ */
+void *run_output_writer(void *arg) {
+  struct output_ring *ring = (struct output_ring *) arg;
+
+  while(1) {
+    sem_wait(&ring->filled);
+    long size = ring->sizes[ring->tail];
+    if(size < 0) break;
+    write_all(ring->fd, ring->chunks[ring->tail], size);
+    ring->tail = (ring->tail + 1) % OUTPUT_RING_SIZE;
+    sem_post(&ring->empty);
+  }
+
+  return NULL;
+}
+
+// mapped outputs have no write(2) to overlap and stay as they are
+void start_output_writer(struct output *out) {
+  if(out->mapped || out->ring != NULL) return;
+
+  flush_output(out);
+
+  struct output_ring *ring = (struct output_ring *) malloc(sizeof(struct output_ring));
+  if(ring == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for(int i = 0; i < OUTPUT_RING_SIZE; i++) {
+    ring->chunks[i] = (unsigned char *) malloc(sizeof(unsigned char) * OUTPUT_CHUNK_SIZE);
+    if(ring->chunks[i] == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+  }
+  ring->head = 0;
+  ring->tail = 0;
+  sem_init(&ring->filled, 0, 0);
+  sem_init(&ring->empty, 0, OUTPUT_RING_SIZE - 1);
+  ring->fd = out->fd;
+
+  if(pthread_create(&ring->writer, NULL, run_output_writer, ring) != 0) {
+    perror("pthread_create");
+    exit(1);
+  }
+
+  free(out->buffer);
+  out->ring = ring;
+  out->buffer = ring->chunks[0];
+  out->capacity = OUTPUT_CHUNK_SIZE;
+}
+
+void submit_output_chunk(struct output *out, long size) {
+  struct output_ring *ring = out->ring;
+  ring->sizes[ring->head] = size;
+  sem_post(&ring->filled);
+  if(size < 0) return;
+
+  ring->head = (ring->head + 1) % OUTPUT_RING_SIZE;
+  sem_wait(&ring->empty);
+  out->buffer = ring->chunks[ring->head];
+  out->size = 0;
+}
+
+void stop_output_writer(struct output *out) {
+  struct output_ring *ring = out->ring;
+  flush_output(out);
+  submit_output_chunk(out, -1);
+  pthread_join(ring->writer, NULL);
+
+  for(int i = 0; i < OUTPUT_RING_SIZE; i++) {
+    free(ring->chunks[i]);
+  }
+  sem_destroy(&ring->filled);
+  sem_destroy(&ring->empty);
+  free(ring);
+  out->ring = NULL;
+  out->buffer = NULL;
+}
+
+void write_output(struct output *out, const unsigned char *data, long size) {
+  out->written += size;
+
+  // the data goes through the windows or chunks in order
+  if(out->mapped || out->ring != NULL) {
+    while(size > 0) {
+      if(out->size == out->capacity) {
+        if(out->mapped) {
+          map_window(out);
+        } else {
+          flush_output(out);
+        }
+      }
+      long n = out->capacity - out->size < size ? out->capacity - out->size : size;
+      memcpy(out->buffer + out->size, data, n);
+      out->size += n;
+      data += n;
+      size -= n;
+    }
+    return;
+  }
+
+  if(out->size + size > out->capacity) {
+    flush_output(out);
+    if(size > out->capacity) {
+      write_all(out->fd, data, size);
+      return;
+    }
+  }
+  memcpy(out->buffer + out->size, data, size);
+  out->size += size;
+}
+
+void flush_output(struct output *out) {
+  if(out->mapped) return;
+  if(out->ring != NULL) {
+    if(out->size > 0) {
+      submit_output_chunk(out, out->size);
+    }
+    return;
+  }
+  write_all(out->fd, out->buffer, out->size);
+  out->size = 0;
+}
+
+// drop the buffered data which is not written out yet
+void discard_output(struct output *out) {
+  if(out->mapped) return;
+  out->written -= out->size;
+  out->size = 0;
+}
+
+void free_output(struct output *out) {
+  if(out->mapped) {
+    unmap_window(out);
+    if(ftruncate(out->fd, out->written) < 0) {
+      perror("ftruncate");
+      exit(1);
+    }
+  } else if(out->ring != NULL) {
+    stop_output_writer(out);
+  } else {
+    flush_output(out);
+    free(out->buffer);
+  }
+
+  if(out->fd > 2) {
+    close(out->fd);
+  }
+  free(out);
+}
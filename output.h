@@ -0,0 +1,48 @@
+#ifndef __OUTPUT_INCLUDE__
+#define __OUTPUT_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "error.h"
+
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define OUTPUT_MAP_SIZE (64 * 1024 * 1024)
+
+#define OUTPUT_CHUNK_SIZE (64 * 1024)
+#define OUTPUT_RING_SIZE 16
+
+// chunks passed from the preprocessing thread to the writer thread
+struct output_ring {
+  unsigned char *chunks[OUTPUT_RING_SIZE];
+  long sizes[OUTPUT_RING_SIZE];
+  int head;
+  int tail;
+  sem_t filled;
+  sem_t empty;
+  int fd;
+  pthread_t writer;
+};
+
+struct output {
+  int fd;
+  int mapped;
+  unsigned char *buffer;
+  long size;
+  long capacity;
+  long map_offset;
+  long written;
+  struct output_ring *ring;
+};
+
+extern struct output *allocate_output_fd(int fd);
+extern struct output *allocate_output_file(const char *file, int mapped);
+extern void start_output_writer(struct output *out);
+extern void write_output(struct output *out, const unsigned char *data, long size);
+extern void flush_output(struct output *out);
+extern void discard_output(struct output *out);
+extern void free_output(struct output *out);
+
+#endif
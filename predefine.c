@@ -0,0 +1,501 @@
+#include "predefine.h"
+
+/*
+ * Compiled-in predefined macros: those of gcc 12 for C11 on x86_64 Linux,
+ * except __STDC_HOSTED__, which would lead the headers of gcc into
+ * #include_next. The replacement lists are stored already split into
+ * tokens. A context lays them out once in a few arrays with the names
+ * interned, and every run links the entries into the macro table without
+ * allocating.
+ */
+
+#define IDENT(text) { PP_IDENT, text }
+#define NUM(text) { PP_NUM, text }
+#define STR(text) { PP_STR, text }
+#define PUNCT(type, text) { type, text }
+#define SPACE { PP_SPACE, " " }
+
+#define PREDEFINED_TOKENS(...) (const struct predefined_token[]) { __VA_ARGS__ }, sizeof((const struct predefined_token[]) { __VA_ARGS__ }) / sizeof(struct predefined_token)
+#define PREDEFINED(identifier, ...) { identifier, NULL, PREDEFINED_TOKENS(__VA_ARGS__) }
+#define PREDEFINED_FUNCTION(identifier, parameter, ...) { identifier, parameter, PREDEFINED_TOKENS(__VA_ARGS__) }
+#define PREDEFINED_EMPTY(identifier) { identifier, NULL, NULL, 0 }
+
+const struct predefined_macro predefined_macros[] = {
+  PREDEFINED("_LP64", NUM("1")),
+  PREDEFINED("_STDC_PREDEF_H", NUM("1")),
+  PREDEFINED("__ATOMIC_ACQUIRE", NUM("2")),
+  PREDEFINED("__ATOMIC_ACQ_REL", NUM("4")),
+  PREDEFINED("__ATOMIC_CONSUME", NUM("1")),
+  PREDEFINED("__ATOMIC_HLE_ACQUIRE", NUM("65536")),
+  PREDEFINED("__ATOMIC_HLE_RELEASE", NUM("131072")),
+  PREDEFINED("__ATOMIC_RELAXED", NUM("0")),
+  PREDEFINED("__ATOMIC_RELEASE", NUM("3")),
+  PREDEFINED("__ATOMIC_SEQ_CST", NUM("5")),
+  PREDEFINED("__BIGGEST_ALIGNMENT__", NUM("16")),
+  PREDEFINED("__BYTE_ORDER__", IDENT("__ORDER_LITTLE_ENDIAN__")),
+  PREDEFINED("__CHAR16_TYPE__", IDENT("short"), SPACE, IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__CHAR32_TYPE__", IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__CHAR_BIT__", NUM("8")),
+  PREDEFINED("__DBL_DECIMAL_DIG__", NUM("17")),
+  PREDEFINED("__DBL_DENORM_MIN__", PUNCT(PP_LPAREN, "("), PUNCT(PP_LPAREN, "("), IDENT("double"), PUNCT(PP_RPAREN, ")"), NUM("4.94065645841246544176568792868221372e-324L"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__DBL_DIG__", NUM("15")),
+  PREDEFINED("__DBL_EPSILON__", PUNCT(PP_LPAREN, "("), PUNCT(PP_LPAREN, "("), IDENT("double"), PUNCT(PP_RPAREN, ")"), NUM("2.22044604925031308084726333618164062e-16L"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__DBL_HAS_DENORM__", NUM("1")),
+  PREDEFINED("__DBL_HAS_INFINITY__", NUM("1")),
+  PREDEFINED("__DBL_HAS_QUIET_NAN__", NUM("1")),
+  PREDEFINED("__DBL_IS_IEC_60559__", NUM("2")),
+  PREDEFINED("__DBL_MANT_DIG__", NUM("53")),
+  PREDEFINED("__DBL_MAX_10_EXP__", NUM("308")),
+  PREDEFINED("__DBL_MAX_EXP__", NUM("1024")),
+  PREDEFINED("__DBL_MAX__", PUNCT(PP_LPAREN, "("), PUNCT(PP_LPAREN, "("), IDENT("double"), PUNCT(PP_RPAREN, ")"), NUM("1.79769313486231570814527423731704357e+308L"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__DBL_MIN_10_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("307"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__DBL_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("1021"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__DBL_MIN__", PUNCT(PP_LPAREN, "("), PUNCT(PP_LPAREN, "("), IDENT("double"), PUNCT(PP_RPAREN, ")"), NUM("2.22507385850720138309023271733240406e-308L"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__DBL_NORM_MAX__", PUNCT(PP_LPAREN, "("), PUNCT(PP_LPAREN, "("), IDENT("double"), PUNCT(PP_RPAREN, ")"), NUM("1.79769313486231570814527423731704357e+308L"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__DEC128_EPSILON__", NUM("1E-33DL")),
+  PREDEFINED("__DEC128_MANT_DIG__", NUM("34")),
+  PREDEFINED("__DEC128_MAX_EXP__", NUM("6145")),
+  PREDEFINED("__DEC128_MAX__", NUM("9.999999999999999999999999999999999E6144DL")),
+  PREDEFINED("__DEC128_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("6142"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__DEC128_MIN__", NUM("1E-6143DL")),
+  PREDEFINED("__DEC128_SUBNORMAL_MIN__", NUM("0.000000000000000000000000000000001E-6143DL")),
+  PREDEFINED("__DEC32_EPSILON__", NUM("1E-6DF")),
+  PREDEFINED("__DEC32_MANT_DIG__", NUM("7")),
+  PREDEFINED("__DEC32_MAX_EXP__", NUM("97")),
+  PREDEFINED("__DEC32_MAX__", NUM("9.999999E96DF")),
+  PREDEFINED("__DEC32_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("94"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__DEC32_MIN__", NUM("1E-95DF")),
+  PREDEFINED("__DEC32_SUBNORMAL_MIN__", NUM("0.000001E-95DF")),
+  PREDEFINED("__DEC64_EPSILON__", NUM("1E-15DD")),
+  PREDEFINED("__DEC64_MANT_DIG__", NUM("16")),
+  PREDEFINED("__DEC64_MAX_EXP__", NUM("385")),
+  PREDEFINED("__DEC64_MAX__", NUM("9.999999999999999E384DD")),
+  PREDEFINED("__DEC64_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("382"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__DEC64_MIN__", NUM("1E-383DD")),
+  PREDEFINED("__DEC64_SUBNORMAL_MIN__", NUM("0.000000000000001E-383DD")),
+  PREDEFINED("__DECIMAL_BID_FORMAT__", NUM("1")),
+  PREDEFINED("__DECIMAL_DIG__", NUM("21")),
+  PREDEFINED("__DEC_EVAL_METHOD__", NUM("2")),
+  PREDEFINED("__ELF__", NUM("1")),
+  PREDEFINED("__FINITE_MATH_ONLY__", NUM("0")),
+  PREDEFINED("__FLOAT_WORD_ORDER__", IDENT("__ORDER_LITTLE_ENDIAN__")),
+  PREDEFINED("__FLT128_DECIMAL_DIG__", NUM("36")),
+  PREDEFINED("__FLT128_DENORM_MIN__", NUM("6.47517511943802511092443895822764655e-4966F128")),
+  PREDEFINED("__FLT128_DIG__", NUM("33")),
+  PREDEFINED("__FLT128_EPSILON__", NUM("1.92592994438723585305597794258492732e-34F128")),
+  PREDEFINED("__FLT128_HAS_DENORM__", NUM("1")),
+  PREDEFINED("__FLT128_HAS_INFINITY__", NUM("1")),
+  PREDEFINED("__FLT128_HAS_QUIET_NAN__", NUM("1")),
+  PREDEFINED("__FLT128_IS_IEC_60559__", NUM("2")),
+  PREDEFINED("__FLT128_MANT_DIG__", NUM("113")),
+  PREDEFINED("__FLT128_MAX_10_EXP__", NUM("4932")),
+  PREDEFINED("__FLT128_MAX_EXP__", NUM("16384")),
+  PREDEFINED("__FLT128_MAX__", NUM("1.18973149535723176508575932662800702e+4932F128")),
+  PREDEFINED("__FLT128_MIN_10_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("4931"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT128_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("16381"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT128_MIN__", NUM("3.36210314311209350626267781732175260e-4932F128")),
+  PREDEFINED("__FLT128_NORM_MAX__", NUM("1.18973149535723176508575932662800702e+4932F128")),
+  PREDEFINED("__FLT16_DECIMAL_DIG__", NUM("5")),
+  PREDEFINED("__FLT16_DENORM_MIN__", NUM("5.96046447753906250000000000000000000e-8F16")),
+  PREDEFINED("__FLT16_DIG__", NUM("3")),
+  PREDEFINED("__FLT16_EPSILON__", NUM("9.76562500000000000000000000000000000e-4F16")),
+  PREDEFINED("__FLT16_HAS_DENORM__", NUM("1")),
+  PREDEFINED("__FLT16_HAS_INFINITY__", NUM("1")),
+  PREDEFINED("__FLT16_HAS_QUIET_NAN__", NUM("1")),
+  PREDEFINED("__FLT16_IS_IEC_60559__", NUM("2")),
+  PREDEFINED("__FLT16_MANT_DIG__", NUM("11")),
+  PREDEFINED("__FLT16_MAX_10_EXP__", NUM("4")),
+  PREDEFINED("__FLT16_MAX_EXP__", NUM("16")),
+  PREDEFINED("__FLT16_MAX__", NUM("6.55040000000000000000000000000000000e+4F16")),
+  PREDEFINED("__FLT16_MIN_10_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("4"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT16_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("13"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT16_MIN__", NUM("6.10351562500000000000000000000000000e-5F16")),
+  PREDEFINED("__FLT16_NORM_MAX__", NUM("6.55040000000000000000000000000000000e+4F16")),
+  PREDEFINED("__FLT32X_DECIMAL_DIG__", NUM("17")),
+  PREDEFINED("__FLT32X_DENORM_MIN__", NUM("4.94065645841246544176568792868221372e-324F32x")),
+  PREDEFINED("__FLT32X_DIG__", NUM("15")),
+  PREDEFINED("__FLT32X_EPSILON__", NUM("2.22044604925031308084726333618164062e-16F32x")),
+  PREDEFINED("__FLT32X_HAS_DENORM__", NUM("1")),
+  PREDEFINED("__FLT32X_HAS_INFINITY__", NUM("1")),
+  PREDEFINED("__FLT32X_HAS_QUIET_NAN__", NUM("1")),
+  PREDEFINED("__FLT32X_IS_IEC_60559__", NUM("2")),
+  PREDEFINED("__FLT32X_MANT_DIG__", NUM("53")),
+  PREDEFINED("__FLT32X_MAX_10_EXP__", NUM("308")),
+  PREDEFINED("__FLT32X_MAX_EXP__", NUM("1024")),
+  PREDEFINED("__FLT32X_MAX__", NUM("1.79769313486231570814527423731704357e+308F32x")),
+  PREDEFINED("__FLT32X_MIN_10_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("307"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT32X_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("1021"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT32X_MIN__", NUM("2.22507385850720138309023271733240406e-308F32x")),
+  PREDEFINED("__FLT32X_NORM_MAX__", NUM("1.79769313486231570814527423731704357e+308F32x")),
+  PREDEFINED("__FLT32_DECIMAL_DIG__", NUM("9")),
+  PREDEFINED("__FLT32_DENORM_MIN__", NUM("1.40129846432481707092372958328991613e-45F32")),
+  PREDEFINED("__FLT32_DIG__", NUM("6")),
+  PREDEFINED("__FLT32_EPSILON__", NUM("1.19209289550781250000000000000000000e-7F32")),
+  PREDEFINED("__FLT32_HAS_DENORM__", NUM("1")),
+  PREDEFINED("__FLT32_HAS_INFINITY__", NUM("1")),
+  PREDEFINED("__FLT32_HAS_QUIET_NAN__", NUM("1")),
+  PREDEFINED("__FLT32_IS_IEC_60559__", NUM("2")),
+  PREDEFINED("__FLT32_MANT_DIG__", NUM("24")),
+  PREDEFINED("__FLT32_MAX_10_EXP__", NUM("38")),
+  PREDEFINED("__FLT32_MAX_EXP__", NUM("128")),
+  PREDEFINED("__FLT32_MAX__", NUM("3.40282346638528859811704183484516925e+38F32")),
+  PREDEFINED("__FLT32_MIN_10_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("37"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT32_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("125"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT32_MIN__", NUM("1.17549435082228750796873653722224568e-38F32")),
+  PREDEFINED("__FLT32_NORM_MAX__", NUM("3.40282346638528859811704183484516925e+38F32")),
+  PREDEFINED("__FLT64X_DECIMAL_DIG__", NUM("21")),
+  PREDEFINED("__FLT64X_DENORM_MIN__", NUM("3.64519953188247460252840593361941982e-4951F64x")),
+  PREDEFINED("__FLT64X_DIG__", NUM("18")),
+  PREDEFINED("__FLT64X_EPSILON__", NUM("1.08420217248550443400745280086994171e-19F64x")),
+  PREDEFINED("__FLT64X_HAS_DENORM__", NUM("1")),
+  PREDEFINED("__FLT64X_HAS_INFINITY__", NUM("1")),
+  PREDEFINED("__FLT64X_HAS_QUIET_NAN__", NUM("1")),
+  PREDEFINED("__FLT64X_IS_IEC_60559__", NUM("2")),
+  PREDEFINED("__FLT64X_MANT_DIG__", NUM("64")),
+  PREDEFINED("__FLT64X_MAX_10_EXP__", NUM("4932")),
+  PREDEFINED("__FLT64X_MAX_EXP__", NUM("16384")),
+  PREDEFINED("__FLT64X_MAX__", NUM("1.18973149535723176502126385303097021e+4932F64x")),
+  PREDEFINED("__FLT64X_MIN_10_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("4931"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT64X_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("16381"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT64X_MIN__", NUM("3.36210314311209350626267781732175260e-4932F64x")),
+  PREDEFINED("__FLT64X_NORM_MAX__", NUM("1.18973149535723176502126385303097021e+4932F64x")),
+  PREDEFINED("__FLT64_DECIMAL_DIG__", NUM("17")),
+  PREDEFINED("__FLT64_DENORM_MIN__", NUM("4.94065645841246544176568792868221372e-324F64")),
+  PREDEFINED("__FLT64_DIG__", NUM("15")),
+  PREDEFINED("__FLT64_EPSILON__", NUM("2.22044604925031308084726333618164062e-16F64")),
+  PREDEFINED("__FLT64_HAS_DENORM__", NUM("1")),
+  PREDEFINED("__FLT64_HAS_INFINITY__", NUM("1")),
+  PREDEFINED("__FLT64_HAS_QUIET_NAN__", NUM("1")),
+  PREDEFINED("__FLT64_IS_IEC_60559__", NUM("2")),
+  PREDEFINED("__FLT64_MANT_DIG__", NUM("53")),
+  PREDEFINED("__FLT64_MAX_10_EXP__", NUM("308")),
+  PREDEFINED("__FLT64_MAX_EXP__", NUM("1024")),
+  PREDEFINED("__FLT64_MAX__", NUM("1.79769313486231570814527423731704357e+308F64")),
+  PREDEFINED("__FLT64_MIN_10_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("307"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT64_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("1021"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT64_MIN__", NUM("2.22507385850720138309023271733240406e-308F64")),
+  PREDEFINED("__FLT64_NORM_MAX__", NUM("1.79769313486231570814527423731704357e+308F64")),
+  PREDEFINED("__FLT_DECIMAL_DIG__", NUM("9")),
+  PREDEFINED("__FLT_DENORM_MIN__", NUM("1.40129846432481707092372958328991613e-45F")),
+  PREDEFINED("__FLT_DIG__", NUM("6")),
+  PREDEFINED("__FLT_EPSILON__", NUM("1.19209289550781250000000000000000000e-7F")),
+  PREDEFINED("__FLT_EVAL_METHOD_TS_18661_3__", NUM("0")),
+  PREDEFINED("__FLT_EVAL_METHOD__", NUM("0")),
+  PREDEFINED("__FLT_HAS_DENORM__", NUM("1")),
+  PREDEFINED("__FLT_HAS_INFINITY__", NUM("1")),
+  PREDEFINED("__FLT_HAS_QUIET_NAN__", NUM("1")),
+  PREDEFINED("__FLT_IS_IEC_60559__", NUM("2")),
+  PREDEFINED("__FLT_MANT_DIG__", NUM("24")),
+  PREDEFINED("__FLT_MAX_10_EXP__", NUM("38")),
+  PREDEFINED("__FLT_MAX_EXP__", NUM("128")),
+  PREDEFINED("__FLT_MAX__", NUM("3.40282346638528859811704183484516925e+38F")),
+  PREDEFINED("__FLT_MIN_10_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("37"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("125"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__FLT_MIN__", NUM("1.17549435082228750796873653722224568e-38F")),
+  PREDEFINED("__FLT_NORM_MAX__", NUM("3.40282346638528859811704183484516925e+38F")),
+  PREDEFINED("__FLT_RADIX__", NUM("2")),
+  PREDEFINED("__FXSR__", NUM("1")),
+  PREDEFINED("__GCC_ASM_FLAG_OUTPUTS__", NUM("1")),
+  PREDEFINED("__GCC_ATOMIC_BOOL_LOCK_FREE", NUM("2")),
+  PREDEFINED("__GCC_ATOMIC_CHAR16_T_LOCK_FREE", NUM("2")),
+  PREDEFINED("__GCC_ATOMIC_CHAR32_T_LOCK_FREE", NUM("2")),
+  PREDEFINED("__GCC_ATOMIC_CHAR_LOCK_FREE", NUM("2")),
+  PREDEFINED("__GCC_ATOMIC_INT_LOCK_FREE", NUM("2")),
+  PREDEFINED("__GCC_ATOMIC_LLONG_LOCK_FREE", NUM("2")),
+  PREDEFINED("__GCC_ATOMIC_LONG_LOCK_FREE", NUM("2")),
+  PREDEFINED("__GCC_ATOMIC_POINTER_LOCK_FREE", NUM("2")),
+  PREDEFINED("__GCC_ATOMIC_SHORT_LOCK_FREE", NUM("2")),
+  PREDEFINED("__GCC_ATOMIC_TEST_AND_SET_TRUEVAL", NUM("1")),
+  PREDEFINED("__GCC_ATOMIC_WCHAR_T_LOCK_FREE", NUM("2")),
+  PREDEFINED("__GCC_CONSTRUCTIVE_SIZE", NUM("64")),
+  PREDEFINED("__GCC_DESTRUCTIVE_SIZE", NUM("64")),
+  PREDEFINED("__GCC_HAVE_DWARF2_CFI_ASM", NUM("1")),
+  PREDEFINED("__GCC_HAVE_SYNC_COMPARE_AND_SWAP_1", NUM("1")),
+  PREDEFINED("__GCC_HAVE_SYNC_COMPARE_AND_SWAP_2", NUM("1")),
+  PREDEFINED("__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4", NUM("1")),
+  PREDEFINED("__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8", NUM("1")),
+  PREDEFINED("__GCC_IEC_559", NUM("2")),
+  PREDEFINED("__GCC_IEC_559_COMPLEX", NUM("2")),
+  PREDEFINED("__GNUC_EXECUTION_CHARSET_NAME", STR("\"UTF-8\"")),
+  PREDEFINED("__GNUC_MINOR__", NUM("2")),
+  PREDEFINED("__GNUC_PATCHLEVEL__", NUM("0")),
+  PREDEFINED("__GNUC_STDC_INLINE__", NUM("1")),
+  PREDEFINED("__GNUC_WIDE_EXECUTION_CHARSET_NAME", STR("\"UTF-32LE\"")),
+  PREDEFINED("__GNUC__", NUM("12")),
+  PREDEFINED("__GXX_ABI_VERSION", NUM("1017")),
+  PREDEFINED("__HAVE_SPECULATION_SAFE_VALUE", NUM("1")),
+  PREDEFINED_FUNCTION("__INT16_C", "c", IDENT("c")),
+  PREDEFINED("__INT16_MAX__", NUM("0x7fff")),
+  PREDEFINED("__INT16_TYPE__", IDENT("short"), SPACE, IDENT("int")),
+  PREDEFINED_FUNCTION("__INT32_C", "c", IDENT("c")),
+  PREDEFINED("__INT32_MAX__", NUM("0x7fffffff")),
+  PREDEFINED("__INT32_TYPE__", IDENT("int")),
+  PREDEFINED_FUNCTION("__INT64_C", "c", IDENT("c"), SPACE, PUNCT(PP_CONCAT, "##"), SPACE, IDENT("L")),
+  PREDEFINED("__INT64_MAX__", NUM("0x7fffffffffffffffL")),
+  PREDEFINED("__INT64_TYPE__", IDENT("long"), SPACE, IDENT("int")),
+  PREDEFINED_FUNCTION("__INT8_C", "c", IDENT("c")),
+  PREDEFINED("__INT8_MAX__", NUM("0x7f")),
+  PREDEFINED("__INT8_TYPE__", IDENT("signed"), SPACE, IDENT("char")),
+  PREDEFINED_FUNCTION("__INTMAX_C", "c", IDENT("c"), SPACE, PUNCT(PP_CONCAT, "##"), SPACE, IDENT("L")),
+  PREDEFINED("__INTMAX_MAX__", NUM("0x7fffffffffffffffL")),
+  PREDEFINED("__INTMAX_TYPE__", IDENT("long"), SPACE, IDENT("int")),
+  PREDEFINED("__INTMAX_WIDTH__", NUM("64")),
+  PREDEFINED("__INTPTR_MAX__", NUM("0x7fffffffffffffffL")),
+  PREDEFINED("__INTPTR_TYPE__", IDENT("long"), SPACE, IDENT("int")),
+  PREDEFINED("__INTPTR_WIDTH__", NUM("64")),
+  PREDEFINED("__INT_FAST16_MAX__", NUM("0x7fffffffffffffffL")),
+  PREDEFINED("__INT_FAST16_TYPE__", IDENT("long"), SPACE, IDENT("int")),
+  PREDEFINED("__INT_FAST16_WIDTH__", NUM("64")),
+  PREDEFINED("__INT_FAST32_MAX__", NUM("0x7fffffffffffffffL")),
+  PREDEFINED("__INT_FAST32_TYPE__", IDENT("long"), SPACE, IDENT("int")),
+  PREDEFINED("__INT_FAST32_WIDTH__", NUM("64")),
+  PREDEFINED("__INT_FAST64_MAX__", NUM("0x7fffffffffffffffL")),
+  PREDEFINED("__INT_FAST64_TYPE__", IDENT("long"), SPACE, IDENT("int")),
+  PREDEFINED("__INT_FAST64_WIDTH__", NUM("64")),
+  PREDEFINED("__INT_FAST8_MAX__", NUM("0x7f")),
+  PREDEFINED("__INT_FAST8_TYPE__", IDENT("signed"), SPACE, IDENT("char")),
+  PREDEFINED("__INT_FAST8_WIDTH__", NUM("8")),
+  PREDEFINED("__INT_LEAST16_MAX__", NUM("0x7fff")),
+  PREDEFINED("__INT_LEAST16_TYPE__", IDENT("short"), SPACE, IDENT("int")),
+  PREDEFINED("__INT_LEAST16_WIDTH__", NUM("16")),
+  PREDEFINED("__INT_LEAST32_MAX__", NUM("0x7fffffff")),
+  PREDEFINED("__INT_LEAST32_TYPE__", IDENT("int")),
+  PREDEFINED("__INT_LEAST32_WIDTH__", NUM("32")),
+  PREDEFINED("__INT_LEAST64_MAX__", NUM("0x7fffffffffffffffL")),
+  PREDEFINED("__INT_LEAST64_TYPE__", IDENT("long"), SPACE, IDENT("int")),
+  PREDEFINED("__INT_LEAST64_WIDTH__", NUM("64")),
+  PREDEFINED("__INT_LEAST8_MAX__", NUM("0x7f")),
+  PREDEFINED("__INT_LEAST8_TYPE__", IDENT("signed"), SPACE, IDENT("char")),
+  PREDEFINED("__INT_LEAST8_WIDTH__", NUM("8")),
+  PREDEFINED("__INT_MAX__", NUM("0x7fffffff")),
+  PREDEFINED("__INT_WIDTH__", NUM("32")),
+  PREDEFINED("__LDBL_DECIMAL_DIG__", NUM("21")),
+  PREDEFINED("__LDBL_DENORM_MIN__", NUM("3.64519953188247460252840593361941982e-4951L")),
+  PREDEFINED("__LDBL_DIG__", NUM("18")),
+  PREDEFINED("__LDBL_EPSILON__", NUM("1.08420217248550443400745280086994171e-19L")),
+  PREDEFINED("__LDBL_HAS_DENORM__", NUM("1")),
+  PREDEFINED("__LDBL_HAS_INFINITY__", NUM("1")),
+  PREDEFINED("__LDBL_HAS_QUIET_NAN__", NUM("1")),
+  PREDEFINED("__LDBL_IS_IEC_60559__", NUM("2")),
+  PREDEFINED("__LDBL_MANT_DIG__", NUM("64")),
+  PREDEFINED("__LDBL_MAX_10_EXP__", NUM("4932")),
+  PREDEFINED("__LDBL_MAX_EXP__", NUM("16384")),
+  PREDEFINED("__LDBL_MAX__", NUM("1.18973149535723176502126385303097021e+4932L")),
+  PREDEFINED("__LDBL_MIN_10_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("4931"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__LDBL_MIN_EXP__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), NUM("16381"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__LDBL_MIN__", NUM("3.36210314311209350626267781732175260e-4932L")),
+  PREDEFINED("__LDBL_NORM_MAX__", NUM("1.18973149535723176502126385303097021e+4932L")),
+  PREDEFINED("__LONG_LONG_MAX__", NUM("0x7fffffffffffffffLL")),
+  PREDEFINED("__LONG_LONG_WIDTH__", NUM("64")),
+  PREDEFINED("__LONG_MAX__", NUM("0x7fffffffffffffffL")),
+  PREDEFINED("__LONG_WIDTH__", NUM("64")),
+  PREDEFINED("__LP64__", NUM("1")),
+  PREDEFINED("__MMX_WITH_SSE__", NUM("1")),
+  PREDEFINED("__MMX__", NUM("1")),
+  PREDEFINED("__NO_INLINE__", NUM("1")),
+  PREDEFINED("__ORDER_BIG_ENDIAN__", NUM("4321")),
+  PREDEFINED("__ORDER_LITTLE_ENDIAN__", NUM("1234")),
+  PREDEFINED("__ORDER_PDP_ENDIAN__", NUM("3412")),
+  PREDEFINED("__PIC__", NUM("2")),
+  PREDEFINED("__PIE__", NUM("2")),
+  PREDEFINED("__PRAGMA_REDEFINE_EXTNAME", NUM("1")),
+  PREDEFINED("__PTRDIFF_MAX__", NUM("0x7fffffffffffffffL")),
+  PREDEFINED("__PTRDIFF_TYPE__", IDENT("long"), SPACE, IDENT("int")),
+  PREDEFINED("__PTRDIFF_WIDTH__", NUM("64")),
+  PREDEFINED_EMPTY("__REGISTER_PREFIX__"),
+  PREDEFINED("__SCHAR_MAX__", NUM("0x7f")),
+  PREDEFINED("__SCHAR_WIDTH__", NUM("8")),
+  PREDEFINED("__SEG_FS", NUM("1")),
+  PREDEFINED("__SEG_GS", NUM("1")),
+  PREDEFINED("__SHRT_MAX__", NUM("0x7fff")),
+  PREDEFINED("__SHRT_WIDTH__", NUM("16")),
+  PREDEFINED("__SIG_ATOMIC_MAX__", NUM("0x7fffffff")),
+  PREDEFINED("__SIG_ATOMIC_MIN__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), IDENT("__SIG_ATOMIC_MAX__"), SPACE, PUNCT(PP_MINUS, "-"), SPACE, NUM("1"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__SIG_ATOMIC_TYPE__", IDENT("int")),
+  PREDEFINED("__SIG_ATOMIC_WIDTH__", NUM("32")),
+  PREDEFINED("__SIZEOF_DOUBLE__", NUM("8")),
+  PREDEFINED("__SIZEOF_FLOAT128__", NUM("16")),
+  PREDEFINED("__SIZEOF_FLOAT80__", NUM("16")),
+  PREDEFINED("__SIZEOF_FLOAT__", NUM("4")),
+  PREDEFINED("__SIZEOF_INT128__", NUM("16")),
+  PREDEFINED("__SIZEOF_INT__", NUM("4")),
+  PREDEFINED("__SIZEOF_LONG_DOUBLE__", NUM("16")),
+  PREDEFINED("__SIZEOF_LONG_LONG__", NUM("8")),
+  PREDEFINED("__SIZEOF_LONG__", NUM("8")),
+  PREDEFINED("__SIZEOF_POINTER__", NUM("8")),
+  PREDEFINED("__SIZEOF_PTRDIFF_T__", NUM("8")),
+  PREDEFINED("__SIZEOF_SHORT__", NUM("2")),
+  PREDEFINED("__SIZEOF_SIZE_T__", NUM("8")),
+  PREDEFINED("__SIZEOF_WCHAR_T__", NUM("4")),
+  PREDEFINED("__SIZEOF_WINT_T__", NUM("4")),
+  PREDEFINED("__SIZE_MAX__", NUM("0xffffffffffffffffUL")),
+  PREDEFINED("__SIZE_TYPE__", IDENT("long"), SPACE, IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__SIZE_WIDTH__", NUM("64")),
+  PREDEFINED("__SSE2_MATH__", NUM("1")),
+  PREDEFINED("__SSE2__", NUM("1")),
+  PREDEFINED("__SSE_MATH__", NUM("1")),
+  PREDEFINED("__SSE__", NUM("1")),
+  PREDEFINED("__STDC_IEC_559_COMPLEX__", NUM("1")),
+  PREDEFINED("__STDC_IEC_559__", NUM("1")),
+  PREDEFINED("__STDC_IEC_60559_BFP__", NUM("201404L")),
+  PREDEFINED("__STDC_IEC_60559_COMPLEX__", NUM("201404L")),
+  PREDEFINED("__STDC_ISO_10646__", NUM("201706L")),
+  PREDEFINED("__STDC_UTF_16__", NUM("1")),
+  PREDEFINED("__STDC_UTF_32__", NUM("1")),
+  PREDEFINED("__STDC_VERSION__", NUM("201112L")),
+  PREDEFINED("__STDC__", NUM("1")),
+  PREDEFINED("__STRICT_ANSI__", NUM("1")),
+  PREDEFINED_FUNCTION("__UINT16_C", "c", IDENT("c")),
+  PREDEFINED("__UINT16_MAX__", NUM("0xffff")),
+  PREDEFINED("__UINT16_TYPE__", IDENT("short"), SPACE, IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED_FUNCTION("__UINT32_C", "c", IDENT("c"), SPACE, PUNCT(PP_CONCAT, "##"), SPACE, IDENT("U")),
+  PREDEFINED("__UINT32_MAX__", NUM("0xffffffffU")),
+  PREDEFINED("__UINT32_TYPE__", IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED_FUNCTION("__UINT64_C", "c", IDENT("c"), SPACE, PUNCT(PP_CONCAT, "##"), SPACE, IDENT("UL")),
+  PREDEFINED("__UINT64_MAX__", NUM("0xffffffffffffffffUL")),
+  PREDEFINED("__UINT64_TYPE__", IDENT("long"), SPACE, IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED_FUNCTION("__UINT8_C", "c", IDENT("c")),
+  PREDEFINED("__UINT8_MAX__", NUM("0xff")),
+  PREDEFINED("__UINT8_TYPE__", IDENT("unsigned"), SPACE, IDENT("char")),
+  PREDEFINED_FUNCTION("__UINTMAX_C", "c", IDENT("c"), SPACE, PUNCT(PP_CONCAT, "##"), SPACE, IDENT("UL")),
+  PREDEFINED("__UINTMAX_MAX__", NUM("0xffffffffffffffffUL")),
+  PREDEFINED("__UINTMAX_TYPE__", IDENT("long"), SPACE, IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__UINTPTR_MAX__", NUM("0xffffffffffffffffUL")),
+  PREDEFINED("__UINTPTR_TYPE__", IDENT("long"), SPACE, IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__UINT_FAST16_MAX__", NUM("0xffffffffffffffffUL")),
+  PREDEFINED("__UINT_FAST16_TYPE__", IDENT("long"), SPACE, IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__UINT_FAST32_MAX__", NUM("0xffffffffffffffffUL")),
+  PREDEFINED("__UINT_FAST32_TYPE__", IDENT("long"), SPACE, IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__UINT_FAST64_MAX__", NUM("0xffffffffffffffffUL")),
+  PREDEFINED("__UINT_FAST64_TYPE__", IDENT("long"), SPACE, IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__UINT_FAST8_MAX__", NUM("0xff")),
+  PREDEFINED("__UINT_FAST8_TYPE__", IDENT("unsigned"), SPACE, IDENT("char")),
+  PREDEFINED("__UINT_LEAST16_MAX__", NUM("0xffff")),
+  PREDEFINED("__UINT_LEAST16_TYPE__", IDENT("short"), SPACE, IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__UINT_LEAST32_MAX__", NUM("0xffffffffU")),
+  PREDEFINED("__UINT_LEAST32_TYPE__", IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__UINT_LEAST64_MAX__", NUM("0xffffffffffffffffUL")),
+  PREDEFINED("__UINT_LEAST64_TYPE__", IDENT("long"), SPACE, IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__UINT_LEAST8_MAX__", NUM("0xff")),
+  PREDEFINED("__UINT_LEAST8_TYPE__", IDENT("unsigned"), SPACE, IDENT("char")),
+  PREDEFINED_EMPTY("__USER_LABEL_PREFIX__"),
+  PREDEFINED("__VERSION__", STR("\"12.2.0\"")),
+  PREDEFINED("__WCHAR_MAX__", NUM("0x7fffffff")),
+  PREDEFINED("__WCHAR_MIN__", PUNCT(PP_LPAREN, "("), PUNCT(PP_MINUS, "-"), IDENT("__WCHAR_MAX__"), SPACE, PUNCT(PP_MINUS, "-"), SPACE, NUM("1"), PUNCT(PP_RPAREN, ")")),
+  PREDEFINED("__WCHAR_TYPE__", IDENT("int")),
+  PREDEFINED("__WCHAR_WIDTH__", NUM("32")),
+  PREDEFINED("__WINT_MAX__", NUM("0xffffffffU")),
+  PREDEFINED("__WINT_MIN__", NUM("0U")),
+  PREDEFINED("__WINT_TYPE__", IDENT("unsigned"), SPACE, IDENT("int")),
+  PREDEFINED("__WINT_WIDTH__", NUM("32")),
+  PREDEFINED("__amd64", NUM("1")),
+  PREDEFINED("__amd64__", NUM("1")),
+  PREDEFINED("__code_model_small__", NUM("1")),
+  PREDEFINED("__gnu_linux__", NUM("1")),
+  PREDEFINED("__k8", NUM("1")),
+  PREDEFINED("__k8__", NUM("1")),
+  PREDEFINED("__linux", NUM("1")),
+  PREDEFINED("__linux__", NUM("1")),
+  PREDEFINED("__pic__", NUM("2")),
+  PREDEFINED("__pie__", NUM("2")),
+  PREDEFINED("__unix", NUM("1")),
+  PREDEFINED("__unix__", NUM("1")),
+  PREDEFINED("__x86_64", NUM("1")),
+  PREDEFINED("__x86_64__", NUM("1")),
+};
+
+#define PREDEFINED_MACROS_SIZE ((int) (sizeof(predefined_macros) / sizeof(struct predefined_macro)))
+
+void *allocate_predefined_array(size_t size) {
+  void *array = calloc(1, size > 0 ? size : 1);
+  if(array == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  return array;
+}
+
+struct predefined_image *allocate_predefined_image(struct intern_table *atoms) {
+  int token_count = 0;
+  for(int i = 0; i < PREDEFINED_MACROS_SIZE; i++) {
+    token_count += predefined_macros[i].token_count;
+  }
+
+  struct predefined_image *image = (struct predefined_image *) allocate_predefined_array(sizeof(struct predefined_image));
+  image->macros = (struct macro_entry *) allocate_predefined_array(sizeof(struct macro_entry) * PREDEFINED_MACROS_SIZE);
+  image->macros_size = PREDEFINED_MACROS_SIZE;
+  image->tokens = (struct pp_token *) allocate_predefined_array(sizeof(struct pp_token) * token_count);
+  image->texts = (struct string *) allocate_predefined_array(sizeof(struct string) * token_count);
+  image->nodes = (struct pp_node *) allocate_predefined_array(sizeof(struct pp_node) * token_count);
+  image->lists = (struct pp_list *) allocate_predefined_array(sizeof(struct pp_list) * PREDEFINED_MACROS_SIZE);
+  image->empty.head = NULL;
+  image->empty.tail = &image->empty.head;
+
+  for(int i = 0, k = 0; i < PREDEFINED_MACROS_SIZE; i++) {
+    const struct predefined_macro *predefined = &predefined_macros[i];
+
+    struct pp_list *list = &image->lists[i];
+    list->head = NULL;
+    list->tail = &list->head;
+    for(int j = 0; j < predefined->token_count; j++, k++) {
+      struct string *text = &image->texts[k];
+      text->head = (unsigned char *) predefined->tokens[j].text;
+      text->size = strlen(predefined->tokens[j].text);
+      text->alloc_size = text->size;
+
+      // the tokens are never freed, and copied when they are written
+      struct pp_token *token = &image->tokens[k];
+      token->type = predefined->tokens[j].type;
+      token->name = pp_token_name[token->type];
+      token->text = text;
+      token->file = NULL;
+      token->offset = 0;
+      token->atom = token->type == PP_IDENT ? intern_string(atoms, text->head, text->size) : NULL;
+      token->persistent = 1;
+
+      struct pp_node *node = &image->nodes[k];
+      node->token = token;
+      *(list->tail) = node;
+      list->tail = &node->next;
+    }
+
+    struct macro_entry *macro = &image->macros[i];
+    macro->identifier = intern_string(atoms, (const unsigned char *) predefined->identifier, strlen(predefined->identifier));
+    if(predefined->parameter != NULL) {
+      macro->type = MACRO_FUNCTION;
+      macro->parameter_size = 1;
+      macro->parameters[0] = intern_string(atoms, (const unsigned char *) predefined->parameter, strlen(predefined->parameter));
+    } else {
+      macro->type = MACRO_OBJECT;
+    }
+    macro->replacement_list = list;
+    macro->tokens = &image->empty;
+    macro->borrowed = 1;
+  }
+
+  image->table = allocate_macro_table();
+  for(int i = 0; i < image->macros_size; i++) {
+    install_macro_table(image->table, &image->macros[i]);
+  }
+
+  return image;
+}
+
+void free_predefined_image(struct predefined_image *image) {
+  free_macro_table(image->table);
+  free(image->macros);
+  free(image->tokens);
+  free(image->texts);
+  free(image->nodes);
+  free(image->lists);
+  free(image);
+}
+
+// the table of the image becomes the base of the table, which is never written to by a run;
+// an error may leave a macro marked in the middle of its expansion, so the marks are cleared
+void install_predefined_image(struct predefined_image *image, struct macro_table *table) {
+  for(int i = 0; i < image->macros_size; i++) {
+    image->macros[i].expanded = 0;
+  }
+  table->base = image->table;
+}
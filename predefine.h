@@ -0,0 +1,39 @@
+#ifndef __PREDEFINE_INCLUDE__
+#define __PREDEFINE_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "preprocess.h"
+
+// a token of a compiled-in definition, spelled as the lexer would spell it
+struct predefined_token {
+  enum pp_token_type type;
+  const char *text;
+};
+
+struct predefined_macro {
+  const char *identifier;
+  const char *parameter;
+  const struct predefined_token *tokens;
+  int token_count;
+};
+
+// the compiled-in macros laid out for one context; their table is the base of the table of every run
+struct predefined_image {
+  struct macro_entry *macros;
+  int macros_size;
+  struct pp_token *tokens;
+  struct string *texts;
+  struct pp_node *nodes;
+  struct pp_list *lists;
+  struct pp_list empty;
+  struct macro_table *table;
+};
+
+extern struct predefined_image *allocate_predefined_image(struct intern_table *atoms);
+extern void free_predefined_image(struct predefined_image *image);
+extern void install_predefined_image(struct predefined_image *image, struct macro_table *table);
+
+#endif
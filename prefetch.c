@@ -0,0 +1,200 @@
+#include "prefetch.h"
+
+/*
+ * Read-ahead of included files. When a file is loaded, the header names of
+ * all its #include directives, including the ones in conditional groups,
+ * are queued for a pool of I/O threads. They resolve each name and load
+ * the file into the source cache, whose users then find it there. Requests
+ * beyond PREFETCH_QUEUE_SIZE outstanding reads are dropped.
+ */
+
+void fetch_request(struct prefetcher *prefetcher, struct prefetch_request *request) {
+  jmp_buf jump;
+  struct string *name = allocate_string();
+  write_string(name, request->name);
+  struct string *volatile path = NULL;
+
+  // a wrong guess must not stop the run; the real include reports the error
+  error_jump = &jump;
+  if(setjmp(jump) == 0) {
+    struct include_file file;
+    file.misses = NULL;
+    int found;
+    if(name->head[0] == '<') {
+      found = search_header_file(prefetcher->search, &file, name);
+    } else {
+      found = search_named_source_file(prefetcher->search, &file, name, request->current_file);
+    }
+
+    if(found) {
+      path = file.path;
+      struct source_file *content = prefetch_source_file(prefetcher->sources, file.name, file.fd);
+      prefetch_includes(prefetcher, content, file.name);
+      release_source_file(prefetcher->sources, content);
+    } else {
+      pthread_mutex_lock(&prefetcher->lock);
+      prefetcher->failed++;
+      pthread_mutex_unlock(&prefetcher->lock);
+    }
+  } else {
+    pthread_mutex_lock(&prefetcher->lock);
+    prefetcher->failed++;
+    pthread_mutex_unlock(&prefetcher->lock);
+  }
+  error_jump = NULL;
+
+  if(path != NULL) {
+    free_string(path);
+  }
+  free_string(name);
+}
+
+void *run_prefetch_worker(void *arg) {
+  struct prefetcher *prefetcher = (struct prefetcher *) arg;
+
+  error_stream = fopen("/dev/null", "w");
+  if(error_stream == NULL) {
+    perror("fopen");
+    exit(1);
+  }
+
+  pthread_mutex_lock(&prefetcher->lock);
+  while(1) {
+    while(prefetcher->size == 0 && !prefetcher->stopping) {
+      pthread_cond_wait(&prefetcher->ready, &prefetcher->lock);
+    }
+    if(prefetcher->stopping) break;
+
+    struct prefetch_request request = prefetcher->queue[prefetcher->head];
+    prefetcher->head = (prefetcher->head + 1) % PREFETCH_QUEUE_SIZE;
+    prefetcher->size--;
+    pthread_mutex_unlock(&prefetcher->lock);
+
+    fetch_request(prefetcher, &request);
+    free(request.name);
+    free(request.current_file);
+
+    pthread_mutex_lock(&prefetcher->lock);
+    prefetcher->outstanding--;
+  }
+  pthread_mutex_unlock(&prefetcher->lock);
+
+  fclose(error_stream);
+  error_stream = NULL;
+  return NULL;
+}
+
+struct prefetcher *allocate_prefetcher(struct source_cache *sources, struct include_search *search, int threads) {
+  struct prefetcher *prefetcher = (struct prefetcher *) calloc(1, sizeof(struct prefetcher));
+  if(prefetcher == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  prefetcher->sources = sources;
+  prefetcher->search = search;
+  pthread_mutex_init(&prefetcher->lock, NULL);
+  pthread_cond_init(&prefetcher->ready, NULL);
+
+  prefetcher->threads = (pthread_t *) malloc(sizeof(pthread_t) * threads);
+  if(prefetcher->threads == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for(int i = 0; i < threads; i++) {
+    if(pthread_create(&prefetcher->threads[i], NULL, run_prefetch_worker, prefetcher) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  prefetcher->threads_size = threads;
+
+  return prefetcher;
+}
+
+// requests still in the queue are dropped
+void free_prefetcher(struct prefetcher *prefetcher) {
+  pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->stopping = 1;
+  pthread_cond_broadcast(&prefetcher->ready);
+  pthread_mutex_unlock(&prefetcher->lock);
+
+  for(int i = 0; i < prefetcher->threads_size; i++) {
+    pthread_join(prefetcher->threads[i], NULL);
+  }
+
+  for(int i = 0; i < prefetcher->size; i++) {
+    struct prefetch_request *request = &prefetcher->queue[(prefetcher->head + i) % PREFETCH_QUEUE_SIZE];
+    free(request->name);
+    free(request->current_file);
+  }
+  pthread_mutex_destroy(&prefetcher->lock);
+  pthread_cond_destroy(&prefetcher->ready);
+  free(prefetcher->threads);
+  free(prefetcher);
+}
+
+// the header name of an #include operand, or NULL if the operand is macro replaced
+char *include_operand(const unsigned char *text, struct directive *directive) {
+  int begin = directive->operand;
+  if(begin >= directive->end) return NULL;
+
+  unsigned char close = text[begin] == '<' ? '>' : text[begin] == '"' ? '"' : '\0';
+  if(close == '\0') return NULL;
+
+  for(int i = begin + 1; i < directive->end; i++) {
+    if(text[i] == close) {
+      return strndup(&text[begin], i - begin + 1);
+    }
+  }
+  return NULL;
+}
+
+// the includes of each file are queued once, when it is first seen
+void prefetch_includes(struct prefetcher *prefetcher, struct source_file *content, const unsigned char *file) {
+  struct skeleton *skeleton = content->skeleton;
+
+  pthread_mutex_lock(&prefetcher->lock);
+  if(content->scanned || prefetcher->stopping) {
+    pthread_mutex_unlock(&prefetcher->lock);
+    return;
+  }
+  content->scanned = 1;
+
+  for(int i = 0; i < skeleton->size; i++) {
+    if(skeleton->directives[i].type != DIR_INCLUDE) continue;
+
+    char *name = include_operand(content->text, &skeleton->directives[i]);
+    if(name == NULL) continue;
+
+    if(prefetcher->outstanding == PREFETCH_QUEUE_SIZE) {
+      prefetcher->dropped++;
+      free(name);
+      continue;
+    }
+
+    struct prefetch_request *request = &prefetcher->queue[(prefetcher->head + prefetcher->size) % PREFETCH_QUEUE_SIZE];
+    request->name = name;
+    request->current_file = strdup(file);
+    prefetcher->size++;
+    prefetcher->outstanding++;
+    prefetcher->queued++;
+  }
+
+  pthread_cond_broadcast(&prefetcher->ready);
+  pthread_mutex_unlock(&prefetcher->lock);
+}
+
+void write_prefetch_stats(struct prefetcher *prefetcher, FILE *fp) {
+  pthread_mutex_lock(&prefetcher->sources->lock);
+  long loads = prefetcher->sources->prefetch_loads;
+  long hits = prefetcher->sources->prefetch_hits;
+  pthread_mutex_unlock(&prefetcher->sources->lock);
+
+  pthread_mutex_lock(&prefetcher->lock);
+  fprintf(fp, "prefetch: %ld queued, %ld dropped, %ld failed, %ld loaded, %ld used", prefetcher->queued, prefetcher->dropped, prefetcher->failed, loads, hits);
+  if(loads > 0) {
+    fprintf(fp, ", accuracy %.1f%%", 100.0 * hits / loads);
+  }
+  fprintf(fp, "\n");
+  pthread_mutex_unlock(&prefetcher->lock);
+}
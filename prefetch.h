@@ -0,0 +1,42 @@
+#ifndef __PREFETCH_INCLUDE__
+#define __PREFETCH_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "error.h"
+#include "file.h"
+#include "search.h"
+
+#define PREFETCH_QUEUE_SIZE 64
+
+struct prefetch_request {
+  char *name;
+  char *current_file;
+};
+
+struct prefetcher {
+  struct source_cache *sources;
+  struct include_search *search;
+  struct prefetch_request queue[PREFETCH_QUEUE_SIZE];
+  int head;
+  int size;
+  int outstanding;
+  int stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_t *threads;
+  int threads_size;
+  long queued;
+  long dropped;
+  long failed;
+};
+
+extern struct prefetcher *allocate_prefetcher(struct source_cache *sources, struct include_search *search, int threads);
+extern void free_prefetcher(struct prefetcher *prefetcher);
+extern char *include_operand(const unsigned char *text, struct directive *directive);
+extern void prefetch_includes(struct prefetcher *prefetcher, struct source_file *content, const unsigned char *file);
+extern void write_prefetch_stats(struct prefetcher *prefetcher, FILE *fp);
+
+#endif
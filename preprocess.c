@@ -1,6 +1,10 @@
+#include <unistd.h>
 #include "preprocess.h"
+#include "speculate.h"
+#include "snapshot.h"
+#include "predefine.h"
+#include "hdrcache.h"
 
-struct macro_entry *macro_table[MACRO_TABLE_SIZE];
 
 struct pp_list *object_macro_invocation(struct preprocessor *pp, struct macro_entry *macro);
 struct pp_list *function_macro_invocation(struct preprocessor *pp, struct macro_entry *macro, struct pp_list **args, int args_size);
@@ -8,7 +12,11 @@ int conditional_expression(struct pp_node **node);
 void group(struct preprocessor *pp);
 void skip_line(struct preprocessor *pp);
 void skip_group(struct preprocessor *pp);
-struct pp_list *parse_preprocessing_file(unsigned char *file);
+void release_pp_tokens(struct pp_list *replaced, struct pp_list *text);
+void release_replaced_pp_tokens(struct pp_list *replaced, struct pp_list *text);
+void parse_preprocessing_file(struct skcc_context *ctx, unsigned char *file, struct pp_sink *sink);
+void parse_preprocessing_file_fd(struct skcc_context *ctx, unsigned char *file, int fd, struct pp_sink *sink);
+void parse_preprocessing_lexer(struct skcc_context *ctx, unsigned char *file, struct pp_token_lexer *lexer, struct pp_sink *sink);
 
 // pp_list
 struct pp_list *allocate_pp_list() {
@@ -55,23 +63,53 @@ struct macro_entry *allocate_macro_entry() {
     perror("malloc");
     exit(1);
   }
+  macro->parameter_size = 0;
+  macro->parameter_ellipsis = 0;
   macro->replacement_list = allocate_pp_list();
+  macro->tokens = allocate_pp_list();
   macro->expanded = 0;
+  macro->borrowed = 0;
+  macro->settled = 0;
   return macro;
 }
 
+// a copy sharing the lists of a macro owned by another table; expanded is left out as the owner may be changing it
+struct macro_entry *borrow_macro_entry(const struct macro_entry *macro) {
+  struct macro_entry *copy = (struct macro_entry *) malloc(sizeof(struct macro_entry));
+  if(copy == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  copy->type = macro->type;
+  copy->identifier = macro->identifier;
+  copy->parameter_size = macro->parameter_size;
+  copy->parameter_ellipsis = macro->parameter_ellipsis;
+  memcpy(copy->parameters, macro->parameters, sizeof(macro->parameters));
+  copy->replacement_list = macro->replacement_list;
+  copy->tokens = macro->tokens;
+  copy->expanded = 0;
+  copy->borrowed = 1;
+  copy->settled = 0;
+  return copy;
+}
+
+// the macro owns its replacement tokens and the tokens of its name and parameters, unless its arena does
 void free_macro_entry(struct macro_entry *macro) {
-  free_pp_list(macro->replacement_list);
+  if(macro->settled) return;
+  if(!macro->borrowed) {
+    struct pp_list *lists[2] = { macro->replacement_list, macro->tokens };
+    for(int i = 0; i < 2; i++) {
+      for(struct pp_node *node = lists[i]->head; node != NULL; node = node->next) {
+        free_pp_token(node->token);
+      }
+      free_pp_list(lists[i]);
+    }
+  }
   free(macro);
 }
 
 int ident_hash(const unsigned char *ident) {
-  const int BASE = 257;
-  int h = 0;
-  for(int i = 0; ident[i] != '\0'; i++) {
-    h = (h * BASE + ident[i]) % MACRO_TABLE_SIZE;
-  }
-  return h;
+  return interned_hash(ident) % MACRO_TABLE_SIZE;
 }
 
 int compare_macro(const struct macro_entry *macro1, const struct macro_entry *macro2) {
@@ -83,7 +121,7 @@ int compare_macro(const struct macro_entry *macro1, const struct macro_entry *ma
     if(macro1->parameter_ellipsis != macro2->parameter_ellipsis) return 0;
     if(macro1->parameter_size != macro2->parameter_size) return 0;
     for(int i = 0; i < macro1->parameter_size; i++) {
-      if(strcmp(macro1->parameters[i]->head, macro2->parameters[i]->head) != 0) return 0;
+      if(macro1->parameters[i] != macro2->parameters[i]) return 0;
     }
   }
 
@@ -103,51 +141,377 @@ int compare_macro(const struct macro_entry *macro1, const struct macro_entry *ma
   return 1;
 }
 
-void insert_macro_table(struct macro_entry *macro) {
-  int h1 = ident_hash(macro->identifier);
-  for(int i = 0, h = h1; i < MACRO_TABLE_SIZE; i++, h = (h + 1) % MACRO_TABLE_SIZE) {
-    if(macro_table[h] == NULL) {
-      macro_table[h] = macro;
-      break;
-    } else {
-      if(strcmp(macro_table[h]->identifier, macro->identifier) == 0) {
-        if(compare_macro(macro_table[h], macro)) {
-          break;
-        } else {
-          error("duplicated macro definition: %s\n", macro->identifier);
-        }
-      }
+// macro_arena
+struct macro_arena *allocate_macro_arena() {
+  struct macro_arena *arena = (struct macro_arena *) malloc(sizeof(struct macro_arena));
+  if(arena == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  arena->blocks = NULL;
+  return arena;
+}
+
+void *reserve_macro_arena(struct macro_arena *arena, size_t size) {
+  size = (size + 7) & ~(size_t) 7;
+
+  struct macro_arena_block *block = arena->blocks;
+  if(block == NULL || block->used + size > block->size) {
+    size_t block_size = size > MACRO_ARENA_BLOCK_SIZE ? size : MACRO_ARENA_BLOCK_SIZE;
+    block = (struct macro_arena_block *) malloc(sizeof(struct macro_arena_block) + block_size);
+    if(block == NULL) {
+      perror("malloc");
+      exit(1);
     }
+    block->size = block_size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  void *p = &block->data[block->used];
+  block->used += size;
+  return p;
+}
+
+// frees every block but the newest one, which the macros of the next run are laid out in
+void clear_macro_arena(struct macro_arena *arena) {
+  if(arena->blocks == NULL) return;
+
+  struct macro_arena_block *block = arena->blocks->next;
+  while(block != NULL) {
+    struct macro_arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->blocks->next = NULL;
+  arena->blocks->used = 0;
+}
+
+void free_macro_arena(struct macro_arena *arena) {
+  clear_macro_arena(arena);
+  free(arena->blocks);
+  free(arena);
+}
+
+// takes over the blocks of other, along with the macros which moved from its table
+void adopt_macro_arena(struct macro_arena *arena, struct macro_arena *other) {
+  if(other->blocks != NULL) {
+    struct macro_arena_block *last = other->blocks;
+    while(last->next != NULL) last = last->next;
+    last->next = arena->blocks;
+    arena->blocks = other->blocks;
   }
+  free(other);
 }
 
-void delete_macro_table(const unsigned char *identifier) {
+struct pp_list *reserve_macro_list(struct macro_arena *arena) {
+  struct pp_list *list = (struct pp_list *) reserve_macro_arena(arena, sizeof(struct pp_list));
+  list->head = NULL;
+  list->tail = &list->head;
+  return list;
+}
+
+// a macro laid out in the arena, which frees it along with the other macros of its table
+struct macro_entry *reserve_macro_entry(struct macro_arena *arena) {
+  struct macro_entry *macro = (struct macro_entry *) reserve_macro_arena(arena, sizeof(struct macro_entry));
+  macro->parameter_size = 0;
+  macro->parameter_ellipsis = 0;
+  macro->replacement_list = reserve_macro_list(arena);
+  macro->tokens = reserve_macro_list(arena);
+  macro->expanded = 0;
+  macro->borrowed = 0;
+  macro->settled = 1;
+  return macro;
+}
+
+// moves a token the preprocessor read into a list of a macro in the arena
+void append_macro_arena(struct macro_arena *arena, struct pp_list *list, struct pp_token *token) {
+  struct string *text = (struct string *) reserve_macro_arena(arena, sizeof(struct string));
+  text->size = token->text->size;
+  text->alloc_size = text->size + 1;
+  text->head = (unsigned char *) reserve_macro_arena(arena, text->alloc_size);
+  memcpy(text->head, token->text->head, text->alloc_size);
+
+  struct pp_token *copy = (struct pp_token *) reserve_macro_arena(arena, sizeof(struct pp_token));
+  *copy = *token;
+  copy->text = text;
+  free_pp_token(token);
+
+  struct pp_node *node = (struct pp_node *) reserve_macro_arena(arena, sizeof(struct pp_node));
+  node->token = copy;
+  node->next = NULL;
+  node->skip = 0;
+  *(list->tail) = node;
+  list->tail = &node->next;
+}
+
+// macro_table
+struct macro_table *allocate_macro_table() {
+  struct macro_table *table = (struct macro_table *) calloc(1, sizeof(struct macro_table));
+  if(table == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  table->generation = 1;
+  table->arena = allocate_macro_arena();
+  return table;
+}
+
+// the entries of a table for lookups from another thread; the copy does not own them
+struct macro_table *copy_macro_table(const struct macro_table *table) {
+  struct macro_table *copy = (struct macro_table *) malloc(sizeof(struct macro_table));
+  if(copy == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(copy->entries, table->entries, sizeof(table->entries));
+  memcpy(copy->marks, table->marks, sizeof(table->marks));
+  memcpy(copy->filter, table->filter, sizeof(table->filter));
+  copy->generation = table->generation;
+  copy->base = table->base;
+  copy->arena = NULL;
+  copy->defined = NULL;
+  copy->defined_size = 0;
+  copy->defined_alloc = 0;
+  return copy;
+}
+
+int live_macro_slot(struct macro_table *table, int h) {
+  return table->marks[h] >> 1 == table->generation;
+}
+
+// the macro in a slot of the table itself, or NULL if the slot is empty or hides a macro of the base
+struct macro_entry *slot_macro_table(struct macro_table *table, int h) {
+  if(!live_macro_slot(table, h) || (table->marks[h] & 1)) return NULL;
+  return table->entries[h];
+}
+
+// starts a new generation, which leaves every slot and filter counter empty at once
+void reset_macro_table(struct macro_table *table) {
+  if(++table->generation > MACRO_GENERATION_LIMIT) {
+    memset(table->marks, 0, sizeof(table->marks));
+    memset(table->filter, 0, sizeof(table->filter));
+    table->generation = 1;
+  }
+  table->base = NULL;
+}
+
+// hands the macros defined since the last reset to the caller and empties the table; the arena holds most of them
+void detach_macro_table(struct macro_table *table, struct macro_entry ***defined, int *size, struct macro_arena **arena) {
+  disown_macro_table(table, defined, size, arena);
+  reset_macro_table(table);
+}
+
+// hands the macros defined since the last reset to the caller, leaving them in the table
+void disown_macro_table(struct macro_table *table, struct macro_entry ***defined, int *size, struct macro_arena **arena) {
+  *defined = table->defined;
+  *size = table->defined_size;
+  *arena = table->arena;
+  table->defined = NULL;
+  table->defined_size = 0;
+  table->defined_alloc = 0;
+  table->arena = allocate_macro_arena();
+}
+
+// frees every macro defined since the last reset, including undefined and redefined ones;
+// only the macros outside the arena are kept in defined, so this does not walk the definitions
+void clear_macro_table(struct macro_table *table) {
+  for(int i = 0; i < table->defined_size; i++) {
+    free_macro_entry(table->defined[i]);
+  }
+  table->defined_size = 0;
+  clear_macro_arena(table->arena);
+  reset_macro_table(table);
+}
+
+void free_macro_table(struct macro_table *table) {
+  clear_macro_table(table);
+  free_macro_arena(table->arena);
+  free(table->defined);
+  free(table);
+}
+
+int macro_filter_count(struct macro_table *table, unsigned int index) {
+  unsigned short counter = table->filter[index];
+  return counter >> 8 == table->generation ? counter & 255 : 0;
+}
+
+// counting bloom filter of defined macro names, indexed by the hash of the atom
+void update_macro_filter(struct macro_table *table, const unsigned char *ident, int delta) {
+  unsigned int h = interned_hash(ident);
+  unsigned int index[2] = { h % MACRO_FILTER_SIZE, (h >> 16) % MACRO_FILTER_SIZE };
+
+  for(int i = 0; i < 2; i++) {
+    int count = macro_filter_count(table, index[i]);
+    // a saturated counter stays set for good
+    if(count == 255) continue;
+    table->filter[index[i]] = table->generation << 8 | (count + delta);
+  }
+}
+
+int check_macro_filter(struct macro_table *table, unsigned int h) {
+  if(macro_filter_count(table, h % MACRO_FILTER_SIZE) && macro_filter_count(table, (h >> 16) % MACRO_FILTER_SIZE)) return 1;
+  return table->base != NULL && check_macro_filter(table->base, h);
+}
+
+// the slot of the identifier in the table itself, or -1
+int find_macro_slot(struct macro_table *table, const unsigned char *identifier) {
   int h1 = ident_hash(identifier);
   for(int i = 0, h = h1; i < MACRO_TABLE_SIZE; i++, h = (h + 1) % MACRO_TABLE_SIZE) {
-    if(macro_table[h] == NULL) break;
-    if(strcmp(macro_table[h]->identifier, identifier) == 0) {
-      macro_table[h] = NULL;
-      h = (h + 1) % MACRO_TABLE_SIZE;
-      for(int j = i; j < MACRO_TABLE_SIZE; j++, h = (h + 1) % MACRO_TABLE_SIZE) {
-        if(macro_table[h] == NULL) break;
-        struct macro_entry *t = macro_table[h];
-        macro_table[h] = NULL;
-        insert_macro_table(t);
-      }
-      break;
-    }
+    if(!live_macro_slot(table, h)) break;
+    if(table->entries[h]->identifier == identifier) return h;
   }
+  return -1;
 }
 
-struct macro_entry *search_macro_table(const unsigned char *identifier) {
-  int h1 = ident_hash(identifier);
+void place_macro_slot(struct macro_table *table, struct macro_entry *macro, int hidden) {
+  int h1 = ident_hash(macro->identifier);
   for(int i = 0, h = h1; i < MACRO_TABLE_SIZE; i++, h = (h + 1) % MACRO_TABLE_SIZE) {
-    if(macro_table[h] == NULL) break;
-    if(strcmp(macro_table[h]->identifier, identifier) == 0) {
-      return macro_table[h];
+    if(!live_macro_slot(table, h)) {
+      table->entries[h] = macro;
+      table->marks[h] = table->generation << 1 | hidden;
+      return;
+    }
+  }
+}
+
+// returns 1 if the macro takes a slot
+int store_macro_table(struct macro_table *table, struct macro_entry *macro) {
+  int h = find_macro_slot(table, macro->identifier);
+  struct macro_entry *defined;
+  if(h >= 0) {
+    defined = slot_macro_table(table, h);
+  } else {
+    defined = table->base != NULL ? search_macro_table(table->base, macro->identifier) : NULL;
+  }
+
+  if(defined != NULL) {
+    if(compare_macro(defined, macro)) return 0;
+    error("duplicated macro definition: %s\n", macro->identifier);
+  }
+
+  // the slot hid the macro of the base
+  if(h >= 0) {
+    table->entries[h] = macro;
+    table->marks[h] = table->generation << 1;
+  } else {
+    place_macro_slot(table, macro, 0);
+  }
+  return 1;
+}
+
+// the macros the arena does not hold are freed one by one when the table is cleared
+void record_macro_table(struct macro_table *table, struct macro_entry *macro) {
+  if(table->defined_size == table->defined_alloc) {
+    table->defined_alloc = table->defined_alloc == 0 ? 1024 : table->defined_alloc * 2;
+    table->defined = (struct macro_entry **) realloc(table->defined, sizeof(struct macro_entry *) * table->defined_alloc);
+    if(table->defined == NULL) {
+      perror("realloc");
+      exit(1);
     }
   }
-  return NULL;
+  table->defined[table->defined_size++] = macro;
+}
+
+void insert_macro_table(struct macro_table *table, struct macro_entry *macro) {
+  if(!macro->settled) {
+    record_macro_table(table, macro);
+  }
+
+  if(store_macro_table(table, macro)) {
+    update_macro_filter(table, macro->identifier, 1);
+  }
+}
+
+// stores a macro owned by the caller; it is left out of the macros the table frees
+void install_macro_table(struct macro_table *table, struct macro_entry *macro) {
+  if(store_macro_table(table, macro)) {
+    update_macro_filter(table, macro->identifier, 1);
+  }
+}
+
+// a macro of the base is hidden by a slot holding it, so that it is not looked up there
+void delete_macro_table(struct macro_table *table, const unsigned char *identifier) {
+  struct macro_entry *based = table->base != NULL ? search_macro_table(table->base, identifier) : NULL;
+  int h = find_macro_slot(table, identifier);
+  if(h < 0) {
+    if(based != NULL) {
+      place_macro_slot(table, based, 1);
+    }
+    return;
+  }
+  if(table->marks[h] & 1) return;
+
+  update_macro_filter(table, identifier, -1);
+  if(based != NULL) {
+    table->entries[h] = based;
+    table->marks[h] |= 1;
+    return;
+  }
+
+  table->marks[h] = 0;
+  h = (h + 1) % MACRO_TABLE_SIZE;
+  for(int j = 0; j < MACRO_TABLE_SIZE; j++, h = (h + 1) % MACRO_TABLE_SIZE) {
+    if(!live_macro_slot(table, h)) break;
+    int hidden = table->marks[h] & 1;
+    table->marks[h] = 0;
+    place_macro_slot(table, table->entries[h], hidden);
+  }
+}
+
+// identifiers of the macro table are atoms, so they are compared by pointer
+struct macro_entry *search_macro_table(struct macro_table *table, const unsigned char *identifier) {
+  if(!check_macro_filter(table, interned_hash(identifier))) return NULL;
+
+  int h = find_macro_slot(table, identifier);
+  if(h >= 0) {
+    return slot_macro_table(table, h);
+  }
+  return table->base != NULL ? search_macro_table(table->base, identifier) : NULL;
+}
+
+// identifiers are interned when they are first compared
+const unsigned char *token_atom(struct preprocessor *pp, struct pp_token *token) {
+  if(token->atom == NULL) {
+    token->atom = intern_string(pp->ctx->atoms, token->text->head, token->text->size);
+  }
+  return token->atom;
+}
+
+// a speculative run takes the first lookup of each name from its snapshot
+struct macro_entry *lookup_macro(struct preprocessor *pp, const unsigned char *identifier) {
+  if(pp->ctx->speculation != NULL) {
+    resolve_speculative_macro(pp->ctx, identifier);
+  }
+  if(pp->ctx->recording != NULL) {
+    record_header_read(pp->ctx, identifier);
+  }
+  return search_macro_table(pp->ctx->macros, identifier);
+}
+
+void define_macro(struct preprocessor *pp, struct macro_entry *macro) {
+  if(pp->ctx->speculation != NULL) {
+    resolve_speculative_macro(pp->ctx, macro->identifier);
+    record_speculative_effect(pp->ctx, macro->identifier, macro);
+  }
+  if(pp->ctx->recording != NULL) {
+    record_header_read(pp->ctx, macro->identifier);
+    record_header_effect(pp->ctx, macro->identifier, macro);
+  }
+  insert_macro_table(pp->ctx->macros, macro);
+}
+
+void undefine_macro(struct preprocessor *pp, const unsigned char *identifier) {
+  if(pp->ctx->speculation != NULL) {
+    resolve_speculative_macro(pp->ctx, identifier);
+    record_speculative_effect(pp->ctx, identifier, NULL);
+  }
+  if(pp->ctx->recording != NULL) {
+    record_header_read(pp->ctx, identifier);
+    record_header_effect(pp->ctx, identifier, NULL);
+  }
+  delete_macro_table(pp->ctx->macros, identifier);
 }
 
 // macro replacement
@@ -155,7 +519,7 @@ int check_object_macro_invocation(struct preprocessor *pp, struct pp_node *node)
   if(node->token->type != PP_IDENT) return 0;
   if(node->skip) return 0;
 
-  struct macro_entry *macro = search_macro_table(node->token->text->head);
+  struct macro_entry *macro = lookup_macro(pp, token_atom(pp, node->token));
   return macro != NULL && !macro->expanded && macro->type == MACRO_OBJECT;
 }
 
@@ -163,7 +527,7 @@ int check_function_macro_invocation(struct preprocessor *pp, struct pp_node *nod
   if(node->token->type != PP_IDENT) return 0;
   if(node->skip) return 0;
 
-  struct macro_entry *macro = search_macro_table(node->token->text->head);
+  struct macro_entry *macro = lookup_macro(pp, token_atom(pp, node->token));
   if(macro == NULL || macro->expanded || macro->type != MACRO_FUNCTION) {
     return 0;
   }
@@ -185,18 +549,17 @@ struct pp_list *scan_macro(struct preprocessor *pp, struct pp_list *list) {
   struct pp_list *result = allocate_pp_list();
 
   for(struct pp_node *node = list->head; node != NULL; node = node->next) {
-    struct macro_entry *macro = search_macro_table(node->token->text->head);
-
     // object-like macro invocation
     if(check_object_macro_invocation(pp, node)) {
-      struct macro_entry *macro = search_macro_table(node->token->text->head);
+      struct macro_entry *macro = lookup_macro(pp, token_atom(pp, node->token));
       struct pp_list *list = object_macro_invocation(pp, macro);
       concat_pp_list(result, list);
+      free(list);
     }
 
     // function-like macro invocation
     else if(check_function_macro_invocation(pp, node)) {
-      struct macro_entry *macro = search_macro_table(node->token->text->head);
+      struct macro_entry *macro = lookup_macro(pp, token_atom(pp, node->token));
       struct pp_list *args[MACRO_PARAMS_LIMIT];
       int args_count = 0;
       int level = 0;
@@ -214,6 +577,10 @@ struct pp_list *scan_macro(struct preprocessor *pp, struct pp_list *list) {
 
       // parse arguments
       if(node != NULL && node->token->type == PP_RPAREN) {
+        // F() passes one empty argument to a macro with a parameter
+        if(macro->parameter_size > 0 || macro->parameter_ellipsis) {
+          args[args_count++] = allocate_pp_list();
+        }
         valid = 1;
       } else if(node != NULL) {
         args[args_count] = allocate_pp_list();
@@ -269,19 +636,31 @@ struct pp_list *scan_macro(struct preprocessor *pp, struct pp_list *list) {
           continue;
         }
         if(args[i]->head->token->type == PP_NEW_LINE || args[i]->head->token->type == PP_SPACE) {
-          args[i]->head = args[i]->head->next;
+          struct pp_node *space = args[i]->head;
+          args[i]->head = space->next;
+          if(args[i]->head == NULL) {
+            args[i]->tail = &(args[i]->head);
+          }
+          free(space);
         }
         if(args[i]->head != NULL) {
           struct pp_node **arg_node = &(args[i]->head);
           for(; (*arg_node)->next != NULL; arg_node = &((*arg_node)->next));
           if((*arg_node)->token->type == PP_NEW_LINE || (*arg_node)->token->type == PP_SPACE) {
+            free(*arg_node);
             *arg_node = NULL;
+            args[i]->tail = arg_node;
           }
         }
       }
 
       struct pp_list *list = function_macro_invocation(pp, macro, args, args_count);
       concat_pp_list(result, list);
+      free(list);
+
+      for(int i = 0; i < args_count; i++) {
+        free_pp_list(args[i]);
+      }
     }
 
     // not replaced
@@ -316,11 +695,14 @@ struct pp_list *concat_macro_token(struct pp_list *list) {
       concat_string(str, r->text);
 
       struct pp_token_lexer lexer;
+      lexer.src = NULL;
       lexer.queue = (struct utf8c *) malloc(sizeof(struct utf8c) * (str->size + 1));
       lexer.queue_head = 0;
       lexer.queue_size = 0;
       lexer.queue_allocate_size = str->size + 1;
       lexer.context = CTX_NORMAL;
+      lexer.stream = NULL;
+      lexer.replay = -1;
 
       for(int i = 0; i < str->size;) {
         struct utf8c uc;
@@ -329,6 +711,7 @@ struct pp_list *concat_macro_token(struct pp_list *list) {
           uc.sequence[j] = str->head[i++];
         }
         uc.sequence[uc.bytes] = '\0';
+        uc.offset = -1;
         lexer.queue[lexer.queue_size++] = uc;
       }
       lexer.queue[lexer.queue_size++] = ueof;
@@ -340,6 +723,9 @@ struct pp_list *concat_macro_token(struct pp_list *list) {
       }
       append_pp_list(result, new_token);
 
+      free(lexer.queue);
+      free_string(str);
+
       node = right;
     } else {
       append_pp_list(result, node->token);
@@ -347,13 +733,17 @@ struct pp_list *concat_macro_token(struct pp_list *list) {
   }
 
   // remove place marker
-  for(struct pp_node **node = &(result->head); *node != NULL;) {
+  struct pp_node **node = &(result->head);
+  while(*node != NULL) {
     if((*node)->token->type == PP_PLACE_MARKER) {
-      *node = (*node)->next;
+      struct pp_node *marker = *node;
+      *node = marker->next;
+      free(marker);
     } else {
       node = &((*node)->next);
     }
   }
+  result->tail = node;
 
   return result;
 }
@@ -367,7 +757,9 @@ struct pp_list *object_macro_invocation(struct preprocessor *pp, struct macro_en
   }
 
   struct pp_list *concat_list = concat_macro_token(list);
+  free_pp_list(list);
   struct pp_list *result = scan_macro(pp, concat_list);
+  free_pp_list(concat_list);
 
   macro->expanded = 0;
   return result;
@@ -377,6 +769,8 @@ struct pp_list *function_macro_invocation(struct preprocessor *pp, struct macro_
   macro->expanded = 1;
 
   struct pp_list *replaced_args[MACRO_PARAMS_LIMIT];
+  struct pp_token *place_markers[MACRO_PARAMS_LIMIT];
+  int place_markers_size = 0;
   for(int i = 0; i < args_size; i++) {
     if(args[i]->head != NULL) {
       replaced_args[i] = scan_macro(pp, args[i]);
@@ -384,6 +778,7 @@ struct pp_list *function_macro_invocation(struct preprocessor *pp, struct macro_
       struct pp_token *place_marker = allocate_pp_token();
       place_marker->type = PP_PLACE_MARKER;
       place_marker->name = pp_token_name[PP_PLACE_MARKER];
+      place_markers[place_markers_size++] = place_marker;
 
       replaced_args[i] = allocate_pp_list();
       append_pp_list(replaced_args[i], place_marker);
@@ -402,7 +797,7 @@ struct pp_list *function_macro_invocation(struct preprocessor *pp, struct macro_
 
       int matched;
       for(int i = 0; i < args_size; i++) {
-        if(node->token->type == PP_IDENT && strcmp(node->token->text->head, macro->parameters[i]->head) == 0) {
+        if(node->token->type == PP_IDENT && token_atom(pp, node->token) == macro->parameters[i]) {
           matched = i;
         }
       }
@@ -438,7 +833,7 @@ struct pp_list *function_macro_invocation(struct preprocessor *pp, struct macro_
     if(middle != NULL && middle->token->type == PP_CONCAT && !middle->token->concat) {
       int left_replaced = 0;
       for(int i = 0; i < args_size; i++) {
-        if(left->token->type == PP_IDENT && strcmp(left->token->text->head, macro->parameters[i]->head) == 0) {
+        if(left->token->type == PP_IDENT && token_atom(pp, left->token) == macro->parameters[i]) {
           for(struct pp_node *arg_node = args[i]->head; arg_node != NULL; arg_node = arg_node->next) {
             append_pp_list(list, arg_node->token);
           }
@@ -458,7 +853,7 @@ struct pp_list *function_macro_invocation(struct preprocessor *pp, struct macro_
       }
       int right_replaced = 0;
       for(int i = 0; i < args_size; i++) {
-        if(right->token->type == PP_IDENT && strcmp(right->token->text->head, macro->parameters[i]->head) == 0) {
+        if(right->token->type == PP_IDENT && token_atom(pp, right->token) == macro->parameters[i]) {
           for(struct pp_node *arg_node = args[i]->head; arg_node != NULL; arg_node = arg_node->next) {
             append_pp_list(list, arg_node->token);
           }
@@ -475,7 +870,7 @@ struct pp_list *function_macro_invocation(struct preprocessor *pp, struct macro_
 
     int replaced = 0;
     for(int i = 0; i < args_size; i++) {
-      if(node->token->type == PP_IDENT && strcmp(node->token->text->head, macro->parameters[i]->head) == 0) {
+      if(node->token->type == PP_IDENT && token_atom(pp, node->token) == macro->parameters[i]) {
         for(struct pp_node *arg_node = replaced_args[i]->head; arg_node != NULL; arg_node = arg_node->next) {
           append_pp_list(list, arg_node->token);
         }
@@ -490,7 +885,17 @@ struct pp_list *function_macro_invocation(struct preprocessor *pp, struct macro_
   }
 
   struct pp_list *concat_list = concat_macro_token(list);
+  free_pp_list(list);
   struct pp_list *result = scan_macro(pp, concat_list);
+  free_pp_list(concat_list);
+
+  // place markers never survive concat_macro_token()
+  for(int i = 0; i < args_size; i++) {
+    free_pp_list(replaced_args[i]);
+  }
+  for(int i = 0; i < place_markers_size; i++) {
+    free_pp_token(place_markers[i]);
+  }
 
   macro->expanded = 0;
   return result;
@@ -806,21 +1211,21 @@ struct pp_node *check_defined_operator(struct pp_node **node) {
 }
 
 int if_control(struct preprocessor *pp) {
-  struct pp_list *list = allocate_pp_list();
+  struct pp_list *text = allocate_pp_list();
   while(!check_pp_token(pp, PP_NEW_LINE)) {
     struct pp_token *token = read_pp_token(pp);
-    append_pp_list(list, token);
+    append_pp_list(text, token);
   }
   discard_new_line(pp);
 
-  for(struct pp_node *node = list->head; node != NULL; node = node->next) {
+  for(struct pp_node *node = text->head; node != NULL; node = node->next) {
     if(node->token->type == PP_IDENT && strcmp(node->token->text->head, "defined") == 0) {
       struct pp_node *ident = check_defined_operator(&node);
       ident->skip = 1;
     }
   }
 
-  list = scan_macro(pp, list);
+  struct pp_list *list = scan_macro(pp, text);
 
   struct pp_token *zero = allocate_pp_token();
   zero->type = PP_NUM;
@@ -836,7 +1241,7 @@ int if_control(struct preprocessor *pp) {
   for(struct pp_node *node = list->head; node != NULL; node = node->next) {
     if(node->token->type == PP_IDENT && strcmp(node->token->text->head, "defined") == 0) {
       struct pp_node *ident = check_defined_operator(&node);
-      struct macro_entry *macro = search_macro_table(ident->token->text->head);
+      struct macro_entry *macro = lookup_macro(pp, token_atom(pp, ident->token));
       append_pp_list(replaced, macro == NULL ? zero : one);
     } else {
       append_pp_list(replaced, node->token->type != PP_IDENT ? node->token : zero);
@@ -845,13 +1250,25 @@ int if_control(struct preprocessor *pp) {
 
   for(struct pp_node **node = &(replaced->head); *node != NULL;) {
     if((*node)->token->type == PP_SPACE || (*node)->token->type == PP_SPACE) {
-      *node = (*node)->next;
+      struct pp_node *next = (*node)->next;
+      free(*node);
+      *node = next;
     } else {
        node = &((*node)->next);
     }
   }
 
-  return conditional_expression(&(replaced->head));
+  struct pp_node *head = replaced->head;
+  int control = conditional_expression(&head);
+
+  release_pp_tokens(list, text);
+  free_pp_token(zero);
+  free_pp_token(one);
+  free_pp_list(replaced);
+  free_pp_list(list);
+  free_pp_list(text);
+
+  return control;
 }
 
 void conditional_include(struct preprocessor *pp, int condition) {
@@ -874,7 +1291,8 @@ int ifdef_directive(struct preprocessor *pp) {
   struct pp_token *ident = expect_pp_token(pp, PP_IDENT);
   discard_new_line(pp);
 
-  struct macro_entry *macro = search_macro_table(ident->text->head);
+  struct macro_entry *macro = lookup_macro(pp, token_atom(pp, ident));
+  free_pp_token(ident);
   int control = macro != NULL;
   conditional_include(pp, control);
 
@@ -887,7 +1305,8 @@ int ifndef_directive(struct preprocessor *pp) {
   struct pp_token *ident = expect_pp_token(pp, PP_IDENT);
   discard_new_line(pp);
 
-  struct macro_entry *macro = search_macro_table(ident->text->head);
+  struct macro_entry *macro = lookup_macro(pp, token_atom(pp, ident));
+  free_pp_token(ident);
   int control = macro == NULL;
   conditional_include(pp, control);
 
@@ -942,71 +1361,6 @@ void if_section(struct preprocessor *pp) {
 }
 
 // include directive
-int try_fopen(char *file) {
-  FILE *fp = fopen(file, "r");
-
-  if(fp == NULL) return 0;
-
-  fclose(fp);
-  return 1;
-}
-
-struct string *search_header_file(struct string *text) {
-  char location[4][64] = {
-    "/usr/lib/gcc/x86_64-linux-gnu/7/include/",
-    "/usr/include/",
-    "/usr/include/linux/",
-    "/usr/include/x86_64-linux-gnu/"
-  };
-
-  for(int k = 0; k < 4; k++) {
-    struct string *path = allocate_string();
-    write_string(path, location[k]);
-    for(int i = 1; i < text->size - 1; i++) {
-      append_string(path, text->head[i]);
-    }
-
-    if(try_fopen(path->head)) return path;
-
-    free_string(path);
-  }
-
-  // failed to search header file
-  return NULL;
-}
-
-struct string *search_named_source_file(struct string *text, const char *current_file) {
-  int last_slash = 0;
-  for(int i = 0; current_file[i]; i++) {
-    if(current_file[i] == '/') {
-      last_slash = i;
-    }
-  }
-
-  struct string *dir = allocate_string();
-  if(last_slash > 0) {
-    for(int i = 0; i < last_slash; i++) {
-      append_string(dir, current_file[i]);
-    }
-    append_string(dir, '/');
-  }
-
-  struct string *path = allocate_string();
-  concat_string(path, dir);
-  for(int i = 1; i < text->size - 1; i++) {
-    append_string(path, text->head[i]);
-  }
-
-  if(try_fopen(path->head)) {
-    return path;
-  }
-
-  free_string(path);
-
-  // reprocess as if header file was read
-  return search_header_file(text);
-}
-
 void include_directive(struct preprocessor *pp) {
   struct pp_token *header;
   if(peek_pp_token(pp)->type == PP_H_NAME) {
@@ -1016,29 +1370,69 @@ void include_directive(struct preprocessor *pp) {
   }
   discard_new_line(pp);
 
-  struct string *path;
+  // a file created at a candidate path which was not found would change the include
+  struct include_file file;
+  file.misses = pp->ctx->misses != NULL || pp->ctx->recording != NULL ? allocate_dependencies() : NULL;
+  int found;
   if(header->type == PP_H_NAME && header->text->head[0] == '<') {
-    path = search_header_file(header->text);
+    found = search_header_file(pp->ctx->search, &file, header->text);
   } else if(header->type == PP_H_NAME && header->text->head[0] == '"') {
-    path = search_named_source_file(header->text, pp->lexer->src->file);
+    found = search_named_source_file(pp->ctx->search, &file, header->text, pp->lexer->src->file);
+  }
+
+  if(file.misses != NULL) {
+    for(int i = 0; i < file.misses->size; i++) {
+      if(pp->ctx->misses != NULL) {
+        add_dependency(pp->ctx->misses, file.misses->paths[i], 0);
+      }
+      record_header_include(pp->ctx, file.misses->paths[i], 0, 1);
+    }
+    free_dependencies(file.misses);
+  }
+
+  if(!found) {
+    error("failed to search include file: %s\n", header->text->head);
   }
+  free_pp_token(header);
 
-  if(path == NULL) {
-    error("failed to search include file\n");
+  if(pp->ctx->dependencies->options.enabled) {
+    add_dependency(pp->ctx->dependencies, file.path, file.system);
+  }
+  if(pp->ctx->inputs != NULL) {
+    add_dependency(pp->ctx->inputs, file.path, file.system);
+  }
+  if(pp->ctx->recording != NULL) {
+    record_header_include(pp->ctx, file.path, file.system, 0);
+  }
+
+  // line markers need the positions of the tokens, which replayed output does not have
+  if(pp->ctx->speculator != NULL && pp->sink->mark == NULL) {
+    int committed = commit_speculation(pp, file.name);
+    speculate_includes(pp);
+    if(committed) {
+      if(file.fd >= 0) close(file.fd);
+      free_string(file.path);
+      return;
+    }
   }
 
-  struct pp_list *list = parse_preprocessing_file(path->head);
-  concat_pp_list(pp->list, list);
+  // the name is kept by the lookup table, so tokens can refer to it
+  if(pp->ctx->headers != NULL && pp->sink->mark == NULL && pp->ctx->speculation == NULL) {
+    include_cached_header(pp, &file);
+  } else {
+    parse_preprocessing_file_fd(pp->ctx, (unsigned char *) file.name, file.fd, pp->sink);
+  }
+  free_string(file.path);
 }
 
 // define, undef directive
-int check_parameter(struct macro_entry *macro, struct pp_token *token) {
+int check_parameter(struct preprocessor *pp, struct macro_entry *macro, struct pp_token *token) {
   int parameter_size = macro->parameter_size;
   if(macro->parameter_ellipsis) parameter_size++;
 
   if(token->type == PP_IDENT) {
     for(int i = 0; i < parameter_size; i++) {
-      if(strcmp(token->text->head, macro->parameters[i]->head) == 0) {
+      if(token_atom(pp, token) == macro->parameters[i]) {
         return 1;
       }
     }
@@ -1047,7 +1441,7 @@ int check_parameter(struct macro_entry *macro, struct pp_token *token) {
   return 0;
 }
 
-int check_stringify_operator(struct macro_entry *macro) {
+int check_stringify_operator(struct preprocessor *pp, struct macro_entry *macro) {
   struct pp_list *list = macro->replacement_list;
 
   for(struct pp_node *node = list->head; node != NULL; node = node->next) {
@@ -1056,7 +1450,7 @@ int check_stringify_operator(struct macro_entry *macro) {
 
       if(target == NULL) return 0;
       if(target->token->type == PP_SPACE) target = target->next;
-      if(!check_parameter(macro, target->token)) return 0;
+      if(!check_parameter(pp, macro, target->token)) return 0;
 
       node = target;
     }
@@ -1078,10 +1472,14 @@ int check_concat_operator(struct macro_entry *macro) {
   return 1;
 }
 
+// the definition is built in the arena of the table, which frees it when the table is cleared
 void define_directive(struct preprocessor *pp) {
-  struct macro_entry *macro = allocate_macro_entry();
+  struct macro_arena *arena = pp->ctx->macros->arena;
+  struct macro_entry *macro = reserve_macro_entry(arena);
 
-  macro->identifier = expect_pp_token(pp, PP_IDENT)->text->head;
+  struct pp_token *name = expect_pp_token(pp, PP_IDENT);
+  macro->identifier = token_atom(pp, name);
+  append_macro_arena(arena, macro->tokens, name);
 
   if(check_pp_token(pp, PP_SPACE) || check_pp_token(pp, PP_NEW_LINE)) {
     macro->type = MACRO_OBJECT;
@@ -1103,7 +1501,8 @@ void define_directive(struct preprocessor *pp) {
           }
 
           struct pp_token *token = read_pp_token_with_space(pp);
-          macro->parameters[macro->parameter_size++] = token->text;
+          macro->parameters[macro->parameter_size++] = token_atom(pp, token);
+          append_macro_arena(arena, macro->tokens, token);
 
           if(check_pp_token(pp, PP_COMMA)) {
             skip_pp_token_with_space(pp);
@@ -1117,9 +1516,7 @@ void define_directive(struct preprocessor *pp) {
         } else if(check_pp_token(pp, PP_ELLIPSIS)) {
           skip_pp_token_with_space(pp);
 
-          struct string *va_args = allocate_string();
-          write_string(va_args, "__VA_ARGS__");
-          macro->parameters[macro->parameter_size] = va_args;
+          macro->parameters[macro->parameter_size] = intern_string(pp->ctx->atoms, "__VA_ARGS__", 11);
           macro->parameter_ellipsis = 1;
 
           if(check_pp_token(pp, PP_RPAREN)) {
@@ -1140,47 +1537,483 @@ void define_directive(struct preprocessor *pp) {
 
   while(!check_pp_token(pp, PP_NEW_LINE)) {
     struct pp_token *token = read_pp_token(pp);
-    append_pp_list(macro->replacement_list, token);
+    token->persistent = 1;
+    // interned now, as other threads may read the definition later
+    if(token->type == PP_IDENT) token_atom(pp, token);
+    append_macro_arena(arena, macro->replacement_list, token);
   }
 
   discard_new_line(pp);
 
-  if(macro->type == MACRO_FUNCTION && !check_stringify_operator(macro)) {
+  if(macro->type == MACRO_FUNCTION && !check_stringify_operator(pp, macro)) {
     error("invalid # operator.\n");
   }
   if(!check_concat_operator(macro)) {
     error("invalid ## operator.\n");
   }
 
-  insert_macro_table(macro);
+  define_macro(pp, macro);
 }
 
 void undef_directive(struct preprocessor *pp) {
   struct pp_token *ident = expect_pp_token(pp, PP_IDENT);
   discard_new_line(pp);
-  delete_macro_table(ident->text->head);
+  undefine_macro(pp, token_atom(pp, ident));
+  free_pp_token(ident);
+}
+
+// sink
+void write_output_sink(struct pp_sink *sink, struct pp_list *list) {
+  struct output *out = (struct output *) sink->data;
+  for(struct pp_node *node = list->head; node != NULL; node = node->next) {
+    write_output(out, node->token->text->head, node->token->text->size);
+  }
+}
+
+void write_output_text_sink(struct pp_sink *sink, const unsigned char *text, int size) {
+  struct output *out = (struct output *) sink->data;
+  write_output(out, text, size);
+}
+
+// tokens of macro definitions are freed with the macro table, so the list keeps copies
+struct pp_token *copy_pp_token(struct pp_token *token) {
+  struct pp_token *copy = allocate_pp_token();
+  copy->type = token->type;
+  copy->name = token->name;
+  concat_string(copy->text, token->text);
+  copy->concat = token->concat;
+  copy->file = token->file;
+  copy->atom = token->atom;
+  copy->offset = token->offset;
+  return copy;
+}
+
+void write_list_sink(struct pp_sink *sink, struct pp_list *list) {
+  struct pp_list *result = (struct pp_list *) sink->data;
+  for(struct pp_node *node = list->head; node != NULL; node = node->next) {
+    struct pp_token *token = node->token;
+    if(token->persistent) {
+      token = copy_pp_token(token);
+    }
+    append_pp_list(result, token);
+  }
+}
+
+// like the list sink, but the copies of macro tokens stay marked for the binary output
+void write_marked_list_sink(struct pp_sink *sink, struct pp_list *list) {
+  struct pp_list *result = (struct pp_list *) sink->data;
+  for(struct pp_node *node = list->head; node != NULL; node = node->next) {
+    struct pp_token *token = node->token;
+    if(token->persistent) {
+      token = copy_pp_token(token);
+      token->persistent = 1;
+    }
+    append_pp_list(result, token);
+  }
+}
+
+struct pp_sink *allocate_pp_sink(void (*write)(struct pp_sink *sink, struct pp_list *list), void *data, int retain) {
+  struct pp_sink *sink = (struct pp_sink *) malloc(sizeof(struct pp_sink));
+  if(sink == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  sink->write = write;
+  sink->write_text = NULL;
+  sink->mark = NULL;
+  sink->data = data;
+  sink->retain = retain;
+  return sink;
+}
+
+struct pp_sink *allocate_output_sink(struct output *out) {
+  struct pp_sink *sink = allocate_pp_sink(write_output_sink, out, 0);
+  sink->write_text = write_output_text_sink;
+  return sink;
+}
+
+struct pp_sink *allocate_list_sink(struct pp_list *list) {
+  return allocate_pp_sink(write_list_sink, list, 1);
+}
+
+struct pp_sink *allocate_marked_list_sink(struct pp_list *list) {
+  return allocate_pp_sink(write_marked_list_sink, list, 1);
+}
+
+// compact output: blank lines are dropped and spaces are kept only between tokens which would merge
+struct compact_output *allocate_compact_output(struct output *out, int markers) {
+  struct compact_output *compact = (struct compact_output *) malloc(sizeof(struct compact_output));
+  if(compact == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  compact->out = out;
+  compact->markers = markers;
+  compact->column = 0;
+  compact->space = 0;
+  compact->last = '\0';
+  compact->number = 0;
+  compact->file = NULL;
+  compact->row = 0;
+  compact->mark_file = NULL;
+  compact->mark_row = 0;
+  return compact;
+}
+
+void free_compact_output(struct compact_output *compact) {
+  free(compact);
+}
+
+int compact_word(unsigned char c) {
+  return ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9') || c == '_';
+}
+
+// number tells whether the last token is a pp-number, which takes a sign after its exponent
+int compact_separate(unsigned char last, int number, unsigned char first) {
+  if(number && strchr("eEpP", last) != NULL && (first == '+' || first == '-')) return 1;
+  if(compact_word(last)) {
+    return compact_word(first) || first == '"' || first == '\'' || first == '.';
+  }
+  if(last == '.' && '0' <= first && first <= '9') return 1;
+  if(strchr("+-*/%&|^<>=!.:#", last) != NULL && strchr("+-*/%&|^<>=!.:#", first) != NULL) return 1;
+  if(last >= 0x7f || first >= 0x7f || strchr("\\$@`", last) != NULL || strchr("\\$@`", first) != NULL) return 1;
+  return 0;
+}
+
+// a line marker is written when the file changes or the output line is off from the source line
+void write_line_marker(struct compact_output *compact) {
+  const unsigned char *file = compact->mark_file;
+  compact->mark_file = NULL;
+  if(compact->file == file && compact->row == compact->mark_row) return;
+
+  char marker[32];
+  write_output(compact->out, marker, sprintf(marker, "# %d \"", compact->mark_row));
+  for(const unsigned char *p = file; *p != '\0'; p++) {
+    if(*p == '"' || *p == '\\') write_output(compact->out, "\\", 1);
+    write_output(compact->out, p, 1);
+  }
+  write_output(compact->out, "\"\n", 2);
+
+  compact->file = file;
+  compact->row = compact->mark_row;
+}
+
+void write_compact_text(struct pp_sink *sink, const unsigned char *text, int size) {
+  struct compact_output *compact = (struct compact_output *) sink->data;
+
+  if(size == 0) return;
+  if(text[0] == ' ' || text[0] == '\t') {
+    compact->space = 1;
+    return;
+  }
+  if(text[0] == '\n') {
+    if(compact->column > 0) {
+      write_output(compact->out, "\n", 1);
+      compact->column = 0;
+      compact->row++;
+    }
+    compact->space = 0;
+    return;
+  }
+
+  if(compact->column == 0 && compact->mark_file != NULL) {
+    write_line_marker(compact);
+  }
+  if(compact->space && compact->column > 0 && compact_separate(compact->last, compact->number, text[0])) {
+    write_output(compact->out, " ", 1);
+    compact->column++;
+  }
+  write_output(compact->out, text, size);
+  compact->column += size;
+  compact->space = 0;
+  compact->last = text[size - 1];
+  compact->number = ('0' <= text[0] && text[0] <= '9') || (text[0] == '.' && size > 1 && '0' <= text[1] && text[1] <= '9');
+}
+
+void write_compact_sink(struct pp_sink *sink, struct pp_list *list) {
+  for(struct pp_node *node = list->head; node != NULL; node = node->next) {
+    write_compact_text(sink, node->token->text->head, node->token->text->size);
+  }
+}
+
+// the marker is deferred until the line writes something
+void mark_compact_sink(struct pp_sink *sink, struct source *src, int offset) {
+  struct compact_output *compact = (struct compact_output *) sink->data;
+  if(!compact->markers) return;
+
+  if(compact->column > 0) {
+    write_output(compact->out, "\n", 1);
+    compact->column = 0;
+    compact->row++;
+  }
+  compact->space = 0;
+  compact->mark_file = src->file;
+  compact->mark_row = source_row(src, offset);
+}
+
+struct pp_sink *allocate_compact_sink(struct compact_output *compact) {
+  struct pp_sink *sink = allocate_pp_sink(write_compact_sink, compact, 0);
+  sink->write_text = write_compact_text;
+  sink->mark = compact->markers ? mark_compact_sink : NULL;
+  return sink;
+}
+
+void free_pp_sink(struct pp_sink *sink) {
+  free(sink);
+}
+
+// free the tokens of an emitted line, except those owned by macro definitions
+void release_pp_tokens(struct pp_list *replaced, struct pp_list *text) {
+  struct pp_list *garbage = allocate_pp_list();
+  struct pp_list *lists[2] = { replaced, text };
+
+  for(int i = 0; i < 2; i++) {
+    for(struct pp_node *node = lists[i]->head; node != NULL; node = node->next) {
+      if(!node->token->persistent && !node->token->released) {
+        node->token->released = 1;
+        append_pp_list(garbage, node->token);
+      }
+    }
+  }
+
+  for(struct pp_node *node = garbage->head; node != NULL; node = node->next) {
+    free_pp_token(node->token);
+  }
+  free_pp_list(garbage);
+}
+
+// a retaining sink keeps the emitted tokens; free those the macro replacement consumed
+// the tokens of macros are left untouched, as a cached header shares them between threads
+void release_replaced_pp_tokens(struct pp_list *replaced, struct pp_list *text) {
+  for(struct pp_node *node = replaced->head; node != NULL; node = node->next) {
+    if(!node->token->persistent) node->token->released = 1;
+  }
+  for(struct pp_node *node = text->head; node != NULL; node = node->next) {
+    if(!node->token->persistent && !node->token->released) {
+      free_pp_token(node->token);
+    }
+  }
+  for(struct pp_node *node = replaced->head; node != NULL; node = node->next) {
+    if(!node->token->persistent) node->token->released = 0;
+  }
+}
+
+// frees the tokens of a list written to a sink, all of them or only the marked copies if the sink kept the rest; a token may appear in the list more than once
+void release_written_pp_tokens(struct pp_list *list, int retained) {
+  struct pp_list *garbage = allocate_pp_list();
+  for(struct pp_node *node = list->head; node != NULL; node = node->next) {
+    if((!retained || node->token->persistent) && !node->token->released) {
+      node->token->released = 1;
+      append_pp_list(garbage, node->token);
+    }
+  }
+
+  for(struct pp_node *node = garbage->head; node != NULL; node = node->next) {
+    free_pp_token(node->token);
+  }
+  free_pp_list(garbage);
+}
+
+// writes copies of the tokens, so that the list can be written again
+void write_pp_token_copies(struct pp_list *list, struct pp_sink *sink) {
+  struct pp_list *copies = allocate_pp_list();
+  for(struct pp_node *node = list->head; node != NULL; node = node->next) {
+    struct pp_token *token = copy_pp_token(node->token);
+    token->persistent = node->token->persistent;
+    append_pp_list(copies, token);
+  }
+  sink->write(sink, copies);
+  release_written_pp_tokens(copies, sink->retain);
+  free_pp_list(copies);
+}
+
+// verbatim text line
+int verbatim_space(unsigned char c) {
+  return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+}
+
+int verbatim_word(unsigned char c) {
+  return ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9') || c == '_';
+}
+
+// returns the offset just after a simple string or character literal, or -1
+int skip_verbatim_literal(const unsigned char *text, int pos, int end) {
+  unsigned char quote = text[pos++];
+  int begin = pos;
+
+  while(pos < end && text[pos] != quote) {
+    unsigned char c = text[pos];
+    if(c == '\\') {
+      if(pos + 1 >= end) return -1;
+      unsigned char e = text[pos + 1];
+      if(strchr("'\"?\\abfnrtv01234567", e) == NULL) return -1;
+      pos += 2;
+    } else if(c < 0x20 || c >= 0x7f) {
+      return -1;
+    } else {
+      pos++;
+    }
+  }
+
+  if(pos >= end) return -1;
+  if(quote == '\'') {
+    // a character constant is a single character or a simple escape sequence
+    if(pos - begin == 1 && text[begin] != '\\') return pos + 1;
+    if(pos - begin == 2 && text[begin] == '\\' && !('0' <= text[begin + 1] && text[begin + 1] <= '7')) return pos + 1;
+    return -1;
+  }
+  return pos + 1;
+}
+
+// check that text[begin, end) lexes to tokens with no defined macro names
+int check_verbatim_line(struct skcc_context *ctx, const unsigned char *text, int begin, int end) {
+  for(int i = begin; i < end;) {
+    unsigned char c = text[i];
+    if(c == '"' || c == '\'') {
+      i = skip_verbatim_literal(text, i, end);
+      if(i < 0) return 0;
+    } else if(verbatim_word(c)) {
+      int j = i;
+      while(j < end && verbatim_word(text[j])) j++;
+      if(!('0' <= c && c <= '9') && check_macro_filter(ctx->macros, intern_hash(&text[i], j - i))) {
+        // a macro name is always interned
+        const unsigned char *ident = find_interned(ctx->atoms, &text[i], j - i);
+        if(ident != NULL && search_macro_table(ctx->macros, ident) != NULL) return 0;
+      }
+      i = j;
+    } else if(c == '/' && i + 1 < end && (text[i + 1] == '/' || text[i + 1] == '*')) {
+      return 0;
+    } else if(verbatim_space(c) || (0x20 < c && c < 0x7f && c != '\\' && c != '$' && c != '@' && c != '`')) {
+      i++;
+    } else {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// copy a text line without macro invocations straight from the source buffer
+int parse_verbatim_line(struct preprocessor *pp) {
+  if(pp->sink->write_text == NULL) return 0;
+
+  const unsigned char *text = pp->lexer->src->content->text;
+  int size = pp->lexer->src->content->size;
+  int begin = peek_pp_token(pp)->offset;
+  if(begin < 0) return 0;
+
+  const unsigned char *nl = memchr(&text[begin], '\n', size - begin);
+  if(nl == NULL) return 0;
+  int end = nl - text;
+  while(end > begin && verbatim_space(text[end - 1])) end--;
+
+  if(!check_verbatim_line(pp->ctx, text, begin, end)) return 0;
+
+  // white spaces out of literals are written as a single space like the token path
+  int start = begin;
+  for(int i = begin; i < end;) {
+    if(text[i] == '"' || text[i] == '\'') {
+      i = skip_verbatim_literal(text, i, end);
+    } else if(verbatim_space(text[i])) {
+      pp->sink->write_text(pp->sink, &text[start], i - start);
+      pp->sink->write_text(pp->sink, " ", 1);
+      while(verbatim_space(text[i])) i++;
+      start = i;
+    } else {
+      i++;
+    }
+  }
+  pp->sink->write_text(pp->sink, &text[start], end - start);
+
+  // the trailing spaces and the new line are lexed as a new line token
+  while(pp->token_queue_size > 0) {
+    skip_pp_token(pp);
+  }
+  seek_pp_token_lexer(pp->lexer, end);
+  pp->lexer->context = CTX_NORMAL;
+
+  struct pp_list *line = allocate_pp_list();
+  append_pp_list(line, read_pp_token(pp));
+  pp->sink->write(pp->sink, line);
+  free_pp_token(line->head->token);
+  free_pp_list(line);
+
+  return 1;
 }
 
 // text line
 void parse_text_line(struct preprocessor *pp) {
+  if(pp->sink->mark != NULL) {
+    pp->sink->mark(pp->sink, pp->lexer->src, peek_pp_token(pp)->offset);
+  }
+  if(parse_verbatim_line(pp)) return;
+
   struct pp_list *text = allocate_pp_list();
+  int defined = 0;
+  int invoked = 0;
+  int level = 0;
+  int pending = 0;
 
   while(1) {
     struct pp_token *token = read_pp_token(pp);
     append_pp_list(text, token);
+
+    // track function-like macro invocations which may continue to the next line
+    if(token->type == PP_IDENT) {
+      struct macro_entry *macro = lookup_macro(pp, token_atom(pp, token));
+      pending = macro != NULL && macro->type == MACRO_FUNCTION;
+      defined = defined || macro != NULL;
+      invoked = invoked || pending;
+    } else if(token->type != PP_SPACE && token->type != PP_NEW_LINE) {
+      pending = 0;
+      if(invoked && token->type == PP_LPAREN) level++;
+      if(invoked && token->type == PP_RPAREN && level > 0) level--;
+    }
+
     if(token->type == PP_NEW_LINE) {
       struct pp_token *next = peek_pp_token(pp);
       if(next->type == PP_SHARP || next->type == PP_NONE) {
         break;
       }
+      if(level == 0 && !pending) {
+        break;
+      }
     }
   }
 
-  struct pp_list *replaced = scan_macro(pp, text);
-  concat_pp_list(pp->list, replaced);
+  // a line naming no defined macro needs no rescanning
+  struct pp_list *replaced = defined ? scan_macro(pp, text) : text;
+  pp->sink->write(pp->sink, replaced);
+
+  if(!pp->sink->retain) {
+    release_pp_tokens(replaced, text);
+  } else if(replaced != text) {
+    release_replaced_pp_tokens(replaced, text);
+  }
+  if(replaced != text) {
+    free_pp_list(replaced);
+  }
+  free_pp_list(text);
+}
+
+// dependency scanning does not need text lines; jump to the next directive
+void skip_text_lines(struct preprocessor *pp) {
+  struct skeleton *skeleton = pp->lexer->src->content->skeleton;
+  int next = next_directive(skeleton, peek_pp_token(pp)->offset + 1);
+  int offset = next < skeleton->size ? skeleton->directives[next].offset : pp->lexer->src->content->size;
+
+  while(pp->token_queue_size > 0) {
+    skip_pp_token(pp);
+  }
+  seek_pp_token_lexer(pp->lexer, offset);
 }
 
 // group
+void mark_directive(struct preprocessor *pp) {
+  struct skeleton *skeleton = pp->lexer->src->content->skeleton;
+  pp->directive = search_directive(skeleton, peek_pp_token(pp)->offset);
+}
+
 int check_if_section(struct preprocessor *pp) {
   if(check_keyword(pp, "if")) return 1;
   if(check_keyword(pp, "ifdef")) return 1;
@@ -1198,6 +2031,7 @@ int check_group_end(struct preprocessor *pp) {
 void group(struct preprocessor *pp) {
   while(!check_pp_token(pp, PP_NONE)) {
     if(check_pp_token(pp, PP_SHARP)) {
+      mark_directive(pp);
       skip_pp_token_with_space(pp);
 
       if(check_if_section(pp)) {
@@ -1228,6 +2062,8 @@ void group(struct preprocessor *pp) {
         struct pp_token *directive = read_pp_token(pp);
         error("unknown directive: \"#%s\".\n", directive->text->head);
       }
+    } else if(pp->ctx->dependencies->options.only) {
+      skip_text_lines(pp);
     } else {
       parse_text_line(pp);
     }
@@ -1237,13 +2073,40 @@ void group(struct preprocessor *pp) {
 void skip_line(struct preprocessor *pp) {
   while(1) {
     struct pp_token *token = read_pp_token(pp);
-    if(token->type == PP_NEW_LINE) break;
+    enum pp_token_type type = token->type;
+    free_pp_token(token);
+    if(type == PP_NEW_LINE) break;
+  }
+}
+
+int skip_group_by_skeleton(struct preprocessor *pp) {
+  if(pp->directive < 0) return 0;
+
+  struct skeleton *skeleton = pp->lexer->src->content->skeleton;
+  struct directive *directive = &skeleton->directives[pp->directive];
+  if(directive->type != DIR_IF && directive->type != DIR_IFDEF && directive->type != DIR_IFNDEF
+      && directive->type != DIR_ELIF && directive->type != DIR_ELSE) {
+    return 0;
+  }
+  if(directive->next < 0) return 0;
+
+  while(pp->token_queue_size > 0) {
+    skip_pp_token(pp);
   }
+  seek_pp_token_lexer(pp->lexer, skeleton->directives[directive->next].offset);
+  pp->directive = directive->next;
+  read_pp_token_with_space(pp);
+
+  return 1;
 }
 
 void skip_group(struct preprocessor *pp) {
+  // jump to the matching #elif, #else or #endif without lexing the group
+  if(skip_group_by_skeleton(pp)) return;
+
   while(peek_pp_token(pp)->type != PP_NONE) {
     if(peek_pp_token(pp)->type == PP_SHARP) {
+      mark_directive(pp);
       read_pp_token_with_space(pp);
 
       if(check_if_section(pp)) {
@@ -1271,11 +2134,38 @@ void skip_group(struct preprocessor *pp) {
   }
 }
 
-struct pp_list *parse_preprocessing_file(unsigned char *file) {
+void parse_preprocessing_file(struct skcc_context *ctx, unsigned char *file, struct pp_sink *sink) {
+  parse_preprocessing_file_fd(ctx, file, -1, sink);
+}
+
+void parse_preprocessing_file_fd(struct skcc_context *ctx, unsigned char *file, int fd, struct pp_sink *sink) {
+  if(ctx->include_depth == INCLUDE_DEPTH_LIMIT) {
+    if(fd >= 0) close(fd);
+    error("#include nested too deeply: %s\n", file);
+  }
+
+  parse_preprocessing_lexer(ctx, file, allocate_pp_token_lexer_fd(ctx->sources, file, fd), sink);
+}
+
+// preprocess text which is not in a file, such as the definitions of the command line
+void parse_preprocessing_text(struct skcc_context *ctx, unsigned char *file, const unsigned char *text, int size, struct pp_sink *sink) {
+  parse_preprocessing_lexer(ctx, file, allocate_pp_token_lexer_text(ctx->sources, file, text, size), sink);
+}
+
+void parse_preprocessing_lexer(struct skcc_context *ctx, unsigned char *file, struct pp_token_lexer *lexer, struct pp_sink *sink) {
   struct preprocessor pp;
-  pp.lexer = allocate_pp_token_lexer(file);
+  pp.ctx = ctx;
+  pp.lexer = lexer;
   pp.token_queue_size = 0;
-  pp.list = allocate_pp_list();
+  pp.directive = -1;
+  pp.sink = sink;
+
+  // the include stack lets an error unwind the open files
+  ctx->includes[ctx->include_depth++] = pp.lexer;
+
+  if(ctx->prefetch != NULL) {
+    prefetch_includes(ctx->prefetch, pp.lexer->src->content, file);
+  }
 
   group(&pp);
 
@@ -1289,21 +2179,204 @@ struct pp_list *parse_preprocessing_file(unsigned char *file) {
     }
   }
 
-  return pp.list;
+  ctx->include_depth--;
+  while(pp.token_queue_size > 0) {
+    skip_pp_token(&pp);
+  }
+  free_pp_token_lexer(pp.lexer);
 }
 
-struct pp_list *preprocess(unsigned char *file) {
-  struct macro_entry *arch = allocate_macro_entry();
-  arch->identifier = "__x86_64__";
-  insert_macro_table(arch);
+// context
+struct skcc_context *allocate_skcc_context() {
+  struct skcc_context *ctx = (struct skcc_context *) malloc(sizeof(struct skcc_context));
+  if(ctx == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  ctx->parent = NULL;
+  ctx->atoms = allocate_intern_table();
+  ctx->macros = allocate_macro_table();
+  ctx->sources = allocate_source_cache();
+  ctx->search = allocate_include_search();
+  ctx->dependencies = allocate_dependencies();
+  ctx->prefetch = NULL;
+  ctx->speculator = NULL;
+  ctx->speculation = NULL;
+  ctx->speculations = NULL;
+  ctx->snapshot = NULL;
+  ctx->snapshot_macros = NULL;
+  ctx->prefix = NULL;
+  ctx->predefined = NULL;
+  ctx->inputs = NULL;
+  ctx->misses = NULL;
+  ctx->definitions = NULL;
+  ctx->headers = NULL;
+  ctx->recording = NULL;
+  ctx->include_depth = 0;
+  return ctx;
+}
+
+// a context for another thread, sharing the source cache and the include lookups of the parent
+struct skcc_context *allocate_skcc_worker_context(struct skcc_context *parent) {
+  struct skcc_context *ctx = (struct skcc_context *) malloc(sizeof(struct skcc_context));
+  if(ctx == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  ctx->parent = parent;
+  ctx->atoms = parent->atoms;
+  ctx->macros = allocate_macro_table();
+  ctx->sources = parent->sources;
+  ctx->search = parent->search;
+  ctx->dependencies = allocate_dependencies();
+  ctx->dependencies->options = parent->dependencies->options;
+  ctx->prefetch = parent->prefetch;
+  ctx->speculator = parent->speculator;
+  ctx->speculation = NULL;
+  ctx->speculations = NULL;
+  ctx->snapshot = parent->snapshot;
+  ctx->snapshot_macros = NULL;
+  ctx->prefix = parent->prefix;
+  ctx->predefined = NULL;
+  ctx->inputs = NULL;
+  ctx->misses = NULL;
+  ctx->definitions = parent->definitions;
+  ctx->headers = parent->headers;
+  ctx->recording = NULL;
+  ctx->include_depth = 0;
+  return ctx;
+}
+
+void free_skcc_context(struct skcc_context *ctx) {
+  free_macro_table(ctx->macros);
+  if(ctx->predefined != NULL) {
+    free_predefined_image(ctx->predefined);
+  }
+  if(ctx->parent == NULL) {
+    clear_macro_definitions(ctx);
+    if(ctx->speculator != NULL) {
+      free_speculator(ctx->speculator);
+    }
+    if(ctx->prefetch != NULL) {
+      free_prefetcher(ctx->prefetch);
+    }
+    free_intern_table(ctx->atoms);
+    if(ctx->sources->tokens != NULL) {
+      free_token_cache(ctx->sources->tokens);
+      ctx->sources->tokens = NULL;
+    }
+    free_source_cache(ctx->sources);
+    free_include_search(ctx->search);
+  }
+  free_dependencies(ctx->dependencies);
+  free(ctx);
+}
+
+// -D name, -D name=definition and -U name are kept as directives, in the order of the command line
+void add_macro_definition(struct skcc_context *ctx, char *option, char *argument) {
+  if(ctx->definitions == NULL) {
+    ctx->definitions = allocate_string();
+  }
+
+  int length = strcspn(argument, "(=");
+  if(length == 0) {
+    error("macro name missing after \"%s\".\n", option);
+  }
 
-  struct pp_list *list = parse_preprocessing_file(file);
+  // a definition replaces the one before it, as with gcc
+  write_string(ctx->definitions, "#undef ");
+  for(int i = 0; i < length; i++) {
+    append_string(ctx->definitions, argument[i]);
+  }
+  append_string(ctx->definitions, '\n');
 
-  for(int i = 0; i < MACRO_TABLE_SIZE; i++) {
-    if(macro_table[i] != NULL) {
-      free_macro_entry(macro_table[i]);
+  if(strcmp(option, "-D") == 0) {
+    char *value = strchr(argument, '=');
+    write_string(ctx->definitions, "#define ");
+    for(int i = 0; &argument[i] != value && argument[i] != '\0'; i++) {
+      append_string(ctx->definitions, argument[i]);
     }
+    append_string(ctx->definitions, ' ');
+    write_string(ctx->definitions, value != NULL ? &value[1] : "1");
+    append_string(ctx->definitions, '\n');
   }
+}
 
+void clear_macro_definitions(struct skcc_context *ctx) {
+  if(ctx->definitions != NULL) {
+    free_string(ctx->definitions);
+    ctx->definitions = NULL;
+  }
+}
+
+// the macros every run starts with: the compiled-in ones, then those of the command line
+void predefine_macros(struct skcc_context *ctx) {
+  if(ctx->predefined == NULL) {
+    ctx->predefined = allocate_predefined_image(ctx->atoms);
+  }
+  install_predefined_image(ctx->predefined, ctx->macros);
+
+  if(ctx->definitions != NULL) {
+    struct pp_list *output = allocate_pp_list();
+    struct pp_sink *sink = allocate_list_sink(output);
+    parse_preprocessing_text(ctx, (unsigned char *) "<command-line>", ctx->definitions->head, ctx->definitions->size, sink);
+    release_written_pp_tokens(output, 0);
+    free_pp_list(output);
+    free_pp_sink(sink);
+  }
+}
+
+// preprocess a file into the sink; returns 0 on success and 1 on error
+int skcc_preprocess(struct skcc_context *ctx, const char *path, struct pp_sink *sink) {
+  jmp_buf jump;
+  jmp_buf *saved_jump = error_jump;
+  int status = 0;
+
+  error_jump = &jump;
+  if(setjmp(jump) == 0) {
+    predefine_macros(ctx);
+    if(ctx->snapshot != NULL) {
+      include_snapshot(ctx, ctx->snapshot, sink);
+    }
+    if(ctx->prefix != NULL && !ctx->dependencies->options.only) {
+      write_pp_token_copies(ctx->prefix, sink);
+    }
+
+    parse_preprocessing_file(ctx, (unsigned char *) path, sink);
+
+    if(ctx->dependencies->options.enabled) {
+      write_dependencies(ctx->dependencies, path);
+    }
+  } else {
+    abort_header_recordings(ctx);
+    while(ctx->include_depth > 0) {
+      free_pp_token_lexer(ctx->includes[--ctx->include_depth]);
+    }
+    status = 1;
+  }
+  error_jump = saved_jump;
+
+  // the speculations refer to the macros of this run
+  if(ctx->speculator != NULL) {
+    cancel_speculations(ctx);
+  }
+  clear_macro_table(ctx->macros);
+  clear_dependencies(ctx->dependencies);
+  free(ctx->snapshot_macros);
+  ctx->snapshot_macros = NULL;
+  return status;
+}
+
+struct pp_list *preprocess(struct skcc_context *ctx, unsigned char *file) {
+  struct pp_list *list = allocate_pp_list();
+  struct pp_sink *sink = allocate_list_sink(list);
+
+  int status = skcc_preprocess(ctx, file, sink);
+
+  free_pp_sink(sink);
+  if(status != 0) {
+    free_pp_list(list);
+    return NULL;
+  }
   return list;
 }
@@ -5,11 +5,27 @@
 #include "string.h"
 #include "lex.h"
 #include "utf8.h"
+#include "search.h"
+#include "depend.h"
+#include "output.h"
+#include "intern.h"
+#include "prefetch.h"
+#include "tokcache.h"
 
 /* prime number */
 #define MACRO_TABLE_SIZE 40961
 #define MACRO_TABLE_SLIDE_MOD 1001
 
+/* power of 2 */
+#define MACRO_FILTER_SIZE 65536
+
+// generations a table goes through before its marks are cleared; the mark of a slot holds one and a bit
+#define MACRO_GENERATION_LIMIT 127
+
+#define MACRO_ARENA_BLOCK_SIZE 65536
+
+#define INCLUDE_DEPTH_LIMIT 200
+
 #define MACRO_PARAMS_SIZE 128
 #define MACRO_PARAMS_LIMIT (MACRO_PARAMS_SIZE - 1)
 
@@ -31,22 +47,151 @@ struct macro_entry {
   const unsigned char *identifier;
   int parameter_size;
   int parameter_ellipsis;
-  struct string *parameters[MACRO_PARAMS_SIZE];
+  const unsigned char *parameters[MACRO_PARAMS_SIZE];
   struct pp_list *replacement_list;
+  struct pp_list *tokens;
   int expanded;
+  int borrowed;
+  int settled;
+};
+
+struct pp_sink {
+  void (*write)(struct pp_sink *sink, struct pp_list *list);
+  void (*write_text)(struct pp_sink *sink, const unsigned char *text, int size);
+  void (*mark)(struct pp_sink *sink, struct source *src, int offset);
+  void *data;
+  int retain;
+};
+
+struct compact_output {
+  struct output *out;
+  int markers;
+  int column;
+  int space;
+  unsigned char last;
+  int number;
+  const unsigned char *file;
+  int row;
+  const unsigned char *mark_file;
+  int mark_row;
+};
+
+struct macro_arena_block {
+  struct macro_arena_block *next;
+  size_t size;
+  size_t used;
+  unsigned char data[];
+};
+
+// memory of the macros defined in a table, freed at once when the table is cleared
+struct macro_arena {
+  struct macro_arena_block *blocks;
+};
+
+// a slot or a filter counter is in use only if it was marked in the current generation;
+// names looked up in none of the slots are looked up in the base, unless a slot hides them
+struct macro_table {
+  struct macro_entry *entries[MACRO_TABLE_SIZE];
+  unsigned char marks[MACRO_TABLE_SIZE];
+  unsigned short filter[MACRO_FILTER_SIZE];
+  int generation;
+  struct macro_table *base;
+  struct macro_arena *arena;
+  struct macro_entry **defined;
+  int defined_size;
+  int defined_alloc;
+};
+
+struct speculator;
+struct speculation;
+struct macro_snapshot;
+struct predefined_image;
+struct header_cache;
+struct header_recording;
+
+// everything one preprocessing run touches; contexts are independent of each other
+struct skcc_context {
+  struct skcc_context *parent;
+  struct intern_table *atoms;
+  struct macro_table *macros;
+  struct source_cache *sources;
+  struct include_search *search;
+  struct dependencies *dependencies;
+  struct dependencies *inputs;
+  struct dependencies *misses;
+  struct prefetcher *prefetch;
+  struct speculator *speculator;
+  struct speculation *speculation;
+  struct speculation *speculations;
+  struct macro_snapshot *snapshot;
+  struct macro_entry *snapshot_macros;
+  struct pp_list *prefix;
+  struct predefined_image *predefined;
+  struct string *definitions;
+  struct header_cache *headers;
+  struct header_recording *recording;
+  struct pp_token_lexer *includes[INCLUDE_DEPTH_LIMIT];
+  int include_depth;
 };
 
 struct preprocessor {
+  struct skcc_context *ctx;
   struct pp_token_lexer *lexer;
   struct pp_token *token_queue[1];
   int token_queue_size;
-  struct pp_list *list;
+  int directive;
+  struct pp_sink *sink;
 };
 
+extern struct pp_list *allocate_pp_list();
+extern void free_pp_list(struct pp_list *list);
+extern void append_pp_list(struct pp_list *list, struct pp_token *token);
+extern struct pp_token *copy_pp_token(struct pp_token *token);
+extern void release_written_pp_tokens(struct pp_list *list, int retained);
+extern void write_pp_token_copies(struct pp_list *list, struct pp_sink *sink);
+extern struct macro_entry *allocate_macro_entry();
+extern void free_macro_entry(struct macro_entry *macro);
+extern struct macro_entry *borrow_macro_entry(const struct macro_entry *macro);
+extern int compare_macro(const struct macro_entry *macro1, const struct macro_entry *macro2);
 extern void group(struct preprocessor *pp);
 extern void skip_line(struct preprocessor *pp);
 extern void skip_group(struct preprocessor *pp);
-extern struct pp_list *parse_preprocessing_file(unsigned char *file);
-extern struct pp_list *preprocess(unsigned char *file);
+extern struct pp_sink *allocate_pp_sink(void (*write)(struct pp_sink *sink, struct pp_list *list), void *data, int retain);
+extern struct pp_sink *allocate_output_sink(struct output *out);
+extern struct pp_sink *allocate_list_sink(struct pp_list *list);
+extern struct pp_sink *allocate_marked_list_sink(struct pp_list *list);
+extern struct compact_output *allocate_compact_output(struct output *out, int markers);
+extern void free_compact_output(struct compact_output *compact);
+extern struct pp_sink *allocate_compact_sink(struct compact_output *compact);
+extern void free_pp_sink(struct pp_sink *sink);
+extern struct macro_arena *allocate_macro_arena();
+extern void clear_macro_arena(struct macro_arena *arena);
+extern void free_macro_arena(struct macro_arena *arena);
+extern void adopt_macro_arena(struct macro_arena *arena, struct macro_arena *other);
+extern struct macro_entry *reserve_macro_entry(struct macro_arena *arena);
+extern void append_macro_arena(struct macro_arena *arena, struct pp_list *list, struct pp_token *token);
+extern struct macro_table *allocate_macro_table();
+extern struct macro_table *copy_macro_table(const struct macro_table *table);
+extern struct macro_entry *slot_macro_table(struct macro_table *table, int h);
+extern void detach_macro_table(struct macro_table *table, struct macro_entry ***defined, int *size, struct macro_arena **arena);
+extern void disown_macro_table(struct macro_table *table, struct macro_entry ***defined, int *size, struct macro_arena **arena);
+extern void reset_macro_table(struct macro_table *table);
+extern void clear_macro_table(struct macro_table *table);
+extern void free_macro_table(struct macro_table *table);
+extern void insert_macro_table(struct macro_table *table, struct macro_entry *macro);
+extern void install_macro_table(struct macro_table *table, struct macro_entry *macro);
+extern void delete_macro_table(struct macro_table *table, const unsigned char *identifier);
+extern struct macro_entry *search_macro_table(struct macro_table *table, const unsigned char *identifier);
+extern void parse_preprocessing_file(struct skcc_context *ctx, unsigned char *file, struct pp_sink *sink);
+extern void parse_preprocessing_file_fd(struct skcc_context *ctx, unsigned char *file, int fd, struct pp_sink *sink);
+extern void parse_preprocessing_text(struct skcc_context *ctx, unsigned char *file, const unsigned char *text, int size, struct pp_sink *sink);
+extern struct skcc_context *allocate_skcc_context();
+extern struct skcc_context *allocate_skcc_worker_context(struct skcc_context *parent);
+extern void free_skcc_context(struct skcc_context *ctx);
+extern void add_macro_definition(struct skcc_context *ctx, char *option, char *argument);
+extern void clear_macro_definitions(struct skcc_context *ctx);
+extern void predefine_macros(struct skcc_context *ctx);
+extern int skcc_preprocess(struct skcc_context *ctx, const char *path, struct pp_sink *sink);
+extern struct pp_list *preprocess(struct skcc_context *ctx, unsigned char *file);
 
 #endif
@@ -0,0 +1,69 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "reader.h"
+
+// returns 0 on success, -1 if the file is not a valid token stream
+int open_token_stream(struct token_stream_reader *reader, const char *file) {
+  int fd = open(file, O_RDONLY);
+  if(fd < 0) return -1;
+
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size < sizeof(struct token_stream_header)) {
+    close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return -1;
+
+  const struct token_stream_header *header = (const struct token_stream_header *) map;
+  if(memcmp(header->magic, TOKEN_STREAM_MAGIC, 4) != 0 || header->version != TOKEN_STREAM_VERSION
+      || header->size != st.st_size || header->record_offset % 4 != 0
+      || header->string_offset < header->atom_offset || header->record_offset < header->string_offset
+      || header->size < header->record_offset
+      || (header->string_offset - header->atom_offset) / sizeof(uint32_t) != header->atom_count + 1
+      || (header->size - header->record_offset) / sizeof(struct token_record) != header->record_count) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  reader->map = map;
+  reader->size = st.st_size;
+  reader->header = header;
+  reader->atom_offsets = (const uint32_t *) ((const char *) map + header->atom_offset);
+  reader->strings = (const char *) map + header->string_offset;
+  reader->records = (const struct token_record *) ((const char *) map + header->record_offset);
+  return 0;
+}
+
+void close_token_stream(struct token_stream_reader *reader) {
+  munmap(reader->map, reader->size);
+  reader->map = NULL;
+}
+
+const char *token_stream_atom(const struct token_stream_reader *reader, uint32_t atom) {
+  if(atom >= reader->header->atom_count) return NULL;
+  return &reader->strings[reader->atom_offsets[atom]];
+}
+
+// print the stream as skcc prints the textual output
+int write_token_stream_text(const struct token_stream_reader *reader, FILE *fp) {
+  for(uint32_t i = 0; i < reader->header->record_count; i++) {
+    const struct token_record *record = &reader->records[i];
+    const char *text = token_stream_atom(reader, record->atom);
+    if(text == NULL) return -1;
+
+    for(int j = 0; j < record->lines; j++) {
+      fputc('\n', fp);
+    }
+    if(record->flags & TOKEN_SPACE) {
+      fputc(' ', fp);
+    }
+    fputs(text, fp);
+  }
+  return 0;
+}
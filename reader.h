@@ -0,0 +1,23 @@
+#ifndef __READER_INCLUDE__
+#define __READER_INCLUDE__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "binary.h"
+
+// a mapped binary token stream; no part of the file is parsed or copied
+struct token_stream_reader {
+  void *map;
+  long size;
+  const struct token_stream_header *header;
+  const uint32_t *atom_offsets;
+  const char *strings;
+  const struct token_record *records;
+};
+
+extern int open_token_stream(struct token_stream_reader *reader, const char *file);
+extern void close_token_stream(struct token_stream_reader *reader);
+extern const char *token_stream_atom(const struct token_stream_reader *reader, uint32_t atom);
+extern int write_token_stream_text(const struct token_stream_reader *reader, FILE *fp);
+
+#endif
@@ -0,0 +1,287 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "search.h"
+
+#ifndef GCC_INCLUDE_DIR
+#define GCC_INCLUDE_DIR "/usr/lib/gcc/x86_64-linux-gnu/7/include/"
+#endif
+
+const char *default_include_paths[] = {
+  GCC_INCLUDE_DIR,
+  "/usr/include/",
+  "/usr/include/linux/",
+  "/usr/include/x86_64-linux-gnu/"
+};
+
+#define DEFAULT_INCLUDE_PATHS_SIZE (sizeof(default_include_paths) / sizeof(default_include_paths[0]))
+
+struct include_search *allocate_include_search() {
+  struct include_search *search = (struct include_search *) calloc(1, sizeof(struct include_search));
+  if(search == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  search->lookup_table = (struct lookup_entry *) calloc(LOOKUP_TABLE_SIZE, sizeof(struct lookup_entry));
+  if(search->lookup_table == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  search->lookup_size = LOOKUP_TABLE_SIZE;
+  search->notify = -1;
+  pthread_mutex_init(&search->lock, NULL);
+  return search;
+}
+
+void free_include_search(struct include_search *search) {
+  for(int i = 0; i < search->lookup_size; i++) {
+    free(search->lookup_table[i].path);
+  }
+  free(search->lookup_table);
+  if(search->notify >= 0) {
+    close(search->notify);
+  }
+  pthread_mutex_destroy(&search->lock);
+  free(search);
+}
+
+// include paths
+void add_include_path(struct include_search *search, enum include_path_type type, const char *dir) {
+  const char **paths;
+  int *size;
+
+  if(type == PATH_QUOTE) {
+    paths = search->paths.quote;
+    size = &search->paths.quote_size;
+  } else if(type == PATH_BRACKET) {
+    paths = search->paths.bracket;
+    size = &search->paths.bracket_size;
+  } else {
+    paths = search->paths.system;
+    size = &search->paths.system_size;
+  }
+
+  if(*size == INCLUDE_PATHS_SIZE) {
+    error("too many include paths.\n");
+  }
+
+  paths[(*size)++] = dir;
+}
+
+void clear_include_paths(struct include_search *search) {
+  search->paths.quote_size = 0;
+  search->paths.bracket_size = 0;
+  search->paths.system_size = 0;
+}
+
+// the include paths as the options which give them, one per line
+void write_include_paths(struct include_search *search, struct string *text) {
+  const char *options[] = { "-iquote", "-I", "-isystem" };
+  const char **paths[] = { search->paths.quote, search->paths.bracket, search->paths.system };
+  int sizes[] = { search->paths.quote_size, search->paths.bracket_size, search->paths.system_size };
+  for(int i = 0; i < 3; i++) {
+    for(int j = 0; j < sizes[i]; j++) {
+      write_string(text, (char *) options[i]);
+      append_string(text, ' ');
+      write_string(text, (char *) paths[i][j]);
+      append_string(text, '\n');
+    }
+  }
+}
+
+// lookup cache
+unsigned int path_hash(const unsigned char *path) {
+  const unsigned int BASE = 257;
+  unsigned int h = 0;
+  for(int i = 0; path[i] != '\0'; i++) {
+    h = h * BASE + path[i];
+  }
+  return h;
+}
+
+// a long running process watches the directories it looked into, so that cached lookups can be dropped
+void watch_include_search(struct include_search *search) {
+  search->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+void watch_lookup_dir(struct include_search *search, const char *dir) {
+  if(search->notify < 0) return;
+  inotify_add_watch(search->notify, dir[0] != '\0' ? dir : ".", IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+}
+
+// marks every lookup to be checked again if a watched directory changed, or always if all is set
+int refresh_include_search(struct include_search *search, int all) {
+  int changed = all || search->notify < 0;
+
+  char events[4096];
+  while(search->notify >= 0 && read(search->notify, events, sizeof(events)) > 0) {
+    changed = 1;
+  }
+
+  if(changed) {
+    pthread_mutex_lock(&search->lock);
+    for(int i = 0; i < search->lookup_size; i++) {
+      if(search->lookup_table[i].path != NULL) {
+        search->lookup_table[i].found = -1;
+      }
+    }
+    pthread_mutex_unlock(&search->lock);
+  }
+
+  return changed;
+}
+
+// called with the lock held; the table is never more than half full, so an empty slot ends the probe
+struct lookup_entry *search_lookup_table(struct include_search *search, const unsigned char *path) {
+  int h = path_hash(path) % search->lookup_size;
+  while(search->lookup_table[h].path != NULL && strcmp(search->lookup_table[h].path, path) != 0) {
+    h = (h + 1) % search->lookup_size;
+  }
+  return &search->lookup_table[h];
+}
+
+// called with the lock held; the entries move, but the paths which file names refer to stay
+void grow_lookup_table(struct include_search *search) {
+  struct lookup_entry *table = search->lookup_table;
+  int size = search->lookup_size;
+
+  search->lookup_size = size * 2 + 1;
+  search->lookup_table = (struct lookup_entry *) calloc(search->lookup_size, sizeof(struct lookup_entry));
+  if(search->lookup_table == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  for(int i = 0; i < size; i++) {
+    if(table[i].path != NULL) {
+      *search_lookup_table(search, table[i].path) = table[i];
+    }
+  }
+  free(table);
+}
+
+int lookup_file(struct include_search *search, struct include_file *file, const char *dir, struct string *name) {
+  struct string *path = allocate_string();
+  write_string(path, (char *) dir);
+  if(path->size > 0 && path->head[path->size - 1] != '/') {
+    append_string(path, '/');
+  }
+  concat_string(path, name);
+
+  // the entry is read under the lock, as another thread may move it when the table grows
+  pthread_mutex_lock(&search->lock);
+  struct lookup_entry *entry = search_lookup_table(search, path->head);
+  const unsigned char *cached = entry->path;
+  int found = entry->found;
+  if(cached != NULL && found >= 0) {
+    pthread_mutex_unlock(&search->lock);
+    if(!found) {
+      if(file->misses != NULL) {
+        add_dependency(file->misses, path, 0);
+      }
+      free_string(path);
+      return 0;
+    }
+    file->path = path;
+    file->name = cached;
+    file->fd = -1;
+    file->system = 0;
+    return 1;
+  }
+  pthread_mutex_unlock(&search->lock);
+
+  int fd = open(path->head, O_RDONLY);
+
+  // another thread may have recorded the path meanwhile
+  pthread_mutex_lock(&search->lock);
+  entry = search_lookup_table(search, path->head);
+  if(entry->path == NULL) {
+    entry->path = (unsigned char *) malloc(sizeof(unsigned char) * (path->size + 1));
+    if(entry->path == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    strcpy(entry->path, path->head);
+    entry->found = fd >= 0;
+    watch_lookup_dir(search, dir);
+    search->lookup_count++;
+  } else if(entry->found < 0) {
+    entry->found = fd >= 0;
+    watch_lookup_dir(search, dir);
+  }
+  cached = entry->path;
+  if(search->lookup_count * 2 > search->lookup_size) {
+    grow_lookup_table(search);
+  }
+  pthread_mutex_unlock(&search->lock);
+
+  if(fd < 0) {
+    if(file->misses != NULL) {
+      add_dependency(file->misses, path, 0);
+    }
+    free_string(path);
+    return 0;
+  }
+
+  file->path = path;
+  file->name = cached;
+  file->fd = fd;
+  file->system = 0;
+  return 1;
+}
+
+// include file search
+struct string *header_name(struct string *text) {
+  struct string *name = allocate_string();
+  for(int i = 1; i < text->size - 1; i++) {
+    append_string(name, text->head[i]);
+  }
+  return name;
+}
+
+int search_paths(struct include_search *search, struct include_file *file, const char **paths, int size, struct string *name) {
+  for(int k = 0; k < size; k++) {
+    if(lookup_file(search, file, paths[k], name)) return 1;
+  }
+  return 0;
+}
+
+int search_header_file(struct include_search *search, struct include_file *file, struct string *text) {
+  struct string *name = header_name(text);
+
+  int found = search_paths(search, file, search->paths.bracket, search->paths.bracket_size, name);
+  if(!found) {
+    found = search_paths(search, file, search->paths.system, search->paths.system_size, name)
+      || search_paths(search, file, default_include_paths, DEFAULT_INCLUDE_PATHS_SIZE, name);
+    file->system = 1;
+  }
+
+  free_string(name);
+  return found;
+}
+
+int search_named_source_file(struct include_search *search, struct include_file *file, struct string *text, const char *current_file) {
+  int last_slash = 0;
+  for(int i = 0; current_file[i]; i++) {
+    if(current_file[i] == '/') {
+      last_slash = i;
+    }
+  }
+
+  struct string *dir = allocate_string();
+  if(last_slash > 0) {
+    for(int i = 0; i < last_slash; i++) {
+      append_string(dir, current_file[i]);
+    }
+    append_string(dir, '/');
+  }
+
+  struct string *name = header_name(text);
+  int found = lookup_file(search, file, dir->head, name)
+    || search_paths(search, file, search->paths.quote, search->paths.quote_size, name);
+
+  free_string(name);
+  free_string(dir);
+
+  // reprocess as if header file was read
+  return found || search_header_file(search, file, text);
+}
@@ -0,0 +1,63 @@
+#ifndef __SEARCH_INCLUDE__
+#define __SEARCH_INCLUDE__
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+#include "string.h"
+#include "depend.h"
+
+/* prime number; the initial size, doubled whenever the table is half full */
+#define LOOKUP_TABLE_SIZE 8191
+
+#define INCLUDE_PATHS_SIZE 64
+
+enum include_path_type { PATH_QUOTE, PATH_BRACKET, PATH_SYSTEM };
+
+struct include_paths {
+  int quote_size;
+  const char *quote[INCLUDE_PATHS_SIZE];
+  int bracket_size;
+  const char *bracket[INCLUDE_PATHS_SIZE];
+  int system_size;
+  const char *system[INCLUDE_PATHS_SIZE];
+};
+
+// found is -1 when the entry has to be checked again; the path stays, as file names refer to it
+struct lookup_entry {
+  unsigned char *path;
+  int found;
+};
+
+struct include_search {
+  struct include_paths paths;
+  struct lookup_entry *lookup_table;
+  int lookup_size;
+  int lookup_count;
+  int notify;
+  pthread_mutex_t lock;
+};
+
+// the candidate paths which were not found are added to misses when it is set
+struct include_file {
+  struct string *path;
+  const unsigned char *name;
+  int fd;
+  int system;
+  struct dependencies *misses;
+};
+
+extern struct include_search *allocate_include_search();
+extern void free_include_search(struct include_search *search);
+extern void add_include_path(struct include_search *search, enum include_path_type type, const char *dir);
+extern void clear_include_paths(struct include_search *search);
+extern void write_include_paths(struct include_search *search, struct string *text);
+extern void watch_include_search(struct include_search *search);
+extern int refresh_include_search(struct include_search *search, int all);
+extern int lookup_file(struct include_search *search, struct include_file *file, const char *dir, struct string *name);
+extern int search_header_file(struct include_search *search, struct include_file *file, struct string *text);
+extern int search_named_source_file(struct include_search *search, struct include_file *file, struct string *text, const char *current_file);
+
+#endif
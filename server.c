@@ -0,0 +1,337 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "main.h"
+
+/*
+ * Local preprocessing server. The server keeps one context, so the source
+ * cache, the directive indices and the include lookups stay warm from one
+ * request to the next; the source cache checks the modification time of
+ * every file it hands out, and the lookups are checked again when inotify
+ * reports a change in a directory they looked into.
+ *
+ * A client sends its working directory and command line together with its
+ * standard output and error, and the server runs the command with those
+ * descriptors in place and sends back the exit status. Requests are served
+ * one at a time; an error ends the request, not the server.
+ */
+
+int read_fully(int fd, void *buffer, long size) {
+  unsigned char *p = (unsigned char *) buffer;
+  while(size > 0) {
+    ssize_t n = read(fd, p, size);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return 0;
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+int write_fully(int fd, const void *buffer, long size) {
+  const unsigned char *p = (const unsigned char *) buffer;
+  while(size > 0) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return 0;
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+void socket_address(struct sockaddr_un *addr, const char *socket_path) {
+  if(strlen(socket_path) >= sizeof(addr->sun_path)) {
+    error("socket path is too long: %s\n", socket_path);
+  }
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, socket_path);
+}
+
+// the header comes with the two descriptors of the client
+int receive_request(int conn, struct server_request *request, int fds[2]) {
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int) * 2)];
+  } control;
+  struct iovec iov = { request, sizeof(struct server_request) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  if(recvmsg(conn, &msg, 0) != sizeof(struct server_request)) return 0;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return 0;
+  if(cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2)) return 0;
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 2);
+  return 1;
+}
+
+int serve_command(struct server *server, char *cwd, int argc, char **argv) {
+  jmp_buf jump;
+  int status;
+
+  error_jump = &jump;
+  if(setjmp(jump) == 0) {
+    if(chdir(cwd) < 0) {
+      error("failed to change directory: %s\n", cwd);
+    }
+
+    // relative lookups hold only in the directory they were made in
+    int moved = server->cwd == NULL || strcmp(server->cwd, cwd) != 0;
+    refresh_include_search(server->ctx->search, moved);
+    free(server->cwd);
+    server->cwd = strdup(cwd);
+
+    status = run_command(server->ctx, argc, argv);
+  } else {
+    status = 1;
+  }
+  error_jump = NULL;
+
+  // the options of the request refer to its payload, and the pools and caches it started are its own
+  if(fchdir(server->home) < 0) {
+    perror("fchdir");
+    exit(1);
+  }
+  clear_include_paths(server->ctx->search);
+  reset_dependency_options(&server->ctx->dependencies->options);
+  clear_macro_definitions(server->ctx);
+  if(server->ctx->speculator != NULL) {
+    free_speculator(server->ctx->speculator);
+    server->ctx->speculator = NULL;
+  }
+  if(server->ctx->prefetch != NULL) {
+    free_prefetcher(server->ctx->prefetch);
+    server->ctx->prefetch = NULL;
+  }
+  if(server->ctx->sources->tokens != NULL) {
+    free_token_cache(server->ctx->sources->tokens);
+    server->ctx->sources->tokens = NULL;
+  }
+  set_source_cache_limit(server->ctx->sources, SOURCE_CACHE_LIMIT);
+
+  return status;
+}
+
+// returns 0 if the request stops the server
+int serve_connection(struct server *server, int conn) {
+  struct server_request request;
+  int fds[2];
+  if(!receive_request(conn, &request, fds)) return 1;
+
+  int running = 1;
+  int32_t status = 1;
+  char *payload = NULL;
+  char **argv = NULL;
+
+  if(request.size > 0 && request.size <= SERVER_REQUEST_LIMIT) {
+    payload = (char *) malloc(request.size);
+    if(payload == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+  }
+
+  // the payload is the working directory and the arguments, each terminated by a null character
+  if(payload != NULL && read_fully(conn, payload, request.size) && payload[request.size - 1] == '\0') {
+    int argc = 0;
+    for(uint32_t i = 0; i < request.size; i++) {
+      if(payload[i] == '\0') argc++;
+    }
+
+    argv = (char **) malloc(sizeof(char *) * (argc + 1));
+    if(argv == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    char *cwd = payload;
+    argv[0] = "skcc";
+    for(int i = 1, offset = strlen(cwd) + 1; i < argc; i++) {
+      argv[i] = &payload[offset];
+      offset += strlen(argv[i]) + 1;
+    }
+    argv[argc] = NULL;
+
+    if(argc == 2 && strcmp(argv[1], SERVER_STOP) == 0) {
+      // the path is free for another server once the client hears back
+      unlink(server->path);
+      running = 0;
+      status = 0;
+    } else {
+      fflush(stdout);
+      fflush(stderr);
+      int saved_out = dup(1);
+      int saved_err = dup(2);
+      dup2(fds[0], 1);
+      dup2(fds[1], 2);
+
+      status = serve_command(server, cwd, argc, argv);
+
+      fflush(stdout);
+      fflush(stderr);
+      dup2(saved_out, 1);
+      dup2(saved_err, 2);
+      close(saved_out);
+      close(saved_err);
+    }
+  }
+
+  close(fds[0]);
+  close(fds[1]);
+  write_fully(conn, &status, sizeof(status));
+
+  free(argv);
+  free(payload);
+  return running;
+}
+
+int run_server(struct skcc_context *ctx, const char *socket_path) {
+  // the socket is renamed into place once it listens, so that a client never finds it refusing connections
+  char *temp = (char *) malloc(strlen(socket_path) + 16);
+  if(temp == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  sprintf(temp, "%s.%d", socket_path, (int) getpid());
+
+  struct sockaddr_un addr;
+  socket_address(&addr, temp);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0) {
+    perror("socket");
+    exit(1);
+  }
+  unlink(temp);
+  if(bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror("bind");
+    exit(1);
+  }
+  if(listen(sock, SERVER_BACKLOG) < 0) {
+    perror("listen");
+    exit(1);
+  }
+  if(rename(temp, socket_path) < 0) {
+    perror("rename");
+    exit(1);
+  }
+  free(temp);
+
+  // a client which went away must not take the server down
+  signal(SIGPIPE, SIG_IGN);
+  watch_include_search(ctx->search);
+
+  struct server server;
+  server.ctx = ctx;
+  server.path = socket_path;
+  server.socket = sock;
+  server.home = open(".", O_RDONLY | O_DIRECTORY);
+  server.cwd = NULL;
+  if(server.home < 0) {
+    perror("open");
+    exit(1);
+  }
+
+  int running = 1;
+  while(running) {
+    int conn = accept(sock, NULL, NULL);
+    if(conn < 0) {
+      if(errno == EINTR) continue;
+      perror("accept");
+      exit(1);
+    }
+    running = serve_connection(&server, conn);
+    close(conn);
+  }
+
+  close(sock);
+  close(server.home);
+  free(server.cwd);
+  return 0;
+}
+
+// the client sends the command line and waits for the exit status; the output goes straight to its descriptors
+int run_client(const char *socket_path, int argc, char **argv) {
+  struct sockaddr_un addr;
+  socket_address(&addr, socket_path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0) {
+    perror("socket");
+    exit(1);
+  }
+  if(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    error("failed to connect to the server: %s\n", socket_path);
+  }
+
+  char *cwd = getcwd(NULL, 0);
+  if(cwd == NULL) {
+    perror("getcwd");
+    exit(1);
+  }
+
+  long size = strlen(cwd) + 1;
+  for(int i = 0; i < argc; i++) {
+    size += strlen(argv[i]) + 1;
+  }
+  if(size > SERVER_REQUEST_LIMIT) {
+    error("command line is too long.\n");
+  }
+
+  char *payload = (char *) malloc(size);
+  if(payload == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  long offset = 0;
+  strcpy(payload, cwd);
+  offset += strlen(cwd) + 1;
+  for(int i = 0; i < argc; i++) {
+    strcpy(&payload[offset], argv[i]);
+    offset += strlen(argv[i]) + 1;
+  }
+
+  struct server_request request;
+  request.size = size;
+  int fds[2] = { 1, 2 };
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int) * 2)];
+  } control;
+  struct iovec iov = { &request, sizeof(request) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * 2);
+
+  if(sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(request) || !write_fully(sock, payload, size)) {
+    error("failed to send the request: %s\n", socket_path);
+  }
+
+  int32_t status;
+  if(!read_fully(sock, &status, sizeof(status))) {
+    error("the server closed the connection.\n");
+  }
+
+  close(sock);
+  free(payload);
+  free(cwd);
+  return status;
+}
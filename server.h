@@ -0,0 +1,33 @@
+#ifndef __SERVER_INCLUDE__
+#define __SERVER_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "error.h"
+#include "preprocess.h"
+
+#define SERVER_BACKLOG 16
+#define SERVER_REQUEST_LIMIT (1 << 20)
+
+// a request with this command line stops the server
+#define SERVER_STOP "--stop-server"
+
+// a request is this header, carrying the standard output and error of the client, and then the payload
+struct server_request {
+  uint32_t size;
+};
+
+struct server {
+  struct skcc_context *ctx;
+  const char *path;
+  int socket;
+  int home;
+  char *cwd;
+};
+
+extern int run_server(struct skcc_context *ctx, const char *socket_path);
+extern int run_client(const char *socket_path, int argc, char **argv);
+
+#endif
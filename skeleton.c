@@ -0,0 +1,211 @@
+#include "skeleton.h"
+
+struct skeleton_scanner {
+  const unsigned char *text;
+  int size;
+  int pos;
+};
+
+int skeleton_space(unsigned char c) {
+  return c == ' ' || c == '\t' || c == '\v' || c == '\f';
+}
+
+int skeleton_ident(unsigned char c) {
+  if('A' <= c && c <= 'Z') return 1;
+  if('a' <= c && c <= 'z') return 1;
+  if('0' <= c && c <= '9') return 1;
+  return c == '_';
+}
+
+int check_comment(struct skeleton_scanner *scanner, unsigned char c) {
+  return scanner->pos + 1 < scanner->size && scanner->text[scanner->pos] == '/' && scanner->text[scanner->pos + 1] == c;
+}
+
+// comments are removed before tokenization, the same way as remove_comment() does
+void skip_block_comment(struct skeleton_scanner *scanner) {
+  scanner->pos += 3;
+  while(scanner->pos < scanner->size) {
+    if(scanner->text[scanner->pos - 1] == '*' && scanner->text[scanner->pos] == '/') {
+      break;
+    }
+    scanner->pos++;
+  }
+  scanner->pos++;
+}
+
+void skip_line_comment(struct skeleton_scanner *scanner) {
+  while(scanner->pos < scanner->size && scanner->text[scanner->pos] != '\n') {
+    scanner->pos++;
+  }
+}
+
+void skip_directive_space(struct skeleton_scanner *scanner) {
+  while(scanner->pos < scanner->size) {
+    if(skeleton_space(scanner->text[scanner->pos])) {
+      scanner->pos++;
+    } else if(check_comment(scanner, '*')) {
+      skip_block_comment(scanner);
+    } else {
+      break;
+    }
+  }
+}
+
+enum directive_type directive_keyword(const unsigned char *text, int size) {
+  char keyword[8];
+  if(size >= 8) return DIR_OTHER;
+  for(int i = 0; i < size; i++) keyword[i] = text[i];
+  keyword[size] = '\0';
+
+  if(strcmp(keyword, "if") == 0) return DIR_IF;
+  if(strcmp(keyword, "ifdef") == 0) return DIR_IFDEF;
+  if(strcmp(keyword, "ifndef") == 0) return DIR_IFNDEF;
+  if(strcmp(keyword, "elif") == 0) return DIR_ELIF;
+  if(strcmp(keyword, "else") == 0) return DIR_ELSE;
+  if(strcmp(keyword, "endif") == 0) return DIR_ENDIF;
+  if(strcmp(keyword, "include") == 0) return DIR_INCLUDE;
+  if(strcmp(keyword, "define") == 0) return DIR_DEFINE;
+  if(strcmp(keyword, "undef") == 0) return DIR_UNDEF;
+  return DIR_OTHER;
+}
+
+void scan_directive(struct skeleton_scanner *scanner, struct directive *directive) {
+  directive->offset = scanner->pos++;
+  skip_directive_space(scanner);
+
+  int keyword = scanner->pos;
+  while(scanner->pos < scanner->size && skeleton_ident(scanner->text[scanner->pos])) {
+    scanner->pos++;
+  }
+  directive->type = directive_keyword(&scanner->text[keyword], scanner->pos - keyword);
+
+  skip_directive_space(scanner);
+  directive->operand = scanner->pos;
+
+  while(scanner->pos < scanner->size && scanner->text[scanner->pos] != '\n') {
+    if(check_comment(scanner, '/')) {
+      break;
+    } else if(check_comment(scanner, '*')) {
+      skip_block_comment(scanner);
+    } else {
+      scanner->pos++;
+    }
+  }
+  directive->end = scanner->pos;
+  directive->next = -1;
+}
+
+struct skeleton *build_skeleton(const unsigned char *text, int size) {
+  struct skeleton *skeleton = (struct skeleton *) malloc(sizeof(struct skeleton));
+  if(skeleton == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  int alloc_size = 16;
+  skeleton->directives = (struct directive *) malloc(sizeof(struct directive) * alloc_size);
+  skeleton->size = 0;
+
+  int stack_alloc_size = 16;
+  int stack_size = 0;
+  int *stack = (int *) malloc(sizeof(int) * stack_alloc_size);
+
+  if(skeleton->directives == NULL || stack == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  struct skeleton_scanner scanner = { text, size, 0 };
+  int line_start = 1;
+
+  while(scanner.pos < size) {
+    unsigned char c = text[scanner.pos];
+
+    if(check_comment(&scanner, '/')) {
+      skip_line_comment(&scanner);
+    } else if(check_comment(&scanner, '*')) {
+      skip_block_comment(&scanner);
+    } else if(c == '\n') {
+      line_start = 1;
+      scanner.pos++;
+    } else if(skeleton_space(c)) {
+      scanner.pos++;
+    } else if(line_start && c == '#' && !(scanner.pos + 1 < size && text[scanner.pos + 1] == '#')) {
+      if(skeleton->size == alloc_size) {
+        alloc_size *= 2;
+        skeleton->directives = (struct directive *) realloc(skeleton->directives, sizeof(struct directive) * alloc_size);
+        if(skeleton->directives == NULL) {
+          perror("realloc");
+          exit(1);
+        }
+      }
+      if(stack_size == stack_alloc_size) {
+        stack_alloc_size *= 2;
+        stack = (int *) realloc(stack, sizeof(int) * stack_alloc_size);
+        if(stack == NULL) {
+          perror("realloc");
+          exit(1);
+        }
+      }
+
+      int index = skeleton->size++;
+      struct directive *directive = &skeleton->directives[index];
+      scan_directive(&scanner, directive);
+
+      // link each conditional directive to its following #elif, #else or #endif
+      if(directive->type == DIR_IF || directive->type == DIR_IFDEF || directive->type == DIR_IFNDEF) {
+        directive->depth = stack_size;
+        stack[stack_size++] = index;
+      } else if(directive->type == DIR_ELIF || directive->type == DIR_ELSE) {
+        if(stack_size > 0) {
+          skeleton->directives[stack[stack_size - 1]].next = index;
+          stack[stack_size - 1] = index;
+        }
+        directive->depth = stack_size > 0 ? stack_size - 1 : 0;
+      } else if(directive->type == DIR_ENDIF) {
+        if(stack_size > 0) {
+          skeleton->directives[stack[--stack_size]].next = index;
+        }
+        directive->depth = stack_size;
+      } else {
+        directive->depth = stack_size;
+      }
+
+      line_start = 0;
+    } else {
+      line_start = 0;
+      scanner.pos++;
+    }
+  }
+
+  free(stack);
+
+  return skeleton;
+}
+
+void free_skeleton(struct skeleton *skeleton) {
+  free(skeleton->directives);
+  free(skeleton);
+}
+
+int next_directive(struct skeleton *skeleton, int offset) {
+  int left = 0;
+  int right = skeleton->size;
+  while(left < right) {
+    int mid = (left + right) / 2;
+    if(skeleton->directives[mid].offset < offset) {
+      left = mid + 1;
+    } else {
+      right = mid;
+    }
+  }
+  return left;
+}
+
+int search_directive(struct skeleton *skeleton, int offset) {
+  int index = next_directive(skeleton, offset);
+  if(index < skeleton->size && skeleton->directives[index].offset == offset) {
+    return index;
+  }
+  return -1;
+}
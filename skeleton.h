@@ -0,0 +1,33 @@
+#ifndef __SKELETON_INCLUDE__
+#define __SKELETON_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "error.h"
+
+enum directive_type {
+  DIR_IF, DIR_IFDEF, DIR_IFNDEF, DIR_ELIF, DIR_ELSE, DIR_ENDIF,
+  DIR_INCLUDE, DIR_DEFINE, DIR_UNDEF, DIR_OTHER
+};
+
+struct directive {
+  enum directive_type type;
+  int offset;
+  int operand;
+  int end;
+  int depth;
+  int next;
+};
+
+struct skeleton {
+  struct directive *directives;
+  int size;
+};
+
+extern struct skeleton *build_skeleton(const unsigned char *text, int size);
+extern void free_skeleton(struct skeleton *skeleton);
+extern int next_directive(struct skeleton *skeleton, int offset);
+extern int search_directive(struct skeleton *skeleton, int offset);
+
+#endif
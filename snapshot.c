@@ -0,0 +1,469 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "speculate.h"
+#include "hdrcache.h"
+
+/*
+ * Macro snapshots of prefix headers. A run with --write-snapshot
+ * preprocesses the prefix header and saves the macros it leaves defined,
+ * the files it included and its output. A run with -include-snapshot maps
+ * the file once, builds the macros and their replacement lists in a few
+ * arrays pointing into the mapping, and every translation unit of the run
+ * starts from a copy of those macros as if it began with #include of the
+ * prefix header.
+ *
+ * The snapshot keeps the size and modification time of every included
+ * file, and the include paths and -D/-U options it was written with; if
+ * any of them changed, the prefix header is preprocessed instead. The
+ * other options must be the same as when it was written.
+ */
+
+struct snapshot_buffer {
+  unsigned char *data;
+  long size;
+  long alloc_size;
+};
+
+struct snapshot_writer {
+  struct snapshot_buffer includes;
+  struct snapshot_buffer macros;
+  struct snapshot_buffer parameters;
+  struct snapshot_buffer tokens;
+  struct snapshot_buffer output;
+  struct snapshot_buffer strings;
+  const unsigned char *last_file;
+  uint32_t last_file_offset;
+};
+
+long append_snapshot_buffer(struct snapshot_buffer *buffer, const void *data, long size) {
+  while(buffer->size + size > buffer->alloc_size) {
+    buffer->alloc_size = buffer->alloc_size == 0 ? 4096 : buffer->alloc_size * 2;
+    buffer->data = (unsigned char *) realloc(buffer->data, buffer->alloc_size);
+    if(buffer->data == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  long offset = buffer->size;
+  memcpy(&buffer->data[offset], data, size);
+  buffer->size += size;
+  return offset;
+}
+
+uint32_t add_snapshot_string(struct snapshot_writer *writer, const unsigned char *text, int size) {
+  uint32_t offset = append_snapshot_buffer(&writer->strings, text, size);
+  append_snapshot_buffer(&writer->strings, "", 1);
+  return offset;
+}
+
+void add_snapshot_token(struct snapshot_writer *writer, struct snapshot_buffer *buffer, struct pp_token *token) {
+  struct snapshot_token record;
+  record.type = token->type;
+  record.flags = token->persistent ? SNAPSHOT_TOKEN_MACRO : 0;
+  record.reserved = 0;
+  record.text = add_snapshot_string(writer, (const unsigned char *) token->text->head, token->text->size);
+  record.size = token->text->size;
+  record.offset = token->offset;
+
+  // the tokens of a file come in a row, so only the last file name is shared
+  if(token->file == NULL) {
+    record.file = SNAPSHOT_NO_FILE;
+  } else {
+    if(token->file != writer->last_file) {
+      writer->last_file = token->file;
+      writer->last_file_offset = add_snapshot_string(writer, token->file, strlen((const char *) token->file));
+    }
+    record.file = writer->last_file_offset;
+  }
+  append_snapshot_buffer(buffer, &record, sizeof(record));
+}
+
+void add_snapshot_include(struct snapshot_writer *writer, const char *path, int system) {
+  struct stat st;
+  if(stat(path, &st) < 0) {
+    error("failed to stat included file: %s\n", path);
+  }
+
+  struct snapshot_include include;
+  include.path = add_snapshot_string(writer, (const unsigned char *) path, strlen(path));
+  include.system = system;
+  include.size = st.st_size;
+  include.mtime_sec = st.st_mtim.tv_sec;
+  include.mtime_nsec = st.st_mtim.tv_nsec;
+  append_snapshot_buffer(&writer->includes, &include, sizeof(include));
+}
+
+void add_snapshot_macro(struct snapshot_writer *writer, struct macro_entry *macro) {
+  struct snapshot_macro record;
+  record.type = macro->type;
+  record.ellipsis = macro->parameter_ellipsis;
+  record.parameter_size = macro->parameter_size;
+  record.identifier = add_snapshot_string(writer, macro->identifier, strlen((const char *) macro->identifier));
+  record.parameter = writer->parameters.size / sizeof(uint32_t);
+  record.token = writer->tokens.size / sizeof(struct snapshot_token);
+  record.token_count = 0;
+
+  int parameter_size = macro->parameter_size + macro->parameter_ellipsis;
+  for(int i = 0; i < parameter_size; i++) {
+    uint32_t parameter = add_snapshot_string(writer, macro->parameters[i], strlen((const char *) macro->parameters[i]));
+    append_snapshot_buffer(&writer->parameters, &parameter, sizeof(parameter));
+  }
+  for(struct pp_node *node = macro->replacement_list->head; node != NULL; node = node->next) {
+    add_snapshot_token(writer, &writer->tokens, node->token);
+    record.token_count++;
+  }
+  append_snapshot_buffer(&writer->macros, &record, sizeof(record));
+}
+
+void save_macro_snapshot(struct skcc_context *ctx, const char *file, struct pp_list *output, const char *path) {
+  struct snapshot_writer writer;
+  memset(&writer, 0, sizeof(writer));
+
+  add_snapshot_include(&writer, file, 0);
+  for(int i = 0; i < ctx->dependencies->size; i++) {
+    add_snapshot_include(&writer, ctx->dependencies->paths[i]->head, ctx->dependencies->system[i]);
+  }
+  // the compiled-in macros are in the base of the table, so they are left out
+  for(int i = 0; i < MACRO_TABLE_SIZE; i++) {
+    struct macro_entry *macro = slot_macro_table(ctx->macros, i);
+    if(macro != NULL) {
+      add_snapshot_macro(&writer, macro);
+    }
+  }
+  for(struct pp_node *node = output->head; node != NULL; node = node->next) {
+    add_snapshot_token(&writer, &writer.output, node->token);
+  }
+  struct string *search = allocate_string();
+  write_include_paths(ctx->search, search);
+  uint32_t search_offset = add_snapshot_string(&writer, search->head, search->size);
+  free_string(search);
+  const char *definitions = ctx->definitions != NULL ? (const char *) ctx->definitions->head : "";
+  uint32_t definitions_offset = add_snapshot_string(&writer, (const unsigned char *) definitions, strlen(definitions));
+
+  struct snapshot_header header;
+  memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+  header.version = SNAPSHOT_VERSION;
+  header.include_count = writer.includes.size / sizeof(struct snapshot_include);
+  header.macro_count = writer.macros.size / sizeof(struct snapshot_macro);
+  header.parameter_count = writer.parameters.size / sizeof(uint32_t);
+  header.token_count = (writer.tokens.size + writer.output.size) / sizeof(struct snapshot_token);
+  header.output_count = writer.output.size / sizeof(struct snapshot_token);
+  header.string_size = writer.strings.size;
+  header.size = sizeof(header) + writer.includes.size + writer.macros.size + writer.parameters.size + writer.tokens.size + writer.output.size + writer.strings.size;
+  header.search = search_offset;
+  header.definitions = definitions_offset;
+  header.reserved = 0;
+
+  FILE *fp = fopen(path, "wb");
+  if(fp == NULL) {
+    error("failed to open snapshot file: %s\n", path);
+  }
+  struct snapshot_buffer *sections[] = { &writer.includes, &writer.macros, &writer.parameters, &writer.tokens, &writer.output, &writer.strings };
+  int written = fwrite(&header, sizeof(header), 1, fp) == 1;
+  for(int i = 0; i < 6; i++) {
+    if(sections[i]->size > 0 && fwrite(sections[i]->data, sections[i]->size, 1, fp) != 1) {
+      written = 0;
+    }
+  }
+  if(fclose(fp) != 0) {
+    written = 0;
+  }
+  for(int i = 0; i < 6; i++) {
+    free(sections[i]->data);
+  }
+  if(!written) {
+    error("failed to write snapshot file: %s\n", path);
+  }
+}
+
+// preprocess the prefix header file and save the state it leaves to path; returns 0 on success and 1 on error
+int write_macro_snapshot(struct skcc_context *ctx, const char *file, const char *path) {
+  jmp_buf jump;
+  jmp_buf *saved_jump = error_jump;
+  int status = 0;
+
+  // every included file is recorded whatever the dependency options are
+  struct dependency_options options = ctx->dependencies->options;
+  ctx->dependencies->options.enabled = 1;
+  ctx->dependencies->options.system = 1;
+
+  struct pp_list *output = allocate_pp_list();
+  struct pp_sink *sink = allocate_marked_list_sink(output);
+
+  error_jump = &jump;
+  if(setjmp(jump) == 0) {
+    predefine_macros(ctx);
+    parse_preprocessing_file(ctx, (unsigned char *) file, sink);
+    save_macro_snapshot(ctx, file, output, path);
+  } else {
+    abort_header_recordings(ctx);
+    while(ctx->include_depth > 0) {
+      free_pp_token_lexer(ctx->includes[--ctx->include_depth]);
+    }
+    status = 1;
+  }
+  error_jump = saved_jump;
+
+  if(ctx->speculator != NULL) {
+    cancel_speculations(ctx);
+  }
+  clear_macro_table(ctx->macros);
+  clear_dependencies(ctx->dependencies);
+  ctx->dependencies->options = options;
+
+  release_written_pp_tokens(output, 0);
+  free_pp_list(output);
+  free_pp_sink(sink);
+  return status;
+}
+
+int check_snapshot_string(const struct snapshot_header *header, uint32_t offset) {
+  return offset < header->string_size;
+}
+
+// everything the loader follows is checked, so a broken file is an error rather than a crash
+int check_macro_snapshot(const void *data, long size) {
+  if(size < (long) sizeof(struct snapshot_header)) return 0;
+
+  const struct snapshot_header *header = (const struct snapshot_header *) data;
+  if(memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0 || header->version != SNAPSHOT_VERSION) return 0;
+  if(header->size != size || header->output_count > header->token_count) return 0;
+  long expected = sizeof(struct snapshot_header)
+    + (long) header->include_count * sizeof(struct snapshot_include)
+    + (long) header->macro_count * sizeof(struct snapshot_macro)
+    + (long) header->parameter_count * sizeof(uint32_t)
+    + (long) header->token_count * sizeof(struct snapshot_token)
+    + header->string_size;
+  if(expected != size || header->include_count == 0 || header->string_size == 0) return 0;
+
+  const struct snapshot_include *includes = (const struct snapshot_include *) &header[1];
+  const struct snapshot_macro *macros = (const struct snapshot_macro *) &includes[header->include_count];
+  const uint32_t *parameters = (const uint32_t *) &macros[header->macro_count];
+  const struct snapshot_token *tokens = (const struct snapshot_token *) &parameters[header->parameter_count];
+  const char *strings = (const char *) &tokens[header->token_count];
+  if(strings[header->string_size - 1] != '\0') return 0;
+  if(!check_snapshot_string(header, header->search) || !check_snapshot_string(header, header->definitions)) return 0;
+
+  for(uint32_t i = 0; i < header->include_count; i++) {
+    if(!check_snapshot_string(header, includes[i].path)) return 0;
+  }
+  uint32_t replacement_count = header->token_count - header->output_count;
+  for(uint32_t i = 0; i < header->macro_count; i++) {
+    const struct snapshot_macro *macro = &macros[i];
+    if(macro->type > MACRO_FUNCTION || macro->ellipsis > 1 || macro->parameter_size > MACRO_PARAMS_LIMIT) return 0;
+    if(!check_snapshot_string(header, macro->identifier)) return 0;
+    if((uint64_t) macro->parameter + macro->parameter_size + macro->ellipsis > header->parameter_count) return 0;
+    if((uint64_t) macro->token + macro->token_count > replacement_count) return 0;
+  }
+  for(uint32_t i = 0; i < header->parameter_count; i++) {
+    if(!check_snapshot_string(header, parameters[i])) return 0;
+  }
+  for(uint32_t i = 0; i < header->token_count; i++) {
+    const struct snapshot_token *token = &tokens[i];
+    if(token->type > PP_PLACE_MARKER) return 0;
+    if((uint64_t) token->text + token->size >= header->string_size || strings[token->text + token->size] != '\0') return 0;
+    if(token->file != SNAPSHOT_NO_FILE && !check_snapshot_string(header, token->file)) return 0;
+  }
+  return 1;
+}
+
+// a header found through other include paths may be another file, and other -D/-U options may take other branches
+int check_snapshot_includes(struct skcc_context *ctx, struct macro_snapshot *snapshot) {
+  struct string *search = allocate_string();
+  write_include_paths(ctx->search, search);
+  int same = strcmp((char *) search->head, &snapshot->strings[snapshot->header->search]) == 0;
+  free_string(search);
+  if(!same) return 0;
+
+  const char *definitions = ctx->definitions != NULL ? (const char *) ctx->definitions->head : "";
+  if(strcmp(definitions, &snapshot->strings[snapshot->header->definitions]) != 0) return 0;
+
+  for(uint32_t i = 0; i < snapshot->header->include_count; i++) {
+    const struct snapshot_include *include = &snapshot->includes[i];
+    struct stat st;
+    if(stat(&snapshot->strings[include->path], &st) < 0) return 0;
+    if(st.st_size != include->size) return 0;
+    if(st.st_mtim.tv_sec != include->mtime_sec || st.st_mtim.tv_nsec != include->mtime_nsec) return 0;
+  }
+  return 1;
+}
+
+void *allocate_snapshot_array(long size) {
+  void *array = malloc(size > 0 ? size : 1);
+  if(array == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  return array;
+}
+
+// the tokens, lists and macros are built in a few arrays; their texts stay in the mapping
+void build_macro_snapshot(struct skcc_context *ctx, struct macro_snapshot *snapshot) {
+  const struct snapshot_header *header = snapshot->header;
+  const struct snapshot_macro *records = (const struct snapshot_macro *) &snapshot->includes[header->include_count];
+  const uint32_t *parameters = (const uint32_t *) &records[header->macro_count];
+  const struct snapshot_token *tokens = (const struct snapshot_token *) &parameters[header->parameter_count];
+  uint32_t replacement_count = header->token_count - header->output_count;
+
+  snapshot->tokens = (struct pp_token *) allocate_snapshot_array(sizeof(struct pp_token) * header->token_count);
+  snapshot->texts = (struct string *) allocate_snapshot_array(sizeof(struct string) * header->token_count);
+  snapshot->nodes = (struct pp_node *) allocate_snapshot_array(sizeof(struct pp_node) * replacement_count);
+  snapshot->lists = (struct pp_list *) allocate_snapshot_array(sizeof(struct pp_list) * header->macro_count);
+  snapshot->macros = (struct macro_entry *) allocate_snapshot_array(sizeof(struct macro_entry) * header->macro_count);
+  snapshot->macros_size = header->macro_count;
+  snapshot->output = &snapshot->tokens[replacement_count];
+  snapshot->output_size = header->output_count;
+  snapshot->empty.head = NULL;
+  snapshot->empty.tail = &snapshot->empty.head;
+
+  for(uint32_t i = 0; i < header->token_count; i++) {
+    struct string *text = &snapshot->texts[i];
+    text->head = (unsigned char *) &snapshot->strings[tokens[i].text];
+    text->size = tokens[i].size;
+    text->alloc_size = tokens[i].size;
+
+    struct pp_token *token = &snapshot->tokens[i];
+    token->type = tokens[i].type;
+    token->name = pp_token_name[token->type];
+    token->text = text;
+    token->concat = 0;
+    token->file = tokens[i].file == SNAPSHOT_NO_FILE ? NULL : (const unsigned char *) &snapshot->strings[tokens[i].file];
+    token->offset = tokens[i].offset;
+    token->atom = token->type == PP_IDENT ? intern_string(ctx->atoms, text->head, text->size) : NULL;
+    token->persistent = (tokens[i].flags & SNAPSHOT_TOKEN_MACRO) != 0;
+    token->released = 0;
+  }
+
+  for(uint32_t i = 0; i < header->macro_count; i++) {
+    const struct snapshot_macro *record = &records[i];
+    struct pp_list *list = &snapshot->lists[i];
+    list->head = NULL;
+    list->tail = &list->head;
+    for(uint32_t j = 0; j < record->token_count; j++) {
+      struct pp_node *node = &snapshot->nodes[record->token + j];
+      node->token = &snapshot->tokens[record->token + j];
+      node->next = NULL;
+      node->skip = 0;
+      *(list->tail) = node;
+      list->tail = &node->next;
+    }
+
+    struct macro_entry *macro = &snapshot->macros[i];
+    const char *identifier = &snapshot->strings[record->identifier];
+    macro->type = record->type;
+    macro->identifier = intern_string(ctx->atoms, (const unsigned char *) identifier, strlen(identifier));
+    macro->parameter_size = record->parameter_size;
+    macro->parameter_ellipsis = record->ellipsis;
+    for(int j = 0; j < record->parameter_size + record->ellipsis; j++) {
+      const char *parameter = &snapshot->strings[parameters[record->parameter + j]];
+      macro->parameters[j] = intern_string(ctx->atoms, (const unsigned char *) parameter, strlen(parameter));
+    }
+    macro->replacement_list = list;
+    macro->tokens = &snapshot->empty;
+    macro->expanded = 0;
+    macro->borrowed = 1;
+  }
+}
+
+struct macro_snapshot *load_macro_snapshot(struct skcc_context *ctx, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    error("failed to open snapshot file: %s\n", path);
+  }
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    error("invalid snapshot file: %s\n", path);
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) {
+    error("failed to map snapshot file: %s\n", path);
+  }
+  if(!check_macro_snapshot(data, st.st_size)) {
+    munmap(data, st.st_size);
+    error("invalid snapshot file: %s\n", path);
+  }
+
+  struct macro_snapshot *snapshot = (struct macro_snapshot *) calloc(1, sizeof(struct macro_snapshot));
+  if(snapshot == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  snapshot->header = (const struct snapshot_header *) data;
+  snapshot->includes = (const struct snapshot_include *) &snapshot->header[1];
+  snapshot->strings = (const char *) data + st.st_size - snapshot->header->string_size;
+  snapshot->prefix = &snapshot->strings[snapshot->includes[0].path];
+  snapshot->data = data;
+  snapshot->size = st.st_size;
+
+  snapshot->stale = !check_snapshot_includes(ctx, snapshot);
+  if(!snapshot->stale) {
+    build_macro_snapshot(ctx, snapshot);
+  }
+  return snapshot;
+}
+
+void free_macro_snapshot(struct macro_snapshot *snapshot) {
+  free(snapshot->tokens);
+  free(snapshot->texts);
+  free(snapshot->nodes);
+  free(snapshot->lists);
+  free(snapshot->macros);
+  munmap(snapshot->data, snapshot->size);
+  free(snapshot);
+}
+
+// the run continues as if it began with #include of the prefix header
+void include_snapshot(struct skcc_context *ctx, struct macro_snapshot *snapshot, struct pp_sink *sink) {
+  if(snapshot->stale) {
+    struct string *path = allocate_string();
+    write_string(path, (char *) snapshot->prefix);
+    if(ctx->dependencies->options.enabled) {
+      add_dependency(ctx->dependencies, path, 0);
+    }
+    if(ctx->inputs != NULL) {
+      add_dependency(ctx->inputs, path, 0);
+    }
+    free_string(path);
+    parse_preprocessing_file(ctx, (unsigned char *) snapshot->prefix, sink);
+    return;
+  }
+
+  for(uint32_t i = 0; i < snapshot->header->include_count; i++) {
+    struct string *path = allocate_string();
+    write_string(path, (char *) &snapshot->strings[snapshot->includes[i].path]);
+    if(ctx->dependencies->options.enabled) {
+      add_dependency(ctx->dependencies, path, snapshot->includes[i].system);
+    }
+    if(ctx->inputs != NULL) {
+      add_dependency(ctx->inputs, path, snapshot->includes[i].system);
+    }
+    free_string(path);
+  }
+
+  // one copy of the macros per run, as expansions mark them
+  struct macro_entry *macros = (struct macro_entry *) allocate_snapshot_array(sizeof(struct macro_entry) * snapshot->macros_size);
+  memcpy(macros, snapshot->macros, sizeof(struct macro_entry) * snapshot->macros_size);
+  ctx->snapshot_macros = macros;
+  for(int i = 0; i < snapshot->macros_size; i++) {
+    install_macro_table(ctx->macros, &macros[i]);
+  }
+
+  // -M writes no text lines
+  if(ctx->dependencies->options.only) return;
+
+  // a retaining sink keeps the tokens, except the marked ones which it copies
+  struct pp_list *output = allocate_pp_list();
+  for(int i = 0; i < snapshot->output_size; i++) {
+    struct pp_token *token = copy_pp_token(&snapshot->output[i]);
+    token->persistent = snapshot->output[i].persistent;
+    append_pp_list(output, token);
+  }
+  sink->write(sink, output);
+  release_written_pp_tokens(output, sink->retain);
+  free_pp_list(output);
+}
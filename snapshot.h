@@ -0,0 +1,96 @@
+#ifndef __SNAPSHOT_INCLUDE__
+#define __SNAPSHOT_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "error.h"
+#include "preprocess.h"
+
+/*
+ * macro snapshot (native little-endian, 8-byte aligned)
+ *
+ *   struct snapshot_header
+ *   struct snapshot_include[include_count]    the prefix header first
+ *   struct snapshot_macro[macro_count]
+ *   uint32_t parameters[parameter_count]      string offsets
+ *   struct snapshot_token[token_count]        replacement lists, then output_count output tokens
+ *   string table                              NUL terminated
+ */
+
+#define SNAPSHOT_MAGIC "SKMS"
+#define SNAPSHOT_VERSION 3
+
+#define SNAPSHOT_NO_FILE 0xffffffff
+
+#define SNAPSHOT_TOKEN_MACRO 0x01
+
+struct snapshot_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t include_count;
+  uint32_t macro_count;
+  uint32_t parameter_count;
+  uint32_t token_count;
+  uint32_t output_count;
+  uint32_t string_size;
+  uint32_t size;
+  uint32_t search;
+  uint32_t definitions;
+  uint32_t reserved;
+};
+
+struct snapshot_include {
+  uint32_t path;
+  uint32_t system;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+struct snapshot_macro {
+  uint8_t type;
+  uint8_t ellipsis;
+  uint16_t parameter_size;
+  uint32_t identifier;
+  uint32_t parameter;
+  uint32_t token;
+  uint32_t token_count;
+};
+
+struct snapshot_token {
+  uint8_t type;
+  uint8_t flags;
+  uint16_t reserved;
+  uint32_t text;
+  uint32_t size;
+  uint32_t file;
+  int32_t offset;
+};
+
+struct macro_snapshot {
+  const char *prefix;
+  int stale;
+  const struct snapshot_header *header;
+  const struct snapshot_include *includes;
+  const char *strings;
+  struct macro_entry *macros;
+  int macros_size;
+  struct pp_token *tokens;
+  struct string *texts;
+  struct pp_node *nodes;
+  struct pp_list *lists;
+  struct pp_list empty;
+  struct pp_token *output;
+  int output_size;
+  void *data;
+  long size;
+};
+
+extern int write_macro_snapshot(struct skcc_context *ctx, const char *file, const char *path);
+extern struct macro_snapshot *load_macro_snapshot(struct skcc_context *ctx, const char *path);
+extern void free_macro_snapshot(struct macro_snapshot *snapshot);
+extern void include_snapshot(struct skcc_context *ctx, struct macro_snapshot *snapshot, struct pp_sink *sink);
+
+#endif
@@ -0,0 +1,447 @@
+#include "speculate.h"
+
+/*
+ * Speculative preprocessing of upcoming includes.
+ *
+ * At an #include, the literal #include directives which follow it in the
+ * same group are queued for a pool of threads, each with a copy of the
+ * macro table as a guess of the state the include will see. A worker
+ * preprocesses the header into a token list, recording the first lookup of
+ * every macro name and every #define and #undef. When the main thread
+ * reaches the include, the result is committed only if every recorded
+ * lookup still finds the same definition; otherwise the header is
+ * preprocessed serially as usual.
+ */
+
+long elapsed_since(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+
+struct speculation *allocate_speculation(struct skcc_context *ctx, struct source *src, int directive, char *name) {
+  struct speculation *spec = (struct speculation *) calloc(1, sizeof(struct speculation));
+  if(spec == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  spec->content = src->content;
+  spec->directive = directive;
+  spec->name = name;
+  spec->current_file = strdup(src->file);
+  spec->snapshot = copy_macro_table(ctx->macros);
+  spec->dependencies = allocate_dependencies();
+  spec->dependencies->options = ctx->dependencies->options;
+  spec->output = allocate_pp_list();
+  atomic_init(&spec->cancelled, 0);
+  return spec;
+}
+
+void free_speculation(struct speculation *spec) {
+  free(spec->name);
+  free(spec->current_file);
+  // the snapshot does not own its entries
+  free(spec->snapshot);
+  free_dependencies(spec->dependencies);
+  free(spec->resolved);
+  free(spec->reads);
+  free(spec->effects);
+  for(int i = 0; i < spec->defined_size; i++) {
+    free_macro_entry(spec->defined[i]);
+  }
+  free(spec->defined);
+  if(spec->arena != NULL) {
+    free_macro_arena(spec->arena);
+  }
+  if(spec->output != NULL) {
+    release_written_pp_tokens(spec->output, 0);
+    free_pp_list(spec->output);
+  }
+  free(spec->messages);
+  free(spec);
+}
+
+// set of names looked up by a run, open addressing over the atoms; returns 1 for a new name
+int mark_resolved(struct speculation *spec, const unsigned char *identifier) {
+  if(spec->resolved_size * 2 >= spec->resolved_alloc) {
+    int alloc = spec->resolved_alloc == 0 ? 1024 : spec->resolved_alloc * 2;
+    const unsigned char **resolved = (const unsigned char **) calloc(alloc, sizeof(const unsigned char *));
+    if(resolved == NULL) {
+      perror("calloc");
+      exit(1);
+    }
+    for(int i = 0; i < spec->resolved_alloc; i++) {
+      if(spec->resolved[i] == NULL) continue;
+      unsigned int h = interned_hash(spec->resolved[i]) & (alloc - 1);
+      while(resolved[h] != NULL) h = (h + 1) & (alloc - 1);
+      resolved[h] = spec->resolved[i];
+    }
+    free(spec->resolved);
+    spec->resolved = resolved;
+    spec->resolved_alloc = alloc;
+  }
+
+  unsigned int h = interned_hash(identifier) & (spec->resolved_alloc - 1);
+  while(spec->resolved[h] != NULL) {
+    if(spec->resolved[h] == identifier) return 0;
+    h = (h + 1) & (spec->resolved_alloc - 1);
+  }
+  spec->resolved[h] = identifier;
+  spec->resolved_size++;
+  return 1;
+}
+
+// a name is taken from the snapshot when the run first looks it up
+void resolve_speculative_macro(struct skcc_context *ctx, const unsigned char *identifier) {
+  struct speculation *spec = ctx->speculation;
+  if(atomic_load(&spec->cancelled)) {
+    error("speculation is cancelled.\n");
+  }
+  if(!mark_resolved(spec, identifier)) return;
+
+  struct macro_entry *macro = search_macro_table(spec->snapshot, identifier);
+  if(spec->reads_size == spec->reads_alloc) {
+    spec->reads_alloc = spec->reads_alloc == 0 ? 256 : spec->reads_alloc * 2;
+    spec->reads = (struct speculative_read *) realloc(spec->reads, sizeof(struct speculative_read) * spec->reads_alloc);
+    if(spec->reads == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  spec->reads[spec->reads_size].identifier = identifier;
+  spec->reads[spec->reads_size].macro = macro;
+  spec->reads_size++;
+
+  if(macro != NULL) {
+    insert_macro_table(ctx->macros, borrow_macro_entry(macro));
+  }
+}
+
+void record_speculative_effect(struct skcc_context *ctx, const unsigned char *identifier, struct macro_entry *macro) {
+  struct speculation *spec = ctx->speculation;
+  if(spec->effects_size == spec->effects_alloc) {
+    spec->effects_alloc = spec->effects_alloc == 0 ? 256 : spec->effects_alloc * 2;
+    spec->effects = (struct speculative_effect *) realloc(spec->effects, sizeof(struct speculative_effect) * spec->effects_alloc);
+    if(spec->effects == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  spec->effects[spec->effects_size].identifier = identifier;
+  spec->effects[spec->effects_size].macro = macro;
+  spec->effects_size++;
+}
+
+void run_speculation(struct skcc_context *ctx, struct speculation *spec) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  FILE *messages = open_memstream(&spec->messages, &spec->messages_size);
+  if(messages == NULL) {
+    perror("open_memstream");
+    exit(1);
+  }
+
+  struct pp_sink *sink = allocate_marked_list_sink(spec->output);
+  struct dependencies *dependencies = ctx->dependencies;
+  struct string *name = allocate_string();
+  write_string(name, spec->name);
+  struct string *volatile path = NULL;
+  jmp_buf jump;
+
+  error_stream = messages;
+  error_jump = &jump;
+  ctx->speculation = spec;
+  ctx->dependencies = spec->dependencies;
+  if(setjmp(jump) == 0) {
+    struct include_file file;
+    file.misses = NULL;
+    int found;
+    if(name->head[0] == '<') {
+      found = search_header_file(ctx->search, &file, name);
+    } else {
+      found = search_named_source_file(ctx->search, &file, name, spec->current_file);
+    }
+    if(!found) {
+      error("failed to search include file: %s\n", name->head);
+    }
+
+    path = file.path;
+    spec->file = file.name;
+    parse_preprocessing_file_fd(ctx, (unsigned char *) file.name, file.fd, sink);
+    spec->status = 0;
+  } else {
+    while(ctx->include_depth > 0) {
+      free_pp_token_lexer(ctx->includes[--ctx->include_depth]);
+    }
+    spec->status = 1;
+  }
+  ctx->dependencies = dependencies;
+  ctx->speculation = NULL;
+  error_jump = NULL;
+  error_stream = NULL;
+
+  fclose(messages);
+  free_pp_sink(sink);
+  free_string(name);
+  if(path != NULL) {
+    free_string(path);
+  }
+
+  // the definitions go with the result; the borrowed ones are freed when it is settled
+  detach_macro_table(ctx->macros, &spec->defined, &spec->defined_size, &spec->arena);
+  spec->elapsed = elapsed_since(&start);
+}
+
+void *run_speculator_thread(void *arg) {
+  struct speculator_thread *thread = (struct speculator_thread *) arg;
+  struct speculator *speculator = thread->speculator;
+
+  pthread_mutex_lock(&speculator->lock);
+  while(1) {
+    while(speculator->queue == NULL && !speculator->stopping) {
+      pthread_cond_wait(&speculator->ready, &speculator->lock);
+    }
+    if(speculator->stopping) break;
+
+    struct speculation *spec = speculator->queue;
+    speculator->queue = spec->next_queued;
+    if(speculator->queue == NULL) {
+      speculator->queue_tail = &speculator->queue;
+    }
+    pthread_mutex_unlock(&speculator->lock);
+
+    if(atomic_load(&spec->cancelled)) {
+      spec->status = 1;
+    } else {
+      run_speculation(thread->ctx, spec);
+    }
+
+    pthread_mutex_lock(&speculator->lock);
+    spec->done = 1;
+    pthread_cond_broadcast(&speculator->finished);
+  }
+  pthread_mutex_unlock(&speculator->lock);
+
+  return NULL;
+}
+
+// every thread has a context of its own, sharing the caches of ctx
+struct speculator *allocate_speculator(struct skcc_context *ctx, int threads) {
+  struct speculator *speculator = (struct speculator *) calloc(1, sizeof(struct speculator));
+  if(speculator == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  speculator->queue_tail = &speculator->queue;
+  pthread_mutex_init(&speculator->lock, NULL);
+  pthread_cond_init(&speculator->ready, NULL);
+  pthread_cond_init(&speculator->finished, NULL);
+
+  speculator->threads = (struct speculator_thread *) calloc(threads, sizeof(struct speculator_thread));
+  if(speculator->threads == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  for(int i = 0; i < threads; i++) {
+    struct speculator_thread *thread = &speculator->threads[i];
+    thread->speculator = speculator;
+    thread->ctx = allocate_skcc_worker_context(ctx);
+    thread->ctx->speculator = NULL;
+    if(pthread_create(&thread->thread, NULL, run_speculator_thread, thread) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  speculator->threads_size = threads;
+
+  return speculator;
+}
+
+// the contexts using the speculator have cancelled their speculations
+void free_speculator(struct speculator *speculator) {
+  pthread_mutex_lock(&speculator->lock);
+  speculator->stopping = 1;
+  pthread_cond_broadcast(&speculator->ready);
+  pthread_mutex_unlock(&speculator->lock);
+
+  for(int i = 0; i < speculator->threads_size; i++) {
+    pthread_join(speculator->threads[i].thread, NULL);
+    free_skcc_context(speculator->threads[i].ctx);
+  }
+  pthread_mutex_destroy(&speculator->lock);
+  pthread_cond_destroy(&speculator->ready);
+  pthread_cond_destroy(&speculator->finished);
+  free(speculator->threads);
+  free(speculator);
+}
+
+void wait_speculation(struct speculator *speculator, struct speculation *spec) {
+  pthread_mutex_lock(&speculator->lock);
+  while(!spec->done) {
+    pthread_cond_wait(&speculator->finished, &speculator->lock);
+  }
+  pthread_mutex_unlock(&speculator->lock);
+}
+
+struct speculation **find_speculation(struct skcc_context *ctx, struct source_file *content, int directive) {
+  for(struct speculation **spec = &ctx->speculations; *spec != NULL; spec = &(*spec)->next) {
+    if((*spec)->content == content && (*spec)->directive == directive) return spec;
+  }
+  return NULL;
+}
+
+// queue the literal #includes following the current one in its group, as many as there are threads
+void speculate_includes(struct preprocessor *pp) {
+  struct skcc_context *ctx = pp->ctx;
+  struct speculator *speculator = ctx->speculator;
+  struct source_file *content = pp->lexer->src->content;
+  struct skeleton *skeleton = content->skeleton;
+  if(pp->directive < 0) return;
+
+  int pending = 0;
+  for(struct speculation *spec = ctx->speculations; spec != NULL; spec = spec->next) {
+    pending++;
+  }
+
+  int depth = skeleton->directives[pp->directive].depth;
+  int ahead = 0;
+  for(int i = pp->directive + 1; i < skeleton->size && ahead < speculator->threads_size; i++) {
+    struct directive *directive = &skeleton->directives[i];
+    // an #elif, #else or #endif of the enclosing section ends the group
+    if(directive->depth < depth) break;
+    if(directive->type != DIR_INCLUDE || directive->depth != depth) continue;
+
+    ahead++;
+    if(find_speculation(ctx, content, i) != NULL) continue;
+    if(pending == SPECULATION_PENDING_LIMIT) break;
+
+    char *name = include_operand(content->text, directive);
+    if(name == NULL) continue;
+
+    struct speculation *spec = allocate_speculation(ctx, pp->lexer->src, i, name);
+    spec->next = ctx->speculations;
+    ctx->speculations = spec;
+    pending++;
+
+    pthread_mutex_lock(&speculator->lock);
+    *speculator->queue_tail = spec;
+    speculator->queue_tail = &spec->next_queued;
+    speculator->launched++;
+    pthread_cond_signal(&speculator->ready);
+    pthread_mutex_unlock(&speculator->lock);
+  }
+}
+
+int check_speculative_reads(struct macro_table *table, struct speculation *spec) {
+  for(int i = 0; i < spec->reads_size; i++) {
+    struct macro_entry *macro = search_macro_table(table, spec->reads[i].identifier);
+    struct macro_entry *guess = spec->reads[i].macro;
+    if(macro == guess) continue;
+    if(macro == NULL || guess == NULL || !compare_macro(macro, guess)) return 0;
+  }
+  return 1;
+}
+
+// returns 1 if the include at the current directive was replaced by a speculative result
+int commit_speculation(struct preprocessor *pp, const unsigned char *file) {
+  struct skcc_context *ctx = pp->ctx;
+  struct speculator *speculator = ctx->speculator;
+  struct speculation **link = find_speculation(ctx, pp->lexer->src->content, pp->directive);
+  if(link == NULL) return 0;
+
+  struct speculation *spec = *link;
+  *link = spec->next;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  wait_speculation(speculator, spec);
+  long waited = elapsed_since(&start);
+
+  int valid = spec->status == 0 && spec->file == file && check_speculative_reads(ctx->macros, spec);
+
+  pthread_mutex_lock(&speculator->lock);
+  speculator->waited_time += waited;
+  if(valid) {
+    speculator->committed++;
+    speculator->committed_time += spec->elapsed;
+  } else {
+    if(spec->status != 0) speculator->failed++;
+    else speculator->mismatched++;
+    speculator->wasted_time += spec->elapsed;
+  }
+  pthread_mutex_unlock(&speculator->lock);
+
+  if(!valid) {
+    free_speculation(spec);
+    return 0;
+  }
+
+  fwrite(spec->messages, 1, spec->messages_size, error_stream != NULL ? error_stream : stderr);
+
+  // the result owns its tokens; a retaining sink keeps them, except the marked ones which it copies
+  pp->sink->write(pp->sink, spec->output);
+  release_written_pp_tokens(spec->output, pp->sink->retain);
+  free_pp_list(spec->output);
+  spec->output = NULL;
+
+  for(int i = 0; i < spec->effects_size; i++) {
+    struct speculative_effect *effect = &spec->effects[i];
+    if(effect->macro != NULL) {
+      insert_macro_table(ctx->macros, effect->macro);
+    } else {
+      delete_macro_table(ctx->macros, effect->identifier);
+    }
+  }
+
+  // the definitions of the run now belong to the table along with its arena; the borrowed copies go
+  for(int i = 0; i < spec->defined_size; i++) {
+    free_macro_entry(spec->defined[i]);
+  }
+  spec->defined_size = 0;
+  adopt_macro_arena(ctx->macros->arena, spec->arena);
+  spec->arena = NULL;
+
+  if(ctx->dependencies->options.enabled) {
+    for(int i = 0; i < spec->dependencies->size; i++) {
+      add_dependency(ctx->dependencies, spec->dependencies->paths[i], 0);
+    }
+  }
+
+  free_speculation(spec);
+  return 1;
+}
+
+// speculations which were never reached are waited for and dropped
+void cancel_speculations(struct skcc_context *ctx) {
+  struct speculator *speculator = ctx->speculator;
+
+  for(struct speculation *spec = ctx->speculations; spec != NULL; spec = spec->next) {
+    atomic_store(&spec->cancelled, 1);
+  }
+
+  while(ctx->speculations != NULL) {
+    struct speculation *spec = ctx->speculations;
+    ctx->speculations = spec->next;
+    wait_speculation(speculator, spec);
+
+    pthread_mutex_lock(&speculator->lock);
+    speculator->unused++;
+    speculator->wasted_time += spec->elapsed;
+    pthread_mutex_unlock(&speculator->lock);
+
+    free_speculation(spec);
+  }
+}
+
+void write_speculation_stats(struct speculator *speculator, FILE *fp) {
+  pthread_mutex_lock(&speculator->lock);
+  fprintf(fp, "speculate: %ld launched, %ld committed, %ld mismatched, %ld failed, %ld unused",
+      speculator->launched, speculator->committed, speculator->mismatched, speculator->failed, speculator->unused);
+  if(speculator->launched > 0) {
+    fprintf(fp, ", hit rate %.1f%%", 100.0 * speculator->committed / speculator->launched);
+  }
+  fprintf(fp, ", %.1f ms committed, %.1f ms wasted, %.1f ms waited\n",
+      speculator->committed_time / 1e6, speculator->wasted_time / 1e6, speculator->waited_time / 1e6);
+  pthread_mutex_unlock(&speculator->lock);
+}
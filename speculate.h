@@ -0,0 +1,92 @@
+#ifndef __SPECULATE_INCLUDE__
+#define __SPECULATE_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "error.h"
+#include "preprocess.h"
+
+#define SPECULATION_PENDING_LIMIT 16
+
+// the first lookup of a name in a speculative run; macro is NULL if it was not defined
+struct speculative_read {
+  const unsigned char *identifier;
+  struct macro_entry *macro;
+};
+
+// a #define or #undef of a speculative run; macro is NULL for #undef
+struct speculative_effect {
+  const unsigned char *identifier;
+  struct macro_entry *macro;
+};
+
+struct speculation {
+  struct source_file *content;
+  int directive;
+  char *name;
+  char *current_file;
+  const unsigned char *file;
+  struct macro_table *snapshot;
+  struct dependencies *dependencies;
+  const unsigned char **resolved;
+  int resolved_size;
+  int resolved_alloc;
+  struct speculative_read *reads;
+  int reads_size;
+  int reads_alloc;
+  struct speculative_effect *effects;
+  int effects_size;
+  int effects_alloc;
+  struct macro_entry **defined;
+  int defined_size;
+  struct macro_arena *arena;
+  struct pp_list *output;
+  char *messages;
+  size_t messages_size;
+  int status;
+  int done;
+  atomic_int cancelled;
+  long elapsed;
+  struct speculation *next;
+  struct speculation *next_queued;
+};
+
+struct speculator_thread {
+  struct speculator *speculator;
+  struct skcc_context *ctx;
+  pthread_t thread;
+};
+
+struct speculator {
+  struct speculator_thread *threads;
+  int threads_size;
+  struct speculation *queue;
+  struct speculation **queue_tail;
+  int stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t finished;
+  long launched;
+  long committed;
+  long mismatched;
+  long failed;
+  long unused;
+  long committed_time;
+  long wasted_time;
+  long waited_time;
+};
+
+extern struct speculator *allocate_speculator(struct skcc_context *ctx, int threads);
+extern void free_speculator(struct speculator *speculator);
+extern void speculate_includes(struct preprocessor *pp);
+extern int commit_speculation(struct preprocessor *pp, const unsigned char *file);
+extern void cancel_speculations(struct skcc_context *ctx);
+extern void resolve_speculative_macro(struct skcc_context *ctx, const unsigned char *identifier);
+extern void record_speculative_effect(struct skcc_context *ctx, const unsigned char *identifier, struct macro_entry *macro);
+extern void write_speculation_stats(struct speculator *speculator, FILE *fp);
+
+#endif
@@ -0,0 +1,82 @@
+#include <time.h>
+#include "../../main.h"
+
+double elapsed(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int preprocess_null(struct skcc_context *ctx, struct batch_unit *unit, void *data) {
+  struct output *out = allocate_output_file("/dev/null", 0);
+  struct pp_sink *sink = allocate_output_sink(out);
+  int status = skcc_preprocess(ctx, unit->source, sink);
+  free_pp_sink(sink);
+  atomic_fetch_add((_Atomic long *) data, out->written);
+  free_output(out);
+  return status;
+}
+
+// bench -j N files...: the batch with 1, 2, 4, ... N threads
+int bench_batch(int threads, char **files, int size) {
+  struct batch_unit *units = (struct batch_unit *) calloc(size, sizeof(struct batch_unit));
+  double base = 0;
+
+  for(int n = 1; ; n = n * 2 < threads ? n * 2 : threads) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(int i = 0; i < size; i++) {
+      units[i].source = files[i];
+    }
+    _Atomic long written = 0;
+    struct skcc_context *ctx = allocate_skcc_context();
+    int status = run_batch(ctx, units, size, n, preprocess_null, &written);
+    free_skcc_context(ctx);
+    if(status != 0) return status;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsed(&start, &end);
+    if(n == 1) base = seconds;
+    printf("  %d files, %d threads: %ld bytes in %.3f s, output %.2f MB/s, speedup %.2fx\n", size, n, (long) written, seconds, written / seconds / 1e6, base / seconds);
+
+    if(n == threads) break;
+  }
+
+  free(units);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if(argc < 2) exit(1);
+
+  if(argc >= 4 && strcmp(argv[1], "-j") == 0) {
+    return bench_batch(atoi(argv[2]), &argv[3], argc - 3);
+  }
+
+  // bench --pipeline file: the output is written by its own thread
+  int pipeline = argc >= 3 && strcmp(argv[1], "--pipeline") == 0;
+  char *file = argv[pipeline ? 2 : 1];
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct output *out = allocate_output_file("/dev/null", 0);
+  if(pipeline) {
+    start_output_writer(out);
+  }
+  struct skcc_context *ctx = allocate_skcc_context();
+  struct pp_sink *sink = allocate_output_sink(out);
+  int status = skcc_preprocess(ctx, file, sink);
+  free_pp_sink(sink);
+  free_skcc_context(ctx);
+
+  long written = out->written;
+  free_output(out);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = elapsed(&start, &end);
+  printf("  %s%s: %ld bytes in %.3f s, output %.2f MB/s\n", file, pipeline ? " (pipeline)" : "", written, seconds, written / seconds / 1e6);
+
+  return status;
+}
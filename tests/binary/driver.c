@@ -0,0 +1,20 @@
+#include "../../reader.h"
+
+int main(int argc, char **argv) {
+  struct token_stream_reader reader;
+  if(open_token_stream(&reader, argv[1]) < 0) {
+    fprintf(stderr, "invalid token stream: %s\n", argv[1]);
+    return 1;
+  }
+
+  FILE *fp = fopen(argv[2], "w");
+  if(fp == NULL) {
+    perror("fopen");
+    return 1;
+  }
+  int status = write_token_stream_text(&reader, fp);
+  fclose(fp);
+  close_token_stream(&reader);
+
+  return status < 0;
+}
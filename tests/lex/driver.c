@@ -10,7 +10,8 @@
 int main(int argc, char **argv) {
   if(argc < 2) exit(1);
 
-  struct pp_token_lexer *lexer = allocate_pp_token_lexer(argv[1]);
+  struct source_cache *cache = allocate_source_cache();
+  struct pp_token_lexer *lexer = allocate_pp_token_lexer(cache, argv[1]);
   FILE *in = fopen(argv[2], "r");
 
   int n;
@@ -45,6 +46,7 @@ int main(int argc, char **argv) {
   }
 
   free_pp_token_lexer(lexer);
+  free_source_cache(cache);
 
   printf("  OK %s\n", argv[2]);
 
@@ -2,13 +2,14 @@
 
 int main(int argc, char **argv) {
   char *file = argv[1];
-  struct pp_list *list = preprocess(file);
 
-  FILE *out = fopen(argv[2], "w");
-  for(struct pp_node *node = list->head; node != NULL; node = node->next) {
-    struct pp_token *token = node->token;
-    fprintf(out, "%s", token->text->head);
-  }
+  struct output *out = allocate_output_file(argv[2], 0);
+  struct skcc_context *ctx = allocate_skcc_context();
+  struct pp_sink *sink = allocate_output_sink(out);
+  int status = skcc_preprocess(ctx, file, sink);
+  free_pp_sink(sink);
+  free_skcc_context(ctx);
+  free_output(out);
 
-  return 0;
+  return status;
 }
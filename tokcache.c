@@ -0,0 +1,590 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tokcache.h"
+
+/*
+ * Persistent cache of lexed token streams. A file is looked up by a digest
+ * of its contents and LEXER_VERSION, so a header lexed by one run is only
+ * replayed by the next ones while both the bytes and the lexer stay the
+ * same. A stream is lexed from the beginning of the file to the end once
+ * and then read by mmap.
+ *
+ * Entries are written to a temporary file and renamed into place, so
+ * processes sharing the directory never see a partial entry. When the
+ * directory grows beyond the limit, the entries used least recently are
+ * removed; an entry is touched whenever a run loads it.
+ *
+ * The streams read or lexed by a run are kept in memory as long as a lexer
+ * replays them, and beyond that within the same limit, the least recently
+ * used first to go. A stream whose source contents leave the source cache
+ * is dropped at once, as the file is not expected to be lexed again.
+ */
+
+#define TOKEN_CACHE_SUFFIX ".lx"
+#define TOKEN_CACHE_TEMP ".tmp-"
+
+// temporary files left by a crashed run are removed after this many seconds
+#define TOKEN_CACHE_TEMP_AGE 3600
+
+struct lexed_builder {
+  struct lexed_record *records;
+  int records_size;
+  int records_alloc;
+  char *strings;
+  long strings_size;
+  long strings_alloc;
+};
+
+struct cache_entry {
+  char *path;
+  long size;
+  struct timespec mtime;
+};
+
+uint64_t lexed_digest(const unsigned char *text, int size) {
+  const uint64_t prime = 1099511628211ull;
+  uint64_t h = 14695981039346656037ull ^ LEXER_VERSION;
+
+  int i = 0;
+  for(; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, &text[i], 8);
+    h = (h ^ word) * prime;
+    h ^= h >> 29;
+  }
+  for(; i < size; i++) {
+    h = (h ^ text[i]) * prime;
+  }
+  h = (h ^ (uint64_t) size) * prime;
+  return h ^ (h >> 32);
+}
+
+char *lexed_stream_path(struct token_cache *cache, uint64_t digest) {
+  char *path = (char *) malloc(strlen(cache->dir) + 32);
+  if(path == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  sprintf(path, "%s/%016llx" TOKEN_CACHE_SUFFIX, cache->dir, (unsigned long long) digest);
+  return path;
+}
+
+int ends_with(const char *s, const char *suffix) {
+  int n = strlen(s), m = strlen(suffix);
+  return n >= m && strcmp(&s[n - m], suffix) == 0;
+}
+
+int compare_cache_entry(const void *a, const void *b) {
+  const struct cache_entry *x = (const struct cache_entry *) a;
+  const struct cache_entry *y = (const struct cache_entry *) b;
+  if(x->mtime.tv_sec != y->mtime.tv_sec) return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  if(x->mtime.tv_nsec != y->mtime.tv_nsec) return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+// called with the lock held; sums up the entries and removes the oldest ones beyond the limit
+void trim_token_cache(struct token_cache *cache) {
+  DIR *dir = opendir(cache->dir);
+  if(dir == NULL) return;
+
+  struct cache_entry *entries = NULL;
+  int size = 0, alloc = 0;
+  long bytes = 0;
+  time_t now = time(NULL);
+
+  struct dirent *ent;
+  while((ent = readdir(dir)) != NULL) {
+    int temp = strncmp(ent->d_name, TOKEN_CACHE_TEMP, strlen(TOKEN_CACHE_TEMP)) == 0;
+    if(!temp && !ends_with(ent->d_name, TOKEN_CACHE_SUFFIX)) continue;
+
+    char *path = (char *) malloc(strlen(cache->dir) + strlen(ent->d_name) + 2);
+    if(path == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    sprintf(path, "%s/%s", cache->dir, ent->d_name);
+
+    struct stat st;
+    if(stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+      free(path);
+      continue;
+    }
+    if(temp) {
+      if(now - st.st_mtim.tv_sec > TOKEN_CACHE_TEMP_AGE) {
+        unlink(path);
+      }
+      free(path);
+      continue;
+    }
+
+    if(size >= alloc) {
+      alloc = alloc == 0 ? 64 : alloc * 2;
+      entries = (struct cache_entry *) realloc(entries, sizeof(struct cache_entry) * alloc);
+      if(entries == NULL) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    entries[size].path = path;
+    entries[size].size = st.st_size;
+    entries[size].mtime = st.st_mtim;
+    size++;
+    bytes += st.st_size;
+  }
+  closedir(dir);
+
+  // trim down to three quarters so that the directory is not scanned on every store
+  if(bytes > cache->limit) {
+    qsort(entries, size, sizeof(struct cache_entry), compare_cache_entry);
+    for(int i = 0; i < size && bytes > cache->limit / 4 * 3; i++) {
+      if(unlink(entries[i].path) == 0) {
+        cache->evicted++;
+      }
+      bytes -= entries[i].size;
+    }
+  }
+  cache->bytes = bytes;
+
+  for(int i = 0; i < size; i++) {
+    free(entries[i].path);
+  }
+  free(entries);
+}
+
+struct token_cache *allocate_token_cache(const char *dir) {
+  if(mkdir(dir, 0777) < 0 && errno != EEXIST) {
+    error("failed to create the token cache: %s\n", dir);
+  }
+
+  struct token_cache *cache = (struct token_cache *) calloc(1, sizeof(struct token_cache));
+  if(cache == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  cache->dir = strdup(dir);
+  cache->limit = TOKEN_CACHE_LIMIT;
+  cache->discard = fopen("/dev/null", "w");
+  pthread_mutex_init(&cache->lock, NULL);
+  trim_token_cache(cache);
+  return cache;
+}
+
+void free_lexed_stream(struct lexed_stream *stream) {
+  if(stream->mapped) {
+    munmap(stream->data, stream->size);
+  } else {
+    free(stream->data);
+  }
+  free(stream);
+}
+
+void unlink_lexed_lru(struct token_cache *cache, struct lexed_stream *stream) {
+  if(stream->lru_prev != NULL) {
+    stream->lru_prev->lru_next = stream->lru_next;
+  } else {
+    cache->lru_head = stream->lru_next;
+  }
+  if(stream->lru_next != NULL) {
+    stream->lru_next->lru_prev = stream->lru_prev;
+  } else {
+    cache->lru_tail = stream->lru_prev;
+  }
+}
+
+void push_lexed_lru(struct token_cache *cache, struct lexed_stream *stream) {
+  stream->lru_prev = NULL;
+  stream->lru_next = cache->lru_head;
+  if(cache->lru_head != NULL) {
+    cache->lru_head->lru_prev = stream;
+  } else {
+    cache->lru_tail = stream;
+  }
+  cache->lru_head = stream;
+}
+
+// called with the lock held
+void remove_lexed_stream(struct token_cache *cache, struct lexed_stream *stream) {
+  struct lexed_stream **entry = &cache->table[stream->digest % TOKEN_CACHE_TABLE_SIZE];
+  while(*entry != stream) {
+    entry = &((*entry)->next);
+  }
+  *entry = stream->next;
+
+  unlink_lexed_lru(cache, stream);
+  cache->memory -= stream->size;
+  cache->dropped++;
+  free_lexed_stream(stream);
+}
+
+// called with the lock held; the streams no lexer replays are dropped until the memory fits in the limit
+void evict_lexed_streams(struct token_cache *cache) {
+  struct lexed_stream *stream = cache->lru_tail;
+  while(stream != NULL && cache->memory > cache->limit) {
+    struct lexed_stream *prev = stream->lru_prev;
+    if(stream->users == 0) {
+      remove_lexed_stream(cache, stream);
+    }
+    stream = prev;
+  }
+}
+
+void set_token_cache_limit(struct token_cache *cache, long limit) {
+  pthread_mutex_lock(&cache->lock);
+  cache->limit = limit;
+  if(cache->bytes > cache->limit) {
+    trim_token_cache(cache);
+  }
+  evict_lexed_streams(cache);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void free_token_cache(struct token_cache *cache) {
+  for(int i = 0; i < TOKEN_CACHE_TABLE_SIZE; i++) {
+    struct lexed_stream *stream = cache->table[i];
+    while(stream != NULL) {
+      struct lexed_stream *next = stream->next;
+      free_lexed_stream(stream);
+      stream = next;
+    }
+  }
+  if(cache->discard != NULL) {
+    fclose(cache->discard);
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->dir);
+  free(cache);
+}
+
+struct lexed_stream *allocate_lexed_stream(void *data, long size, int mapped) {
+  struct lexed_stream *stream = (struct lexed_stream *) malloc(sizeof(struct lexed_stream));
+  if(stream == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  struct lexed_stream_header *header = (struct lexed_stream_header *) data;
+  stream->digest = header->digest;
+  stream->source_size = header->source_size;
+  stream->records = (const struct lexed_record *) &header[1];
+  stream->record_count = header->record_count;
+  stream->strings = (const char *) &stream->records[stream->record_count];
+  stream->data = data;
+  stream->size = size;
+  stream->mapped = mapped;
+  stream->users = 0;
+  stream->next = NULL;
+  stream->lru_prev = NULL;
+  stream->lru_next = NULL;
+  return stream;
+}
+
+// an entry may be truncated or come from another build; everything the lexer relies on is checked
+int check_lexed_stream(const void *data, long size, uint64_t digest, int source_size) {
+  if(size < (long) sizeof(struct lexed_stream_header)) return 0;
+
+  const struct lexed_stream_header *header = (const struct lexed_stream_header *) data;
+  if(memcmp(header->magic, LEXED_STREAM_MAGIC, 4) != 0) return 0;
+  if(header->version != LEXER_VERSION || header->digest != digest) return 0;
+  if(header->source_size != (uint32_t) source_size || header->size != size) return 0;
+  if(header->record_count == 0 || header->string_size == 0) return 0;
+  if(sizeof(struct lexed_stream_header) + (long) header->record_count * sizeof(struct lexed_record) + header->string_size != (unsigned long) size) return 0;
+
+  const struct lexed_record *records = (const struct lexed_record *) &header[1];
+  const char *strings = (const char *) &records[header->record_count];
+  if(strings[header->string_size - 1] != '\0') return 0;
+
+  for(uint32_t i = 0; i < header->record_count; i++) {
+    const struct lexed_record *record = &records[i];
+    int last = i + 1 == header->record_count;
+    if(record->type > PP_NONE || record->context > CTX_NORMAL) return 0;
+    if(record->text >= header->string_size) return 0;
+    if((record->type == PP_NONE) != last) return 0;
+    if(!last && (record->offset >= header->source_size || (i > 0 && record->offset <= records[i - 1].offset))) return 0;
+  }
+  return 1;
+}
+
+struct lexed_stream *load_lexed_stream(struct token_cache *cache, uint64_t digest, int source_size) {
+  char *path = lexed_stream_path(cache, digest);
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if(fd < 0) return NULL;
+
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct lexed_stream_header)) {
+    close(fd);
+    return NULL;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  // a loaded entry is the last to be evicted
+  futimens(fd, NULL);
+  close(fd);
+  if(data == MAP_FAILED) return NULL;
+
+  if(!check_lexed_stream(data, st.st_size, digest, source_size)) {
+    munmap(data, st.st_size);
+    return NULL;
+  }
+  return allocate_lexed_stream(data, st.st_size, 1);
+}
+
+void append_lexed_record(struct lexed_builder *builder, struct pp_token *token, enum pp_token_lexer_context context) {
+  if(builder->records_size >= builder->records_alloc) {
+    builder->records_alloc = builder->records_alloc == 0 ? 256 : builder->records_alloc * 2;
+    builder->records = (struct lexed_record *) realloc(builder->records, sizeof(struct lexed_record) * builder->records_alloc);
+    if(builder->records == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  long length = token->text->size + 1;
+  while(builder->strings_size + length > builder->strings_alloc) {
+    builder->strings_alloc = builder->strings_alloc == 0 ? 4096 : builder->strings_alloc * 2;
+    builder->strings = (char *) realloc(builder->strings, builder->strings_alloc);
+    if(builder->strings == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+
+  struct lexed_record *record = &builder->records[builder->records_size++];
+  record->type = token->type;
+  record->context = context;
+  record->reserved = 0;
+  record->offset = token->offset;
+  record->text = builder->strings_size;
+  memcpy(&builder->strings[builder->strings_size], token->text->head, length);
+  builder->strings_size += length;
+}
+
+// lexes the whole file with lexer and rewinds it; returns NULL if the file does not lex
+struct lexed_stream *lex_stream(struct token_cache *cache, struct pp_token_lexer *lexer, uint64_t digest) {
+  struct lexed_builder *builder = (struct lexed_builder *) calloc(1, sizeof(struct lexed_builder));
+  if(builder == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+
+  // an error in a group the preprocessor would skip is not reported; the file is lexed as usual instead
+  jmp_buf jump;
+  jmp_buf *saved_jump = error_jump;
+  FILE *saved_stream = error_stream;
+  int lexed = 0;
+
+  error_jump = &jump;
+  error_stream = cache->discard;
+  if(setjmp(jump) == 0) {
+    while(1) {
+      enum pp_token_lexer_context context = lexer->context;
+      struct pp_token *token = next_pp_token(lexer);
+      append_lexed_record(builder, token, context);
+      int end = token->type == PP_NONE;
+      free_pp_token(token);
+      if(end) break;
+    }
+    lexed = 1;
+  }
+  error_jump = saved_jump;
+  error_stream = saved_stream;
+  rewind_pp_token_lexer(lexer);
+
+  struct lexed_stream *stream = NULL;
+  if(lexed) {
+    long records_size = sizeof(struct lexed_record) * builder->records_size;
+    long size = sizeof(struct lexed_stream_header) + records_size + builder->strings_size;
+    unsigned char *data = (unsigned char *) malloc(size);
+    if(data == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+
+    struct lexed_stream_header *header = (struct lexed_stream_header *) data;
+    memcpy(header->magic, LEXED_STREAM_MAGIC, 4);
+    header->version = LEXER_VERSION;
+    header->digest = digest;
+    header->source_size = lexer->src->content->size;
+    header->record_count = builder->records_size;
+    header->string_size = builder->strings_size;
+    header->size = size;
+    memcpy(&header[1], builder->records, records_size);
+    memcpy(&data[sizeof(struct lexed_stream_header) + records_size], builder->strings, builder->strings_size);
+
+    stream = allocate_lexed_stream(data, size, 0);
+  }
+
+  free(builder->records);
+  free(builder->strings);
+  free(builder);
+  return stream;
+}
+
+int store_lexed_stream(struct token_cache *cache, struct lexed_stream *stream) {
+  char *temp = (char *) malloc(strlen(cache->dir) + 16);
+  if(temp == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  sprintf(temp, "%s/" TOKEN_CACHE_TEMP "XXXXXX", cache->dir);
+
+  int fd = mkstemp(temp);
+  if(fd < 0) {
+    free(temp);
+    return 0;
+  }
+  fchmod(fd, 0644);
+
+  int written = 1;
+  const unsigned char *p = (const unsigned char *) stream->data;
+  for(long rest = stream->size; rest > 0;) {
+    ssize_t n = write(fd, p, rest);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) {
+      written = 0;
+      break;
+    }
+    p += n;
+    rest -= n;
+  }
+  if(close(fd) < 0) {
+    written = 0;
+  }
+
+  // the rename is atomic; a reader finds either the whole entry or none
+  char *path = lexed_stream_path(cache, stream->digest);
+  if(!written || rename(temp, path) < 0) {
+    unlink(temp);
+    written = 0;
+  }
+  free(path);
+  free(temp);
+  return written;
+}
+
+// called with the lock held
+struct lexed_stream *search_lexed_stream(struct token_cache *cache, uint64_t digest, int source_size) {
+  for(struct lexed_stream *stream = cache->table[digest % TOKEN_CACHE_TABLE_SIZE]; stream != NULL; stream = stream->next) {
+    if(stream->digest == digest && stream->source_size == source_size) return stream;
+  }
+  return NULL;
+}
+
+// returns the token stream of the file of lexer, which is at its first token; NULL if it cannot be cached
+const struct lexed_stream *find_lexed_stream(struct token_cache *cache, struct pp_token_lexer *lexer) {
+  struct source_file *content = lexer->src->content;
+  uint64_t digest = lexed_digest(content->text, content->size);
+
+  pthread_mutex_lock(&cache->lock);
+  struct lexed_stream *stream = search_lexed_stream(cache, digest, content->size);
+  if(stream != NULL) {
+    stream->users++;
+    unlink_lexed_lru(cache, stream);
+    push_lexed_lru(cache, stream);
+    cache->hits++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  if(stream != NULL) return stream;
+
+  // the file is read or lexed without the lock; another thread may do the same
+  int loaded = 1, stored = 0;
+  stream = load_lexed_stream(cache, digest, content->size);
+  if(stream == NULL) {
+    loaded = 0;
+    stream = lex_stream(cache, lexer, digest);
+    if(stream != NULL) {
+      stored = store_lexed_stream(cache, stream);
+    }
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  if(stream == NULL) {
+    cache->failed++;
+  } else {
+    // a thread which lexed the same file meanwhile wrote the same entry, which is counted once
+    struct lexed_stream *found = search_lexed_stream(cache, digest, content->size);
+    if(found != NULL) {
+      free_lexed_stream(stream);
+      stream = found;
+      unlink_lexed_lru(cache, stream);
+    } else {
+      int h = digest % TOKEN_CACHE_TABLE_SIZE;
+      stream->next = cache->table[h];
+      cache->table[h] = stream;
+      cache->memory += stream->size;
+    }
+    stream->users++;
+    push_lexed_lru(cache, stream);
+
+    if(loaded) {
+      cache->hits++;
+      cache->loaded++;
+    } else {
+      cache->misses++;
+      if(stored) {
+        cache->stored++;
+        if(found == NULL) {
+          cache->bytes += stream->size;
+        }
+        if(cache->bytes > cache->limit) {
+          trim_token_cache(cache);
+        }
+      } else {
+        cache->failed++;
+      }
+    }
+    evict_lexed_streams(cache);
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return stream;
+}
+
+void release_lexed_stream(struct token_cache *cache, const struct lexed_stream *stream) {
+  pthread_mutex_lock(&cache->lock);
+  ((struct lexed_stream *) stream)->users--;
+  evict_lexed_streams(cache);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// the source cache lets go of content; the stream lexed from it is dropped unless a lexer still replays it
+void drop_lexed_stream(struct token_cache *cache, struct source_file *content) {
+  uint64_t digest = lexed_digest(content->text, content->size);
+
+  pthread_mutex_lock(&cache->lock);
+  struct lexed_stream *stream = search_lexed_stream(cache, digest, content->size);
+  if(stream != NULL && stream->users == 0) {
+    remove_lexed_stream(cache, stream);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// the record a lexer which seeks to offset continues from, or -1 if no token of the stream starts there
+int search_lexed_record(const struct lexed_stream *stream, int offset) {
+  int last = stream->record_count - 1;
+  if(offset >= stream->source_size) return last;
+
+  int left = 0, right = last;
+  while(left < right) {
+    int mid = (left + right) / 2;
+    if((int) stream->records[mid].offset < offset) {
+      left = mid + 1;
+    } else {
+      right = mid;
+    }
+  }
+  return left < last && (int) stream->records[left].offset == offset ? left : -1;
+}
+
+void write_token_cache_stats(struct token_cache *cache, FILE *fp) {
+  pthread_mutex_lock(&cache->lock);
+  fprintf(fp, "token cache: %ld hits, %ld misses, %ld loaded, %ld stored, %ld evicted, %ld dropped, %ld failed", cache->hits, cache->misses, cache->loaded, cache->stored, cache->evicted, cache->dropped, cache->failed);
+  if(cache->hits + cache->misses > 0) {
+    fprintf(fp, ", hit rate %.1f%%", 100.0 * cache->hits / (cache->hits + cache->misses));
+  }
+  fprintf(fp, "\n");
+  pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,95 @@
+#ifndef __TOKCACHE_INCLUDE__
+#define __TOKCACHE_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "error.h"
+#include "file.h"
+#include "lex.h"
+
+/*
+ * lexed token stream (native little-endian, 4-byte aligned)
+ *
+ *   struct lexed_stream_header
+ *   struct lexed_record[record_count]      in the order of the source, ending with PP_NONE
+ *   string table                           NUL terminated spellings
+ *
+ * A record keeps the lexer context the token was lexed in, so a lexer
+ * which seeks to its offset can tell whether the rest of the stream holds.
+ */
+
+#define LEXED_STREAM_MAGIC "SKLX"
+
+// bump whenever the lexer splits or spells tokens differently
+#define LEXER_VERSION 1
+
+/* prime number */
+#define TOKEN_CACHE_TABLE_SIZE 251
+#define TOKEN_CACHE_LIMIT (512L * 1024 * 1024)
+
+struct lexed_stream_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t digest;
+  uint32_t source_size;
+  uint32_t record_count;
+  uint32_t string_size;
+  uint32_t size;
+};
+
+struct lexed_record {
+  uint8_t type;
+  uint8_t context;
+  uint16_t reserved;
+  uint32_t offset;
+  uint32_t text;
+};
+
+struct lexed_stream {
+  uint64_t digest;
+  int source_size;
+  const struct lexed_record *records;
+  int record_count;
+  const char *strings;
+  void *data;
+  long size;
+  int mapped;
+  // lexers replaying the stream; an unused stream stays in memory until the limit evicts it
+  int users;
+  struct lexed_stream *next;
+  struct lexed_stream *lru_prev;
+  struct lexed_stream *lru_next;
+};
+
+struct token_cache {
+  char *dir;
+  long bytes;
+  long limit;
+  FILE *discard;
+  struct lexed_stream *table[TOKEN_CACHE_TABLE_SIZE];
+  struct lexed_stream *lru_head;
+  struct lexed_stream *lru_tail;
+  long memory;
+  pthread_mutex_t lock;
+  long hits;
+  long misses;
+  long loaded;
+  long stored;
+  long evicted;
+  long dropped;
+  long failed;
+};
+
+extern struct token_cache *allocate_token_cache(const char *dir);
+extern void set_token_cache_limit(struct token_cache *cache, long limit);
+extern void free_token_cache(struct token_cache *cache);
+extern const struct lexed_stream *find_lexed_stream(struct token_cache *cache, struct pp_token_lexer *lexer);
+extern void release_lexed_stream(struct token_cache *cache, const struct lexed_stream *stream);
+extern void drop_lexed_stream(struct token_cache *cache, struct source_file *content);
+extern int search_lexed_record(const struct lexed_stream *stream, int offset);
+extern void write_token_cache_stats(struct token_cache *cache, FILE *fp);
+
+#endif
@@ -66,6 +66,7 @@ struct utf8c single_byte_char(unsigned char c) {
   uc.bytes = 1;
   uc.sequence[0] = c;
   uc.sequence[1] = '\0';
+  uc.offset = 0;
   return uc;
 }
 
@@ -74,6 +75,7 @@ struct utf8c code_point(int code) {
   for(int i = code; i > 0; i /= 2) bit++;
 
   struct utf8c uc;
+  uc.offset = 0;
   if(0 <= bit && bit <= 7) {
     uc.bytes = 1;
     uc.sequence[0] = code;
@@ -4,6 +4,7 @@
 struct utf8c {
   int bytes;
   unsigned char sequence[5];
+  int offset;
 };
 
 extern struct utf8c ueof;
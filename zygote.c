@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "zygote.h"
+#include "hdrcache.h"
+
+/*
+ * Fork server. The prefix header is preprocessed once into the context,
+ * and each translation unit is then preprocessed by a child forked from
+ * it: the child inherits the macro table, the source cache and the include
+ * lookups as copy-on-write pages, writes the output of the prefix and goes
+ * on with its own source file. At most jobs children run at a time.
+ *
+ * The macros of the prefix are disowned by the table before forking, so a
+ * child does not touch their pages when it clears the table. Diagnostics
+ * and dependency rules of a child go to temporary files, which are read
+ * into the unit when the child is reaped, so only the files of the running
+ * children are open. They are written in input order after all the
+ * children exited, as in a batch.
+ */
+
+long zygote_elapsed(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+// preprocess the prefix header into the context; returns 0 on success and 1 on error
+int prepare_zygote(struct zygote *zygote, const char *prefix) {
+  struct skcc_context *ctx = zygote->ctx;
+  jmp_buf jump;
+  jmp_buf *saved_jump = error_jump;
+  int status = 0;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct pp_sink *sink = allocate_marked_list_sink(zygote->prefix);
+  error_jump = &jump;
+  if(setjmp(jump) == 0) {
+    if(ctx->dependencies->options.enabled) {
+      struct string *path = allocate_string();
+      write_string(path, (char *) prefix);
+      add_dependency(ctx->dependencies, path, 0);
+      free_string(path);
+    }
+    predefine_macros(ctx);
+    parse_preprocessing_file(ctx, (unsigned char *) prefix, sink);
+  } else {
+    abort_header_recordings(ctx);
+    while(ctx->include_depth > 0) {
+      free_pp_token_lexer(ctx->includes[--ctx->include_depth]);
+    }
+    status = 1;
+  }
+  error_jump = saved_jump;
+  free_pp_sink(sink);
+
+  disown_macro_table(ctx->macros, &zygote->macros, &zygote->macros_size, &zygote->arena);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  zygote->prepare_time = zygote_elapsed(&start, &end);
+  return status;
+}
+
+FILE *open_zygote_stream() {
+  FILE *fp = tmpfile();
+  if(fp == NULL) {
+    perror("tmpfile");
+    exit(1);
+  }
+  return fp;
+}
+
+void fork_zygote_child(struct zygote *zygote, struct batch_unit *units, int index, batch_function preprocess, void *data) {
+  struct zygote_child *child = &zygote->children[index];
+
+  zygote->messages[index] = open_zygote_stream();
+  zygote->rules[index] = open_zygote_stream();
+
+  // buffered output would be written by both processes
+  fflush(stdout);
+  fflush(stderr);
+
+  clock_gettime(CLOCK_MONOTONIC, &child->forked);
+  pid_t pid = fork();
+  if(pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+
+  if(pid == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &child->started);
+
+    struct skcc_context *ctx = zygote->ctx;
+    ctx->prefix = zygote->prefix;
+    error_stream = zygote->messages[index];
+    ctx->dependencies->options.stream = zygote->rules[index];
+    int status = preprocess(ctx, &units[index], data);
+
+    fflush(zygote->messages[index]);
+    fflush(zygote->rules[index]);
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+  }
+
+  child->pid = pid;
+}
+
+void copy_zygote_stream(FILE *from, FILE *to) {
+  char buffer[4096];
+  size_t size;
+  rewind(from);
+  while((size = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+    fwrite(buffer, 1, size, to);
+  }
+}
+
+// the temporary file is read into memory and closed
+void collect_zygote_stream(FILE *fp, char **text, size_t *size) {
+  FILE *out = open_memstream(text, size);
+  if(out == NULL) {
+    perror("open_memstream");
+    exit(1);
+  }
+  copy_zygote_stream(fp, out);
+  fclose(out);
+  fclose(fp);
+}
+
+int wait_zygote_child(struct zygote *zygote, struct batch_unit *units) {
+  int wstatus;
+  struct rusage usage;
+  pid_t pid;
+  do {
+    pid = wait4(-1, &wstatus, 0, &usage);
+  } while(pid < 0 && errno == EINTR);
+  if(pid < 0) {
+    perror("wait4");
+    exit(1);
+  }
+
+  for(int i = 0; i < zygote->size; i++) {
+    if(zygote->children[i].pid != pid) continue;
+
+    zygote->children[i].usage = usage;
+    if(WIFEXITED(wstatus)) {
+      units[i].status = WEXITSTATUS(wstatus);
+    } else {
+      fprintf(zygote->messages[i], "preprocessing of %s was terminated by signal %d.\n", units[i].source, WTERMSIG(wstatus));
+      units[i].status = 1;
+    }
+    collect_zygote_stream(zygote->messages[i], &units[i].messages, &units[i].messages_size);
+    collect_zygote_stream(zygote->rules[i], &units[i].rules, &units[i].rules_size);
+    zygote->messages[i] = NULL;
+    zygote->rules[i] = NULL;
+    return 1;
+  }
+
+  // not one of ours, such as a process the caller forked before
+  return 0;
+}
+
+
+void write_zygote_stats(struct zygote *zygote, FILE *fp) {
+  long startup = 0, startup_max = 0, faults = 0, rss = 0;
+  for(int i = 0; i < zygote->size; i++) {
+    struct zygote_child *child = &zygote->children[i];
+    long latency = zygote_elapsed(&child->forked, &child->started);
+    startup += latency;
+    if(latency > startup_max) startup_max = latency;
+    faults += child->usage.ru_minflt;
+    rss += child->usage.ru_maxrss;
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  fprintf(fp, "zygote: %d units, prefix %.1f ms", zygote->size, zygote->prepare_time / 1e6);
+  if(zygote->size > 0) {
+    fprintf(fp, ", startup %.1f us average, %.1f us max, %ld minor faults and %ld KB max rss per child",
+        startup / 1e3 / zygote->size, startup_max / 1e3, faults / zygote->size, rss / zygote->size);
+  }
+  fprintf(fp, ", %ld KB max rss in the zygote\n", usage.ru_maxrss);
+}
+
+// preprocess the units in children forked after the prefix header; the units are the same as those of a batch
+int run_zygote(struct skcc_context *ctx, const char *prefix, struct batch_unit *units, int size, int jobs, batch_function preprocess, void *data, FILE *stats) {
+  struct zygote zygote;
+  zygote.ctx = ctx;
+  zygote.prefix = allocate_pp_list();
+  zygote.size = size;
+
+  zygote.children = (struct zygote_child *) mmap(NULL, sizeof(struct zygote_child) * (size > 0 ? size : 1), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  zygote.messages = (FILE **) calloc(size, sizeof(FILE *));
+  zygote.rules = (FILE **) calloc(size, sizeof(FILE *));
+  if(zygote.children == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  if(zygote.messages == NULL || zygote.rules == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  memset(zygote.children, 0, sizeof(struct zygote_child) * size);
+
+  int status = 0;
+  if(prepare_zygote(&zygote, prefix) != 0) {
+    status = 1;
+  } else {
+    int next = 0, running = 0;
+    while(next < size || running > 0) {
+      if(next < size && running < jobs) {
+        fork_zygote_child(&zygote, units, next++, preprocess, data);
+        running++;
+      } else if(wait_zygote_child(&zygote, units)) {
+        running--;
+      }
+    }
+
+    status = replay_batch(units, size);
+
+    if(stats != NULL) {
+      write_zygote_stats(&zygote, stats);
+    }
+  }
+
+  release_written_pp_tokens(zygote.prefix, 0);
+  free_pp_list(zygote.prefix);
+  for(int i = 0; i < zygote.macros_size; i++) {
+    free_macro_entry(zygote.macros[i]);
+  }
+  free(zygote.macros);
+  free_macro_arena(zygote.arena);
+  clear_macro_table(ctx->macros);
+  clear_dependencies(ctx->dependencies);
+
+  munmap(zygote.children, sizeof(struct zygote_child) * (size > 0 ? size : 1));
+  free(zygote.messages);
+  free(zygote.rules);
+  return status;
+}
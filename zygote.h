@@ -0,0 +1,37 @@
+#ifndef __ZYGOTE_INCLUDE__
+#define __ZYGOTE_INCLUDE__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "error.h"
+#include "preprocess.h"
+#include "batch.h"
+
+// a child writes its start time here, so the slots live in a shared mapping
+struct zygote_child {
+  pid_t pid;
+  struct timespec forked;
+  struct timespec started;
+  struct rusage usage;
+};
+
+struct zygote {
+  struct skcc_context *ctx;
+  struct pp_list *prefix;
+  struct macro_entry **macros;
+  int macros_size;
+  struct macro_arena *arena;
+  long prepare_time;
+  struct zygote_child *children;
+  FILE **messages;
+  FILE **rules;
+  int size;
+};
+
+extern int run_zygote(struct skcc_context *ctx, const char *prefix, struct batch_unit *units, int size, int jobs, batch_function preprocess, void *data, FILE *stats);
+
+#endif